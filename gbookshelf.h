@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #include <gtk/gtk.h>
 #include <pango/pango.h>
@@ -17,11 +18,14 @@
 #include "liblist.h"
 #include "libstring.h"
 #include "libmdfa.h"
+#include "libac.h"
 #include "sqlite3.h"
 
 #define GBS_AUTHOR              "liaofei1128@gmail.com"
 #define GBS_WEBSITE             "http://www.gbookshelf.com"
 #define GBS_DATABASE_NAME       "gbs.db"
+#define GBS_SNAPSHOT_SUFFIX     ".snap" /*< the snapshot of gbs.db is gbs.db.snap */
+#define GBS_DB_VALUE_SEPARATOR  ";"     /*< separator of the flat authors, keywords, urls and customs columns */
 
 #define ARRAY_SIZE(x)           (sizeof(x) / sizeof((x)[0]))
 #define str_empty(x)            (x[0] == '\0')
@@ -30,6 +34,7 @@
 
 #define GBS_ID_SIZE                 2*1024*1024 /*< I can hold 2M books at most */
 #define GBS_HASH_SIZE               1024
+#define GBS_GENRE_DFA_BUDGET        256*1024 /*< the bytes of dfa states cached for the genre keywords */
 #define GBS_DEBUG(str, args...)     printf("[%s][%s][%d]"str, __FILE__, __FUNCTION__, __LINE__, ##args)
 
 #define gbs_print(str, args...) fprintf(stdout, str, ##args)
@@ -84,6 +89,20 @@ typedef struct gbs_genre_st {
     struct list_head node;
 } gbs_genre_t;
 
+/**
+ * the keywords of many genres combined, the plain literal ones into one
+ * Aho-Corasick automaton whose pattern id is the index into genres, and
+ * the regex ones into one dfa.
+ */
+typedef struct gbs_genre_matcher_st {
+    int n;
+    gbs_genre_t **genres;
+    ac_t *ac;
+    mdfa_t *mdfa;
+    int nmdfa;
+    int *mdfa_genres;   /* the index into genres of the pattern id of mdfa */
+} gbs_genre_matcher_t;
+
 typedef struct gbs_publisher_name_st {
     char *publisher;
     char *website;
@@ -187,6 +206,83 @@ typedef struct gbs_book_hash_st {
     struct list_head title_head;
 } gbs_book_hash_t;
 
+enum {
+    GBS_SNAPSHOT_FIELD_MD5,
+    GBS_SNAPSHOT_FIELD_ISBN,
+    GBS_SNAPSHOT_FIELD_FORMAT,
+    GBS_SNAPSHOT_FIELD_GENRE,
+    GBS_SNAPSHOT_FIELD_SUBGENRE,
+    GBS_SNAPSHOT_FIELD_LANGUAGE,
+    GBS_SNAPSHOT_FIELD_DATE,
+    GBS_SNAPSHOT_FIELD_VERSION,
+    GBS_SNAPSHOT_FIELD_SERIES,
+    GBS_SNAPSHOT_FIELD_TITLE,
+    GBS_SNAPSHOT_FIELD_SUBTITLE,
+    GBS_SNAPSHOT_FIELD_PUBLISHER,
+    GBS_SNAPSHOT_FIELD_PATH,
+    GBS_SNAPSHOT_FIELD_CONTENTS,
+    GBS_SNAPSHOT_FIELD_INTRODUCTION,
+    GBS_SNAPSHOT_FIELD_DOI,
+    GBS_SNAPSHOT_FIELD_LIBGENID,
+    GBS_SNAPSHOT_FIELD_REPOSITORY,
+    GBS_SNAPSHOT_FIELD_URLS,
+    GBS_SNAPSHOT_FIELD_AUTHORS,
+    GBS_SNAPSHOT_FIELD_KEYWORDS,
+    GBS_SNAPSHOT_FIELD_CUSTOMS,
+    GBS_SNAPSHOT_FIELD_MAX,
+};
+
+/**
+ * fixed layout book record in the mmaped snapshot, the strings are
+ * offsets in the string heap of snapshot.
+ */
+typedef struct gbs_snapshot_book_st {
+    int32_t id;
+    int32_t size;
+    int32_t pages;
+    int32_t scaned;
+    int32_t years;
+    int32_t popular;
+    int32_t quality;
+    int32_t reserved;
+    int64_t ctime;
+    int64_t mtime;
+    double price;
+    uint32_t str[GBS_SNAPSHOT_FIELD_MAX];
+} gbs_snapshot_book_t;
+
+typedef struct gbs_snapshot_st gbs_snapshot_t;
+
+/**
+ * how to merge the column of the book existing in both databases.
+ */
+enum {
+    GBS_MERGE_KEEP,         /*< keep the value of target */
+    GBS_MERGE_SOURCE,       /*< take the value of source */
+    GBS_MERGE_FILL,         /*< take the value of source if the target is empty */
+    GBS_MERGE_NEWER,        /*< take the value of source if its mtime is newer */
+    GBS_MERGE_MAX,
+};
+
+enum {
+    GBS_EXPORT_JSONL,       /*< one json object per line */
+    GBS_EXPORT_CSV,         /*< rfc4180, the first record is the header */
+};
+
+/**
+ * the operation of the row in gbs_changelog.
+ */
+enum {
+    GBS_CHANGE_INSERT = 1,
+    GBS_CHANGE_UPDATE,
+    GBS_CHANGE_DELETE,
+};
+
+/**
+ * called by db_changes for every change in order, stop if it returns < 0.
+ */
+typedef int (*gbs_change_cb_t)(sqlite3_int64 seq, char *table, sqlite3_int64 rowid, int op, void *data);
+
 typedef struct tGbsAddBookWindow {
     GtkWidget *AddBookWindow;
     GtkWidget *AddBookMainVBox;
@@ -372,11 +468,18 @@ extern unsigned int g_genre_cnt;
 extern struct list_head g_genre_list;
 extern gbs_genre_t *gbs_genre_alloc(void);
 extern void gbs_genre_free(gbs_genre_t *genre);
+extern int gbs_genre_add(char *path, char *genre, char *keywords);
 extern int gbs_genre_insert(char *path, char *genre, char *keywords);
 extern int gbs_genre_delete(char *genre, char *subgenre);
 extern int gbs_genre_default_init(void);
 extern void gbs_genre_dump(void);
 extern int gbs_genre_foreach_write_db(sqlite3 *db, int (*insert)(sqlite3 *db, gbs_genre_t *gen));
+extern int gbs_genre_literal(char *keywords);
+extern mdfa_t *gbs_genre_pattern(char *keywords);
+extern gbs_genre_matcher_t *gbs_genre_matcher_new(struct list_head *list);
+extern void gbs_genre_matcher_free(gbs_genre_matcher_t *matcher);
+extern gbs_genre_t *gbs_genre_matcher_match(gbs_genre_matcher_t *matcher, char *text, int len);
+extern gbs_genre_t *gbs_genre_classify(char *name);
 extern int gbs_genre_init(void);
 extern void gbs_genre_fini(void);
 /* gbs_genre_ui.c */
@@ -442,7 +545,82 @@ extern int db_language_insert(char *language, char *description);
 extern int db_publisher_insert(char *publisher, char *website, char *description);
 extern int db_genre_insert(char *path, char *genre, char *keywords);
 extern int db_book_insert(gbs_book_t *book);
+extern int db_format_delete(char *format);
+extern int db_language_delete(char *language);
+extern int db_publisher_delete(char *publisher);
+extern int db_genre_delete(char *path, char *genre);
+extern int db_begin(void);
+extern int db_commit(void);
+extern int db_savepoint(char *name);
+extern int db_release(char *name, int rollback);
 extern int db_close(void);
 extern int gbs_db_read(char *filename);
+extern sqlite3 *g_db_ctx;
+extern char *g_db_book_columns[];
+extern int db_create_schema(sqlite3 *db, int compact);
+extern int db_create_dict_tables(sqlite3 *db);
+extern int db_create_tables(sqlite3 *db);
+extern int db_open_file(char *filename, sqlite3 **db);
+extern int db_child_rebuild(sqlite3 *db, char *cond);
+extern int db_book_reindex(char *filename);
+extern int db_merge(char *filename, char *source, char *rules);
+extern int db_list_by_author(char *filename, char *author, char *displays);
+extern int db_list_by_keyword(char *filename, char *keyword, char *displays);
+extern int db_list_by_url(char *filename, char *url, char *displays);
+extern int db_list_by_text(char *filename, char *match, char *displays);
+extern int db_is_column_name(char *name);
+extern int db_list_page(char *filename, char *orders, char *displays, int limit, int after);
+/* gbs_dbwriter.c */
+typedef void (*gbs_dbw_done_t)(int ret, void *data);
+extern int gbs_dbw_start(char *filename);
+extern void gbs_dbw_stop(void);
+extern int gbs_dbw_flush(void);
+extern int gbs_dbw_format_insert(char *format, char *description, gbs_dbw_done_t done, void *data);
+extern int gbs_dbw_format_delete(char *format, gbs_dbw_done_t done, void *data);
+extern int gbs_dbw_language_insert(char *language, char *description, gbs_dbw_done_t done, void *data);
+extern int gbs_dbw_language_delete(char *language, gbs_dbw_done_t done, void *data);
+extern int gbs_dbw_publisher_insert(char *publisher, char *website, char *description, gbs_dbw_done_t done, void *data);
+extern int gbs_dbw_publisher_delete(char *publisher, gbs_dbw_done_t done, void *data);
+extern int gbs_dbw_genre_insert(char *path, char *genre, char *keywords, gbs_dbw_done_t done, void *data);
+extern int gbs_dbw_genre_delete(char *path, char *genre, gbs_dbw_done_t done, void *data);
+extern int gbs_dbw_book_insert(gbs_book_t *book, gbs_dbw_done_t done, void *data);
+/* gbs_compact.c */
+extern int db_is_compact(sqlite3 *db);
+extern int db_compact_attach(sqlite3 *db);
+extern sqlite3_int64 db_book_last_id(sqlite3 *db);
+extern int db_compact(char *filename, char *output);
+extern int db_expand(char *filename, char *output);
+/* gbs_function.c */
+extern int db_functions_attach(sqlite3 *db);
+/* gbs_rename.c */
+extern int uniform(char **input);
+/* gbs_changelog.c */
+extern int db_changelog_create(sqlite3 *db, char *book_table);
+extern int db_changelog_attach(sqlite3 *db, char *schema);
+extern sqlite3_int64 db_changes_last(sqlite3 *db);
+extern sqlite3_int64 db_changes_last_of(sqlite3 *db, char *table);
+extern sqlite3_int64 db_changes(sqlite3 *db, sqlite3_int64 since, gbs_change_cb_t cb, void *data);
+extern int db_changes_truncate(sqlite3 *db, sqlite3_int64 upto);
+/* gbs_shard.c */
+extern int db_is_sharded(sqlite3 *db);
+extern int db_shard_count(sqlite3 *db);
+extern int db_shard_attach(sqlite3 *db, char *filename);
+extern mbs_t db_shard_prefix(sqlite3 *db, gbs_book_t *book);
+extern int db_shard(char *filename, char *output, char *key, int n);
+/* gbs_maint.c */
+extern int db_backup(char *filename, char *output, int pages);
+extern int db_vacuum(char *filename, int pages, int seconds);
+/* gbs_export.c */
+extern int gbs_export(char *filename, char *table, int format, char *output);
+extern int gbs_import(char *filename, char *table, int format, char *input);
+/* gbs_snapshot.c */
+extern int gbs_snapshot_write(char *dbfile, char *snapfile);
+extern gbs_snapshot_t *gbs_snapshot_open(char *dbfile, char *snapfile, int verify);
+extern void gbs_snapshot_close(gbs_snapshot_t *snap);
+extern int gbs_snapshot_count(gbs_snapshot_t *snap);
+extern gbs_snapshot_book_t *gbs_snapshot_book(gbs_snapshot_t *snap, int idx);
+extern gbs_snapshot_book_t *gbs_snapshot_book_by_title(gbs_snapshot_t *snap, int idx);
+extern char *gbs_snapshot_str(gbs_snapshot_t *snap, gbs_snapshot_book_t *book, int field);
+extern gbs_snapshot_book_t *gbs_snapshot_find_md5(gbs_snapshot_t *snap, char *md5);
 
 #endif
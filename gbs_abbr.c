@@ -134,15 +134,12 @@ void tree_insert_file(tree_node_t *tree, char *filename)
 tree_node_t *tree_search(tree_node_t *tree, char *word)
 {
     int cmp;
-    char *lowercase;
     tree_node_t *q;
 
-    lowercase = strdup(word);
-    strtolower(lowercase);
-
+    /* the keys are lowercase, so it's the order of strcmp on the lowercase word */
     q = tree;
     while (q) {
-        cmp = strcmp(lowercase, q->lowercase);
+        cmp = strcasecmp(word, q->lowercase);
         if (cmp < 0)
             q = q->left;
         else if (cmp > 0)
@@ -151,7 +148,6 @@ tree_node_t *tree_search(tree_node_t *tree, char *word)
             break;
     }
 
-    free(lowercase);
     return q;
 }
 
@@ -188,6 +184,10 @@ static tree_node_t *abbrtree = NULL;
 
 int dict_init(void)
 {
+    if (abbrtree) {
+        return 0;
+    }
+
     abbrtree = tree_create("and", "and", "don't capitalize it");
 
     tree_insert_file(abbrtree, "abbr.txt");
@@ -228,6 +228,7 @@ void dict_dump(void)
 void dict_fini(void)
 {
     tree_destroy(abbrtree);
+    abbrtree = NULL;
 }
 
 char *dict_search(char *word)
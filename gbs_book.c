@@ -300,8 +300,60 @@ void gbs_book_destroy(gbs_book_t * book)
     return;
 }
 
+/**
+ * deep copy the fields of src into the zeroed dst, dst isn't linked into
+ * the catalog.
+ */
 int gbs_book_copy(gbs_book_t * dst, gbs_book_t * src)
 {
+    int i, j;
+    mbs_t *sfield, *dfield;
+    dpa_t *sdpa, *ddpa;
+    static const size_t fields[] = {
+        offsetof(gbs_book_t, md5), offsetof(gbs_book_t, isbn), offsetof(gbs_book_t, format),
+        offsetof(gbs_book_t, genre), offsetof(gbs_book_t, subgenre), offsetof(gbs_book_t, language),
+        offsetof(gbs_book_t, date), offsetof(gbs_book_t, version), offsetof(gbs_book_t, series),
+        offsetof(gbs_book_t, title), offsetof(gbs_book_t, subtitle), offsetof(gbs_book_t, publisher),
+        offsetof(gbs_book_t, path), offsetof(gbs_book_t, contents), offsetof(gbs_book_t, introduction),
+        offsetof(gbs_book_t, doi), offsetof(gbs_book_t, libgenid), offsetof(gbs_book_t, repository),
+        offsetof(gbs_book_t, urls), offsetof(gbs_book_t, authors), offsetof(gbs_book_t, keywords),
+        offsetof(gbs_book_t, customs),
+    };
+    static const size_t dpas[] = {
+        offsetof(gbs_book_t, _urls), offsetof(gbs_book_t, _authors),
+        offsetof(gbs_book_t, _keywords), offsetof(gbs_book_t, _customs),
+    };
+
+    dst->id = src->id;
+    dst->size = src->size;
+    dst->pages = src->pages;
+    dst->scaned = src->scaned;
+    dst->years = src->years;
+    dst->popular = src->popular;
+    dst->quality = src->quality;
+    dst->ctime = src->ctime;
+    dst->mtime = src->mtime;
+    dst->price = src->price;
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        sfield = (mbs_t *)((char *)src + fields[i]);
+        dfield = (mbs_t *)((char *)dst + fields[i]);
+        if (*sfield) {
+            *dfield = mbsdup(*sfield);
+            if (*dfield == NULL)
+                return -GBS_ERROR_NOMEM;
+        }
+    }
+
+    for (i = 0; i < sizeof(dpas) / sizeof(dpas[0]); i++) {
+        sdpa = (dpa_t *)((char *)src + dpas[i]);
+        ddpa = (dpa_t *)((char *)dst + dpas[i]);
+        for (j = 0; j < sdpa->used; j++) {
+            if (dpa_push(ddpa, mbsnew(sdpa->array[j])) < 0)
+                return -GBS_ERROR_NOMEM;
+        }
+    }
+
     return 0;
 }
 
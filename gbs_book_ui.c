@@ -671,6 +671,26 @@ void gbs_gtk_book_add_insert_customs(GtkTreeModel *model, gbs_book_t *book)
     }
 }
 
+/**
+ * look the book up again by md5, the catalog may be reloaded meanwhile.
+ */
+static void gbs_gtk_book_add_insert_done(int ret, void *data)
+{
+    gbs_book_t user;
+    gbs_book_t *book;
+
+    memset(&user, 0, sizeof(user));
+    user.md5 = (mbs_t)data;
+    if (ret >= 0) {
+        book = gbs_book_table_find(&user);
+        if (book) {
+            book->id = ret;
+        }
+    }
+
+    mbsfree(user.md5);
+}
+
 int gbs_gtk_book_add_insert(GtkWidget * widget, gpointer data)
 {
     int ret;
@@ -721,6 +741,14 @@ int gbs_gtk_book_add_insert(GtkWidget * widget, gpointer data)
     gbs_book_set_isbn(nbook, isbn);
     gbs_book_set_genre(nbook, genre);
     gbs_book_set_subgenre(nbook, subgenre);
+    if (genre == NULL || str_empty(genre)) {
+        /* not chosen, guess it by the title with the keywords of genres */
+        gbs_genre_t *gen = gbs_genre_classify(title);
+        if (gen) {
+            gbs_book_set_genre(nbook, gen->path);
+            gbs_book_set_subgenre(nbook, gen->genre);
+        }
+    }
     gbs_book_set_format(nbook, format);
     gbs_book_set_version(nbook, version);
     gbs_book_set_language(nbook, language);
@@ -764,6 +792,8 @@ int gbs_gtk_book_add_insert(GtkWidget * widget, gpointer data)
         return ret;
     }
 
+    /* the writer inserts a copy, the id is set when it's committed */
+    gbs_dbw_book_insert(nbook, gbs_gtk_book_add_insert_done, mbsdup(nbook->md5));
     gbs_gtk_booklist_update_model_first_page();
     g_modify_flag = 1;
     return 0;
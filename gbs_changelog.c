@@ -0,0 +1,232 @@
+#include "gbookshelf.h"
+
+/**
+ * gbs change feed, the triggers append (seq, table, rowid, op) to
+ * gbs_changelog for every row changed in the catalog tables, by us or by
+ * any other process, so a cache over gbs.db can apply only the changes
+ * since the last seq it has seen instead of reloading everything.
+ *
+ * seq is AUTOINCREMENT, it's never reused even after the log is truncated.
+ *
+ * the books of a sharded database are in the shards, every shard logs its
+ * own changes, and db_shard_attach adds the temporary triggers which log
+ * them into the gbs_changelog of main too, so the feed of main covers the
+ * whole catalog for the writers which open it by db_open_file.
+ */
+
+static char *g_db_changelog_tables[] = {
+    "gbs_book", "gbs_genre", "gbs_publisher", "gbs_format", "gbs_language",
+    NULL
+};
+
+/* the triggers of the table which log the changes of source as the ones of table */
+static void db_changelog_triggers(mbs_t *sql, char *create, char *name, char *source, char *table)
+{
+    mbscatfmt(sql, "CREATE %s if not exists %s_changelog_insert AFTER INSERT ON %s BEGIN "
+            "INSERT INTO gbs_changelog(tbl, row_id, op) VALUES ('%s', new.id, %d); END;",
+            create, name, source, table, GBS_CHANGE_INSERT);
+    mbscatfmt(sql, "CREATE %s if not exists %s_changelog_update AFTER UPDATE ON %s BEGIN "
+            "INSERT INTO gbs_changelog(tbl, row_id, op) VALUES ('%s', new.id, %d); END;",
+            create, name, source, table, GBS_CHANGE_UPDATE);
+    mbscatfmt(sql, "CREATE %s if not exists %s_changelog_delete AFTER DELETE ON %s BEGIN "
+            "INSERT INTO gbs_changelog(tbl, row_id, op) VALUES ('%s', old.id, %d); END;",
+            create, name, source, table, GBS_CHANGE_DELETE);
+}
+
+/**
+ * create the gbs_changelog table and the triggers of the catalog tables
+ * which are not exist yet. The changes of gbs_book are logged from the
+ * book_table, gbs_book or gbs_book_compact, or not at all if it's NULL.
+ */
+int db_changelog_create(sqlite3 *db, char *book_table)
+{
+    int i;
+    int ret = 0;
+    char *msg = NULL;
+    char *source;
+    mbs_t sql = NULL;
+
+    mbscpy(&sql, "CREATE TABLE if not exists gbs_changelog (seq INTEGER PRIMARY KEY AUTOINCREMENT, "
+            "tbl TEXT NOT NULL, row_id INTEGER NOT NULL, op INT NOT NULL);");
+    mbscat(&sql, "CREATE INDEX if not exists gbs_changelog_tbl ON gbs_changelog(tbl, seq);");
+
+    for (i = 0; g_db_changelog_tables[i]; i++) {
+        source = g_db_changelog_tables[i];
+        if (!strcmp(source, "gbs_book")) {
+            if (book_table == NULL) {
+                continue;
+            }
+            source = book_table;
+        }
+
+        db_changelog_triggers(&sql, "TRIGGER", g_db_changelog_tables[i], source, g_db_changelog_tables[i]);
+    }
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("create changelog failed, msg %s\n", msg);
+        sqlite3_free(msg);
+        ret = -GBS_ERROR_DB;
+    }
+
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * log the changes of the books in the attached shard schema into the
+ * gbs_changelog of main, by the temporary triggers of this connection,
+ * the unqualified gbs_changelog in them is the one of main.
+ */
+int db_changelog_attach(sqlite3 *db, char *schema)
+{
+    int ret = 0;
+    char *msg = NULL;
+    mbs_t sql = NULL;
+    mbs_t name = NULL;
+    mbs_t source = NULL;
+
+    name = mbsnewfmt("%s_gbs_book", schema);
+    source = mbsnewfmt("%s.gbs_book", schema);
+    db_changelog_triggers(&sql, "TEMP TRIGGER", name, source, "gbs_book");
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("attach changelog of %s failed, msg %s\n", schema, msg);
+        sqlite3_free(msg);
+        ret = -GBS_ERROR_DB;
+    }
+
+    mbsfree(sql);
+    mbsfree(name);
+    mbsfree(source);
+    return ret;
+}
+
+static sqlite3_int64 db_changes_query(sqlite3 *db, char *sql, sqlite3_int64 arg)
+{
+    sqlite3_int64 value = 0;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        gbs_error("sqlite3_prepare_v2: %s failed, msg %s\n", sql, sqlite3_errmsg(db));
+        return -GBS_ERROR_DB;
+    }
+
+    sqlite3_bind_int64(stmt, 1, arg);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+/**
+ * the seq of the latest change, a cache starts to follow the feed from it
+ * after the full load.
+ */
+sqlite3_int64 db_changes_last(sqlite3 *db)
+{
+    return db_changes_query(db, "SELECT seq FROM sqlite_sequence WHERE name = 'gbs_changelog' AND seq > ?;", 0);
+}
+
+/**
+ * the seq of the latest change of the table, 0 if it has no change logged.
+ */
+sqlite3_int64 db_changes_last_of(sqlite3 *db, char *table)
+{
+    sqlite3_int64 seq = 0;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, "SELECT seq FROM gbs_changelog WHERE tbl = ? ORDER BY seq DESC LIMIT 1;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+        return -GBS_ERROR_DB;
+    }
+
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        seq = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    return seq;
+}
+
+/**
+ * call cb for every change after since in order, and return the seq of the
+ * last change passed to cb, or since if nothing changed.
+ *
+ * if the changes after since were truncated already, return
+ * -GBS_ERROR_NOT_EXIST, the caller has to reload everything.
+ */
+sqlite3_int64 db_changes(sqlite3 *db, sqlite3_int64 since, gbs_change_cb_t cb, void *data)
+{
+    int rc;
+    sqlite3_int64 seq = since;
+    sqlite3_int64 last;
+    sqlite3_int64 first;
+    sqlite3_stmt *stmt = NULL;
+
+    last = db_changes_last(db);
+    if (last < 0) {
+        return last;
+    }
+
+    if (last <= since) {
+        return since;
+    }
+
+    /* the seq has no hole except the truncated ones */
+    first = db_changes_query(db, "SELECT min(seq) FROM gbs_changelog WHERE seq > ?;", since);
+    if (first < 0) {
+        return first;
+    }
+    if (first != since + 1) {
+        gbs_debug("changes after %lld were truncated\n", (long long)since);
+        return -GBS_ERROR_NOT_EXIST;
+    }
+
+    if (sqlite3_prepare_v2(db, "SELECT seq, tbl, row_id, op FROM gbs_changelog WHERE seq > ? ORDER BY seq;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+        gbs_error("sqlite3_prepare_v2 failed, msg %s\n", sqlite3_errmsg(db));
+        return -GBS_ERROR_DB;
+    }
+
+    sqlite3_bind_int64(stmt, 1, since);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (cb(sqlite3_column_int64(stmt, 0), (char *)sqlite3_column_text(stmt, 1),
+                    sqlite3_column_int64(stmt, 2), sqlite3_column_int(stmt, 3), data) < 0) {
+            break;
+        }
+        seq = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        gbs_error("read changes failed, msg %s\n", sqlite3_errmsg(db));
+        return -GBS_ERROR_DB;
+    }
+
+    return seq;
+}
+
+/**
+ * drop the changes up to upto, which all the consumers have applied.
+ */
+int db_changes_truncate(sqlite3 *db, sqlite3_int64 upto)
+{
+    int ret = 0;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, "DELETE FROM gbs_changelog WHERE seq <= ?;", -1, &stmt, NULL) != SQLITE_OK) {
+        gbs_error("sqlite3_prepare_v2 failed, msg %s\n", sqlite3_errmsg(db));
+        return -GBS_ERROR_DB;
+    }
+
+    sqlite3_bind_int64(stmt, 1, upto);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        gbs_error("truncate changes failed, msg %s\n", sqlite3_errmsg(db));
+        ret = -GBS_ERROR_DB;
+    }
+
+    sqlite3_finalize(stmt);
+    return ret;
+}
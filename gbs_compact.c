@@ -0,0 +1,475 @@
+#include "gbookshelf.h"
+#include "liblz.h"
+
+/**
+ * gbs compact schema, the gbs_book is stored in gbs_book_compact with:
+ *
+ * md5 as BLOB(16) instead of 32 hex chars,
+ * date as the day number since 1970-01-01 instead of "YYYY-MM-DD",
+ * contents and introduction compressed by liblz.
+ *
+ * the values which can't be converted without loss are kept as they are,
+ * so the conversion is always reversible. Every connection opened by
+ * db_open_file gets a temporary gbs_book view which decodes the columns,
+ * with the INSTEAD OF triggers which encode them, so the compact database
+ * is used in the same way as the normal one.
+ */
+
+#define GBS_LZ_MIN          64      /*< the shorter text is not compressed */
+#define GBS_LZ_MAGIC        0x01
+#define GBS_LZ_HEADER       5       /*< magic, raw length in little endian */
+
+typedef struct db_compact_column_st {
+    char *column;
+    char *encode;
+    char *decode;
+} db_compact_column_t;
+
+static db_compact_column_t g_db_compact_columns[] = {
+    { "md5", "gbs_md5bin", "gbs_md5hex" },
+    { "date", "gbs_date2day", "gbs_day2date" },
+    { "contents", "gbs_lz", "gbs_unlz" },
+    { "introduction", "gbs_lz", "gbs_unlz" },
+
+    { NULL, NULL, NULL },
+};
+
+static void gbs_lz_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    int n;
+    int len;
+    uint8_t *buf;
+    const char *text;
+
+    len = sqlite3_value_bytes(argv[0]);
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || len < GBS_LZ_MIN) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    text = (const char *)sqlite3_value_text(argv[0]);
+    buf = malloc(GBS_LZ_HEADER + LZ_BOUND(len));
+    if (buf == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    n = lz_compress(text, len, buf + GBS_LZ_HEADER, LZ_BOUND(len));
+    if (n < 0 || GBS_LZ_HEADER + n >= len) {
+        free(buf);
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    buf[0] = GBS_LZ_MAGIC;
+    buf[1] = len & 0xff;
+    buf[2] = (len >> 8) & 0xff;
+    buf[3] = (len >> 16) & 0xff;
+    buf[4] = (len >> 24) & 0xff;
+    sqlite3_result_blob(ctx, buf, GBS_LZ_HEADER + n, free);
+}
+
+static void gbs_unlz_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    int n;
+    int len;
+    int raw;
+    char *buf;
+    const uint8_t *blob;
+
+    len = sqlite3_value_bytes(argv[0]);
+    blob = sqlite3_value_blob(argv[0]);
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || len < GBS_LZ_HEADER || blob[0] != GBS_LZ_MAGIC) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    raw = blob[1] | (blob[2] << 8) | (blob[3] << 16) | ((uint32_t)blob[4] << 24);
+    /* the length is from the data, don't trust it before the malloc */
+    if (raw < 0 || raw > sqlite3_limit(sqlite3_context_db_handle(ctx), SQLITE_LIMIT_LENGTH, -1)) {
+        sqlite3_result_error(ctx, "gbs_unlz: corrupted length", -1);
+        return;
+    }
+
+    buf = malloc(raw + 1);
+    if (buf == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    n = lz_decompress(blob + GBS_LZ_HEADER, len - GBS_LZ_HEADER, buf, raw);
+    if (n != raw) {
+        free(buf);
+        sqlite3_result_error(ctx, "gbs_unlz: corrupted data", -1);
+        return;
+    }
+
+    buf[raw] = 0;
+    sqlite3_result_text(ctx, buf, raw, free);
+}
+
+static void gbs_md5bin_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    int i;
+    int hi, lo;
+    uint8_t digest[16];
+    const char *text;
+
+    text = (const char *)sqlite3_value_text(argv[0]);
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || sqlite3_value_bytes(argv[0]) != 32) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    /* only the lowercase hex comes back the same from gbs_md5hex */
+    for (i = 0; i < 16; i++) {
+        hi = text[2 * i];
+        lo = text[2 * i + 1];
+        if (!((hi >= '0' && hi <= '9') || (hi >= 'a' && hi <= 'f'))
+                || !((lo >= '0' && lo <= '9') || (lo >= 'a' && lo <= 'f'))) {
+            sqlite3_result_value(ctx, argv[0]);
+            return;
+        }
+        hi = hi <= '9' ? hi - '0' : hi - 'a' + 10;
+        lo = lo <= '9' ? lo - '0' : lo - 'a' + 10;
+        digest[i] = (hi << 4) | lo;
+    }
+
+    sqlite3_result_blob(ctx, digest, sizeof(digest), SQLITE_TRANSIENT);
+}
+
+static void gbs_md5hex_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    int i;
+    char hex[33];
+    const uint8_t *blob;
+    static const char *digits = "0123456789abcdef";
+
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || sqlite3_value_bytes(argv[0]) != 16) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    blob = sqlite3_value_blob(argv[0]);
+    for (i = 0; i < 16; i++) {
+        hex[2 * i] = digits[blob[i] >> 4];
+        hex[2 * i + 1] = digits[blob[i] & 15];
+    }
+    hex[32] = 0;
+    sqlite3_result_text(ctx, hex, 32, SQLITE_TRANSIENT);
+}
+
+/**
+ * the days between 1970-01-01 and the civil date, and the reverse.
+ */
+static int days_from_civil(int y, int m, int d)
+{
+    int era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void civil_from_days(int z, int *y, int *m, int *d)
+{
+    int era, doe, yoe, doy, mp;
+
+    z += 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp + (mp < 10 ? 3 : -9);
+    *y = yoe + era * 400 + (*m <= 2);
+}
+
+static void gbs_date2day_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    int y, m, d;
+    int day;
+    char back[16];
+    const char *text;
+
+    text = (const char *)sqlite3_value_text(argv[0]);
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || sqlite3_value_bytes(argv[0]) != 10
+            || sscanf(text, "%4d-%2d-%2d", &y, &m, &d) != 3) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    /* the invalid date like 2010-02-30 doesn't come back the same */
+    day = days_from_civil(y, m, d);
+    civil_from_days(day, &y, &m, &d);
+    snprintf(back, sizeof(back), "%04d-%02d-%02d", y, m, d);
+    if (strcmp(back, text)) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    sqlite3_result_int(ctx, day);
+}
+
+static void gbs_day2date_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    int y, m, d;
+    char date[16];
+
+    if (sqlite3_value_type(argv[0]) != SQLITE_INTEGER) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    civil_from_days(sqlite3_value_int(argv[0]), &y, &m, &d);
+    snprintf(date, sizeof(date), "%04d-%02d-%02d", y, m, d);
+    sqlite3_result_text(ctx, date, -1, SQLITE_TRANSIENT);
+}
+
+static int db_compact_functions(sqlite3 *db)
+{
+    int i;
+    static struct {
+        char *name;
+        void (*func)(sqlite3_context *, int, sqlite3_value **);
+    } funcs[] = {
+        { "gbs_lz", gbs_lz_func },
+        { "gbs_unlz", gbs_unlz_func },
+        { "gbs_md5bin", gbs_md5bin_func },
+        { "gbs_md5hex", gbs_md5hex_func },
+        { "gbs_date2day", gbs_date2day_func },
+        { "gbs_day2date", gbs_day2date_func },
+    };
+
+    for (i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
+        if (sqlite3_create_function(db, funcs[i].name, 1, SQLITE_UTF8, NULL, funcs[i].func, NULL, NULL) != SQLITE_OK) {
+            gbs_error("create function %s failed, msg %s\n", funcs[i].name, sqlite3_errmsg(db));
+            return -GBS_ERROR_DB;
+        }
+    }
+
+    return 0;
+}
+
+static db_compact_column_t *db_compact_column(char *column)
+{
+    db_compact_column_t *cc;
+
+    for (cc = g_db_compact_columns; cc->column; cc++) {
+        if (!strcmp(cc->column, column)) {
+            return cc;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * append the column list, every column is wrapped by the encode or decode
+ * function if it has one, eg. "gbs_md5bin(new.md5), new.title, ...".
+ */
+static void db_compact_columns(mbs_t *sql, char *prefix, int encode, int alias)
+{
+    int i;
+    char *col;
+    db_compact_column_t *cc;
+
+    for (i = 0; g_db_book_columns[i]; i++) {
+        col = g_db_book_columns[i];
+        cc = db_compact_column(col);
+        mbscat(sql, i ? ", " : "");
+        if (cc == NULL) {
+            mbscatfmt(sql, "%s%s", prefix, col);
+        } else {
+            mbscatfmt(sql, "%s(%s%s)", encode ? cc->encode : cc->decode, prefix, col);
+            if (alias) {
+                mbscatfmt(sql, " AS %s", col);
+            }
+        }
+    }
+}
+
+int db_is_compact(sqlite3 *db)
+{
+    int ret = 0;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM main.sqlite_master WHERE type = 'table' AND name = 'gbs_book_compact';",
+                -1, &stmt, NULL) == SQLITE_OK) {
+        ret = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/**
+ * register the codec functions, and create the temporary gbs_book view with
+ * its INSTEAD OF triggers if the database is compact.
+ */
+int db_compact_attach(sqlite3 *db)
+{
+    int i;
+    int ret;
+    char *msg = NULL;
+    mbs_t sql = NULL;
+
+    ret = db_compact_functions(db);
+    if (ret < 0 || !db_is_compact(db)) {
+        return ret;
+    }
+
+    mbscpy(&sql, "CREATE TEMP VIEW IF NOT EXISTS gbs_book AS SELECT id, ");
+    db_compact_columns(&sql, "", 0, 1);
+    mbscat(&sql, " FROM main.gbs_book_compact;");
+
+    mbscat(&sql, "CREATE TEMP TRIGGER IF NOT EXISTS gbs_book_insert INSTEAD OF INSERT ON gbs_book BEGIN "
+            "INSERT INTO gbs_book_compact(id, ");
+    for (i = 0; g_db_book_columns[i]; i++) {
+        mbscatfmt(&sql, "%s%s", i ? ", " : "", g_db_book_columns[i]);
+    }
+    mbscat(&sql, ") VALUES (new.id, ");
+    db_compact_columns(&sql, "new.", 1, 0);
+    mbscat(&sql, "); END;");
+
+    mbscat(&sql, "CREATE TEMP TRIGGER IF NOT EXISTS gbs_book_update INSTEAD OF UPDATE ON gbs_book BEGIN "
+            "UPDATE gbs_book_compact SET ");
+    for (i = 0; g_db_book_columns[i]; i++) {
+        db_compact_column_t *cc = db_compact_column(g_db_book_columns[i]);
+        mbscatfmt(&sql, "%s%s = ", i ? ", " : "", g_db_book_columns[i]);
+        if (cc) {
+            mbscatfmt(&sql, "%s(new.%s)", cc->encode, g_db_book_columns[i]);
+        } else {
+            mbscatfmt(&sql, "new.%s", g_db_book_columns[i]);
+        }
+    }
+    mbscat(&sql, " WHERE id = old.id; END;");
+
+    mbscat(&sql, "CREATE TEMP TRIGGER IF NOT EXISTS gbs_book_delete INSTEAD OF DELETE ON gbs_book BEGIN "
+            "DELETE FROM gbs_book_compact WHERE id = old.id; END;");
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("create the compact view failed, msg %s\n", msg);
+        sqlite3_free(msg);
+        ret = -GBS_ERROR_DB;
+    }
+
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * the id of the book inserted at last, the last_insert_rowid is restored
+ * once the INSTEAD OF trigger of compact view ends, so it's useless there.
+ */
+sqlite3_int64 db_book_last_id(sqlite3 *db)
+{
+    sqlite3_int64 id = 0;
+    sqlite3_stmt *stmt = NULL;
+
+    if (!db_is_compact(db)) {
+        return sqlite3_last_insert_rowid(db);
+    }
+
+    if (sqlite3_prepare_v2(db, "SELECT seq FROM sqlite_sequence WHERE name = 'gbs_book_compact';",
+                -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        id = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    return id;
+}
+
+/**
+ * convert the gbs database between the normal and the compact schema, the
+ * output must not exist. The ids are kept, so the child tables and the full
+ * text index are copied as they are.
+ */
+static int db_convert(char *filename, char *output, int compact)
+{
+    int i;
+    int ret;
+    sqlite3 *db;
+    mbs_t sql = NULL;
+    mbs_t src = NULL;
+    char *msg = NULL;
+    static char *copies[] = {
+        "gbs_format", "gbs_language", "gbs_publisher", "gbs_genre",
+        "book_author", "book_keyword", "book_url", "book_custom",
+        NULL
+    };
+
+    if (access(output, F_OK) == 0) {
+        gbs_error("%s already exists\n", output);
+        return -GBS_ERROR_EXIST;
+    }
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+    ret = db_is_compact(db);
+    sqlite3_close(db);
+    if (ret == compact) {
+        gbs_error("%s is already %s\n", filename, compact ? "compact" : "expanded");
+        return -GBS_ERROR_INVAL;
+    }
+
+    if (db_open_file(output, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", output);
+        return -GBS_ERROR_DB;
+    }
+
+    ret = db_create_schema(db, compact);
+    if (ret < 0) {
+        goto out;
+    }
+
+    src = mbsnewescapesqlite(filename);
+    mbscpyfmt(&sql, "ATTACH DATABASE '%s' AS src; BEGIN;", src);
+    mbsfree(src);
+
+    for (i = 0; copies[i]; i++) {
+        mbscatfmt(&sql, "INSERT INTO main.%s SELECT * FROM src.%s;", copies[i], copies[i]);
+    }
+
+    /* the fts is filled by the insert trigger of the target */
+    mbscatfmt(&sql, "INSERT INTO main.%s(id, ", compact ? "gbs_book_compact" : "gbs_book");
+    for (i = 0; g_db_book_columns[i]; i++) {
+        mbscatfmt(&sql, "%s%s", i ? ", " : "", g_db_book_columns[i]);
+    }
+    mbscat(&sql, ") SELECT id, ");
+    db_compact_columns(&sql, "", compact, 0);
+    mbscatfmt(&sql, " FROM src.%s ORDER BY id;", compact ? "gbs_book" : "gbs_book_compact");
+    mbscat(&sql, "COMMIT;");
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("convert %s into %s failed, msg %s\n", filename, output, msg);
+        sqlite3_free(msg);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        ret = -GBS_ERROR_DB;
+    }
+    sqlite3_exec(db, "DETACH DATABASE src;", NULL, NULL, NULL);
+
+out:
+    sqlite3_close(db);
+    mbsfree(sql);
+    if (ret < 0) {
+        unlink(output);
+    }
+    return ret;
+}
+
+int db_compact(char *filename, char *output)
+{
+    return db_convert(filename, output, 1);
+}
+
+int db_expand(char *filename, char *output)
+{
+    return db_convert(filename, output, 0);
+}
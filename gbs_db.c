@@ -1,56 +1,136 @@
 #include "gbookshelf.h"
 
+#include <ctype.h>
+
 sqlite3 *g_db_ctx = NULL;
 
+/* the tables shared by the normal and the compact schema */
 static char *g_sql_tables[] = {
-    "CREATE TABLE if not exists gbs_format (id INTEGER AUTOINCREMENT, format TEXT NOT NULL, description TEXT, PRIMARY KEY(id))",
-    "CREATE TABLE if not exists gbs_language (id INTEGER AUTOINCREMENT, language TEXT NOT NULL, description TEXT, PRIMARY KEY(id))",
-    "CREATE TABLE if not exists gbs_publisher (id INTEGER AUTOINCREMENT, publisher TEXT NOT NULL, website TEXT, description TEXT, PRIMARY KEY(id))",
-    "CREATE TABLE if not exists gbs_genre (id INTEGER AUTOINCREMENT, path TEXT NOT NULL, genre TEXT NOT NULL, keywords TEXT NOT NULL, PRIMARY KEY(id))",
-    "CREATE TABLE if not exists gbs_book (id INTEGER AUTOINCREMENT, md5 TEXT NOT NULL, title TEXT NOT NULL, subtitle TEXT, "
+    "CREATE TABLE if not exists gbs_format (id INTEGER PRIMARY KEY AUTOINCREMENT, format TEXT NOT NULL, description TEXT)",
+    "CREATE TABLE if not exists gbs_language (id INTEGER PRIMARY KEY AUTOINCREMENT, language TEXT NOT NULL, description TEXT)",
+    "CREATE TABLE if not exists gbs_publisher (id INTEGER PRIMARY KEY AUTOINCREMENT, publisher TEXT NOT NULL, website TEXT, description TEXT)",
+    "CREATE TABLE if not exists gbs_genre (id INTEGER PRIMARY KEY AUTOINCREMENT, path TEXT NOT NULL, genre TEXT NOT NULL, keywords TEXT NOT NULL)",
+
+    /* the multi-value columns of gbs_book, one row per value */
+    "CREATE TABLE if not exists book_author (book_id INTEGER NOT NULL, author TEXT NOT NULL)",
+    "CREATE TABLE if not exists book_keyword (book_id INTEGER NOT NULL, keyword TEXT NOT NULL)",
+    "CREATE TABLE if not exists book_url (book_id INTEGER NOT NULL, url TEXT NOT NULL)",
+    "CREATE TABLE if not exists book_custom (book_id INTEGER NOT NULL, custom TEXT NOT NULL)",
+    "CREATE INDEX if not exists book_author_value ON book_author(author)",
+    "CREATE INDEX if not exists book_author_book ON book_author(book_id)",
+    "CREATE INDEX if not exists book_keyword_value ON book_keyword(keyword)",
+    "CREATE INDEX if not exists book_keyword_book ON book_keyword(book_id)",
+    "CREATE INDEX if not exists book_url_value ON book_url(url)",
+    "CREATE INDEX if not exists book_url_book ON book_url(book_id)",
+    "CREATE INDEX if not exists book_custom_value ON book_custom(custom)",
+    "CREATE INDEX if not exists book_custom_book ON book_custom(book_id)",
+    NULL
+};
+
+static char *g_sql_book_tables[] = {
+    "CREATE TABLE if not exists gbs_book (id INTEGER PRIMARY KEY AUTOINCREMENT, md5 TEXT NOT NULL, title TEXT NOT NULL, subtitle TEXT, "
         "isbn TEXT, format TEXT NOT NULL, genre TEXT NOT NULL, subgenre TEXT, "
         "language TEXT, date TEXT, version TEXT, series TEXT, volume TEXT, "
         "publisher TEXT, path TEXT, contents TEXT, introduction TEXT, "
         "pages INT, size INT, scaned INT, years INT, popular INT, price DOUBLE, "
         "authors TEXT, keywords TEXT, urls TEXT, customs TEXT, repository TEXT, "
-        "libgenid TEXT, doi TEXT, quality INT, ctime INT, mtime INT, PRIMARY KEY(id))",
+        "libgenid TEXT, doi TEXT, quality INT, ctime INT, mtime INT)",
+    "CREATE INDEX if not exists gbs_book_md5 ON gbs_book(md5)",
+
+    /* full text index of gbs_book, the docid is gbs_book.id */
+    "CREATE VIRTUAL TABLE if not exists gbs_book_fts USING fts4(title, subtitle, introduction, contents)",
+    "CREATE TRIGGER if not exists gbs_book_fts_insert AFTER INSERT ON gbs_book BEGIN "
+        "INSERT INTO gbs_book_fts(docid, title, subtitle, introduction, contents) "
+        "VALUES (new.id, new.title, new.subtitle, new.introduction, new.contents); END",
+    "CREATE TRIGGER if not exists gbs_book_fts_update AFTER UPDATE OF title, subtitle, introduction, contents ON gbs_book BEGIN "
+        "UPDATE gbs_book_fts SET title = new.title, subtitle = new.subtitle, "
+        "introduction = new.introduction, contents = new.contents WHERE docid = old.id; END",
+    "CREATE TRIGGER if not exists gbs_book_child_delete AFTER DELETE ON gbs_book BEGIN "
+        "DELETE FROM gbs_book_fts WHERE docid = old.id; "
+        "DELETE FROM book_author WHERE book_id = old.id; "
+        "DELETE FROM book_keyword WHERE book_id = old.id; "
+        "DELETE FROM book_url WHERE book_id = old.id; "
+        "DELETE FROM book_custom WHERE book_id = old.id; END",
 
     NULL
 };
 
+/**
+ * the compact schema, md5 is BLOB(16), date is the day number since epoch
+ * and the large text is compressed, see gbs_compact.c. The columns without
+ * type keep the values which can't be converted as they are.
+ */
+static char *g_sql_compact_tables[] = {
+    "CREATE TABLE if not exists gbs_book_compact (id INTEGER PRIMARY KEY AUTOINCREMENT, md5 BLOB NOT NULL, title TEXT NOT NULL, subtitle TEXT, "
+        "isbn TEXT, format TEXT NOT NULL, genre TEXT NOT NULL, subgenre TEXT, "
+        "language TEXT, date, version TEXT, series TEXT, volume TEXT, "
+        "publisher TEXT, path TEXT, contents BLOB, introduction BLOB, "
+        "pages INT, size INT, scaned INT, years INT, popular INT, price DOUBLE, "
+        "authors TEXT, keywords TEXT, urls TEXT, customs TEXT, repository TEXT, "
+        "libgenid TEXT, doi TEXT, quality INT, ctime INT, mtime INT)",
+    "CREATE INDEX if not exists gbs_book_compact_md5 ON gbs_book_compact(md5)",
+
+    "CREATE VIRTUAL TABLE if not exists gbs_book_fts USING fts4(title, subtitle, introduction, contents)",
+    "CREATE TRIGGER if not exists gbs_book_fts_insert AFTER INSERT ON gbs_book_compact BEGIN "
+        "INSERT INTO gbs_book_fts(docid, title, subtitle, introduction, contents) "
+        "VALUES (new.id, new.title, new.subtitle, gbs_unlz(new.introduction), gbs_unlz(new.contents)); END",
+    "CREATE TRIGGER if not exists gbs_book_fts_update AFTER UPDATE OF title, subtitle, introduction, contents ON gbs_book_compact BEGIN "
+        "UPDATE gbs_book_fts SET title = new.title, subtitle = new.subtitle, "
+        "introduction = gbs_unlz(new.introduction), contents = gbs_unlz(new.contents) WHERE docid = old.id; END",
+    "CREATE TRIGGER if not exists gbs_book_child_delete AFTER DELETE ON gbs_book_compact BEGIN "
+        "DELETE FROM gbs_book_fts WHERE docid = old.id; "
+        "DELETE FROM book_author WHERE book_id = old.id; "
+        "DELETE FROM book_keyword WHERE book_id = old.id; "
+        "DELETE FROM book_url WHERE book_id = old.id; "
+        "DELETE FROM book_custom WHERE book_id = old.id; END",
+    NULL
+};
+
+/**
+ * the child tables which hold the multi-value columns of gbs_book. they are
+ * written with the book by db_book_insert, dropped with it by the delete
+ * trigger and rebuilt from the flat columns by db_child_rebuild after the
+ * merge, the import and the reindex. no trigger follows an UPDATE of the
+ * flat columns, splitting them needs the functions of db_open_file which
+ * the other clients of gbs.db don't have, reindex after such an UPDATE.
+ */
+typedef struct db_child_table_st {
+    char *table;
+    char *column;       /*< the value column in the child table */
+    char *flat;         /*< the flat column in gbs_book */
+    int offset;         /*< offset of the dpa_t in gbs_book_t */
+} db_child_table_t;
+
+static db_child_table_t g_db_child_tables[] = {
+    { "book_author", "author", "authors", offsetof(gbs_book_t, _authors) },
+    { "book_keyword", "keyword", "keywords", offsetof(gbs_book_t, _keywords) },
+    { "book_url", "url", "urls", offsetof(gbs_book_t, _urls) },
+    { "book_custom", "custom", "customs", offsetof(gbs_book_t, _customs) },
+
+    { NULL, NULL, NULL, 0 },
+};
+
 int db_open(char *filename)
 {
-    int i;
-    int exist = 0;
-    char *msg = NULL;
+    int ret;
 
     if (g_db_ctx != NULL) {
         gbs_error("db conTEXT NOT NULL!\n");
         return -EINVAL;
     }
 
-    if (access(filename, F_OK) == 0) {
-        exist = 1;
-    }
-
-    if (sqlite3_open(filename, &g_db_ctx) != 0) {
+    if (db_open_file(filename, &g_db_ctx) < 0) {
         gbs_error("Error: open db %s failed\n", filename);
         return -GBS_ERROR_DB;
     }
 
-    i = 0;
-    while (g_sql_tables[i]) {
-        if (sqlite3_exec(db, g_sql_tables[i], NULL, NULL, &msg) != SQLITE_OK) {
-            gbs_error("sqlite3_exec: %s failed, msg %s\n", g_sql_create[i], msg);
-            sqlite3_close(g_db_ctx);
-            sqlite3_free(msg);
-            g_db_ctx = NULL;
-            return -GBS_ERROR_DB;
-        }
-        i++;
+    ret = db_create_tables(g_db_ctx);
+    if (ret < 0) {
+        sqlite3_close(g_db_ctx);
+        g_db_ctx = NULL;
     }
 
-    return 0;
+    return ret;
 }
 
 int db_count(char *tbl)
@@ -113,7 +193,7 @@ int db_format_insert(char *format, char *description)
     }
 
     mbsfree(sql);
-    return sqlite3_last_insert_rowid(g_db_ctx);
+    return ret < 0 ? ret : sqlite3_last_insert_rowid(g_db_ctx);
 }
 
 int db_format_delete(char *format)
@@ -163,7 +243,7 @@ int db_language_insert(char *language, char *description)
     }
 
     mbsfree(sql);
-    return sqlite3_last_insert_rowid(g_db_ctx);
+    return ret < 0 ? ret : sqlite3_last_insert_rowid(g_db_ctx);
 }
 
 int db_language_delete(char *language)
@@ -215,7 +295,7 @@ int db_publisher_insert(char *publisher, char *website, char *description)
     }
 
     mbsfree(sql);
-    return sqlite3_last_insert_rowid(g_db_ctx);
+    return ret < 0 ? ret : sqlite3_last_insert_rowid(g_db_ctx);
 }
 
 int db_publisher_delete(char *publisher)
@@ -267,7 +347,7 @@ int db_genre_insert(char *path, char *genre, char *keywords)
     }
 
     mbsfree(sql);
-    return sqlite3_last_insert_rowid(g_db_ctx);
+    return ret < 0 ? ret : sqlite3_last_insert_rowid(g_db_ctx);
 }
 
 int db_genre_delete(char *path, char *genre)
@@ -297,25 +377,184 @@ int db_genre_delete(char *path, char *genre)
 }
 
 
+static int db_child_insert(sqlite3 *db, char *prefix, db_child_table_t *child, int book_id, int n, char **values)
+{
+    int i;
+    int ret = 0;
+    mbs_t sql = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    mbscatfmt(&sql, "INSERT INTO %s%s(book_id, %s) VALUES (?, ?);", prefix ? prefix : "", child->table, child->column);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        gbs_error("invalid sql: %s, msg %s\n", sql, sqlite3_errmsg(db));
+        mbsfree(sql);
+        return -GBS_ERROR_DB;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (values[i] == NULL || str_empty(values[i])) {
+            continue;
+        }
+
+        sqlite3_bind_int(stmt, 1, book_id);
+        sqlite3_bind_text(stmt, 2, values[i], -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            gbs_error("insert %s into %s failed, msg %s\n", values[i], child->table, sqlite3_errmsg(db));
+            ret = -GBS_ERROR_DB;
+            break;
+        }
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * write the authors, keywords, urls and customs of one book into the
+ * child tables, so they can be searched by the value indexes. The prefix
+ * is the schema of the shard, or NULL.
+ */
+static int db_book_insert_children(sqlite3 *db, char *prefix, gbs_book_t *book)
+{
+    int ret;
+    dpa_t *dpa;
+    db_child_table_t *child;
+
+    for (child = g_db_child_tables; child->table; child++) {
+        dpa = (dpa_t *)((char *)book + child->offset);
+        ret = db_child_insert(db, prefix, child, book->id, dpa->used, (char **)dpa->array);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 int db_book_insert(gbs_book_t *book)
 {
     int ret = 0;
     char *msg = NULL;
     mbs_t sql = NULL;
+    mbs_t prefix = NULL;
 
     if (g_db_ctx == NULL) {
         gbs_error("db context is null.\n");
         return -EINVAL;
     }
 
+    /* the book goes into its shard if the database is sharded */
+    prefix = db_shard_prefix(g_db_ctx, book);
     mbscatfmt(&sql,
-        "INSERT INTO gbs_book(md5, title, subtitle, isbn, format, genre, subgenre, language, date, version, series, publisher, customs, path, contents, introduction, authors, keywords, urls, pages, size, scaned, years, popular, price, quality, doi, libgenid, repository, ctime, mtime)"
+        "INSERT INTO %sgbs_book(md5, title, subtitle, isbn, format, genre, subgenre, language, date, version, series, publisher, customs, path, contents, introduction, authors, keywords, urls, pages, size, scaned, years, popular, price, quality, doi, libgenid, repository, ctime, mtime)"
         "VALUES ('%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%d', '%d', '%d', '%d', '%d', '%.4f', '%d', '%s', '%s', '%s', '%ld', '%ld');",
-        book->md5, book->title, book->subtitle, book->isbn, book->format, book->genre, book->subgenre, book->language, book->date,
+        prefix ? prefix : "", book->md5, book->title, book->subtitle, book->isbn, book->format, book->genre, book->subgenre, book->language, book->date,
         book->version, book->series, book->publisher, book->customs, book->path, book->contents, book->introduction, book->authors,
         book->keywords, book->urls, book->pages, book->size, book->scaned, book->years, book->popular, book->price, book->quality,
         book->doi, book->libgenid, book->repository, book->ctime, book->mtime);
     gbs_debug("%s\n", sql);
+    if (sqlite3_exec(g_db_ctx, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("sqlite3_exec: %s failed, msg %s\n", sql, msg);
+        sqlite3_free(msg);
+        ret = -GBS_ERROR_DB;
+    } else {
+        book->id = db_book_last_id(g_db_ctx);
+        ret = db_book_insert_children(g_db_ctx, prefix, book);
+    }
+
+    mbsfree(prefix);
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * group the following mutations into one transaction.
+ */
+int db_begin(void)
+{
+    char *msg = NULL;
+
+    if (g_db_ctx == NULL) {
+        return -EINVAL;
+    }
+
+    if (sqlite3_exec(g_db_ctx, "BEGIN;", NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("sqlite3_exec: BEGIN failed, msg %s\n", msg);
+        sqlite3_free(msg);
+        return -GBS_ERROR_DB;
+    }
+
+    return 0;
+}
+
+int db_commit(void)
+{
+    char *msg = NULL;
+
+    if (g_db_ctx == NULL) {
+        return -EINVAL;
+    }
+
+    if (sqlite3_get_autocommit(g_db_ctx)) {
+        return 0;
+    }
+
+    if (sqlite3_exec(g_db_ctx, "COMMIT;", NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("sqlite3_exec: COMMIT failed, msg %s\n", msg);
+        sqlite3_free(msg);
+        sqlite3_exec(g_db_ctx, "ROLLBACK;", NULL, NULL, NULL);
+        return -GBS_ERROR_DB;
+    }
+
+    return 0;
+}
+
+/**
+ * mark a savepoint in the transaction, the mutations after it can be undone
+ * alone by db_release with rollback set.
+ */
+int db_savepoint(char *name)
+{
+    int ret = 0;
+    char *msg = NULL;
+    mbs_t sql = NULL;
+
+    if (g_db_ctx == NULL) {
+        return -EINVAL;
+    }
+
+    mbscatfmt(&sql, "SAVEPOINT %s;", name);
+    if (sqlite3_exec(g_db_ctx, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("sqlite3_exec: %s failed, msg %s\n", sql, msg);
+        sqlite3_free(msg);
+        ret = -GBS_ERROR_DB;
+    }
+
+    mbsfree(sql);
+    return ret;
+}
+
+int db_release(char *name, int rollback)
+{
+    int ret = 0;
+    char *msg = NULL;
+    mbs_t sql = NULL;
+
+    if (g_db_ctx == NULL) {
+        return -EINVAL;
+    }
+
+    /* ROLLBACK TO keeps the savepoint, it's released anyway */
+    if (rollback) {
+        mbscatfmt(&sql, "ROLLBACK TO %s; ", name);
+    }
+    mbscatfmt(&sql, "RELEASE %s;", name);
     if (sqlite3_exec(g_db_ctx, sql, NULL, NULL, &msg) != SQLITE_OK) {
         gbs_error("sqlite3_exec: %s failed, msg %s\n", sql, msg);
         sqlite3_free(msg);
@@ -399,7 +638,7 @@ static int gbs_db_load_genre_cb(void *NotUsed, int argc, char **argv,
     if (argc != 3)
         return -GBS_ERROR_DB;
 
-    gbs_genre_insert(argv[0], argv[1], argv[2]);
+    gbs_genre_add(argv[0], argv[1], argv[2]);
 #endif
     return 0;
 }
@@ -459,8 +698,68 @@ static int gbs_db_load_book_cb(void *NotUsed, int argc, char **argv,
     return 0;
 }
 
+/* the snapshot fields of the text columns gbs_db_load_book_cb takes, -1 for the numbers */
+static int g_db_snapshot_columns[25] = {
+    GBS_SNAPSHOT_FIELD_MD5, GBS_SNAPSHOT_FIELD_TITLE, GBS_SNAPSHOT_FIELD_SUBTITLE,
+    GBS_SNAPSHOT_FIELD_ISBN, GBS_SNAPSHOT_FIELD_FORMAT, GBS_SNAPSHOT_FIELD_GENRE,
+    GBS_SNAPSHOT_FIELD_SUBGENRE, GBS_SNAPSHOT_FIELD_LANGUAGE, GBS_SNAPSHOT_FIELD_DATE,
+    GBS_SNAPSHOT_FIELD_VERSION, GBS_SNAPSHOT_FIELD_SERIES, GBS_SNAPSHOT_FIELD_PUBLISHER,
+    GBS_SNAPSHOT_FIELD_PATH, GBS_SNAPSHOT_FIELD_CONTENTS, GBS_SNAPSHOT_FIELD_INTRODUCTION,
+    -1, -1, -1, -1, -1, -1,
+    GBS_SNAPSHOT_FIELD_AUTHORS, GBS_SNAPSHOT_FIELD_KEYWORDS, GBS_SNAPSHOT_FIELD_URLS,
+    GBS_SNAPSHOT_FIELD_CUSTOMS,
+};
+
+/**
+ * load the books from the snapshot of filename by gbs_db_load_book_cb, as
+ * if they were read from gbs_book. -GBS_ERROR_NOT_EXIST if the snapshot is
+ * missing or stale, its stamp is not the one of filename, the books are
+ * read from filename then.
+ */
+static int gbs_db_load_snapshot(char *filename)
+{
+    int i, j, n;
+    int ret = 0;
+    char *argv[25];
+    char nums[6][32];
+    mbs_t snapfile;
+    gbs_snapshot_t *snap;
+    gbs_snapshot_book_t *book;
+
+    snapfile = mbsnewfmt("%s%s", filename, GBS_SNAPSHOT_SUFFIX);
+    snap = gbs_snapshot_open(filename, snapfile, 0);
+    mbsfree(snapfile);
+    if (snap == NULL) {
+        return -GBS_ERROR_NOT_EXIST;
+    }
+
+    n = gbs_snapshot_count(snap);
+    for (i = 0; i < n && ret == 0; i++) {
+        book = gbs_snapshot_book(snap, i);
+        snprintf(nums[0], sizeof(nums[0]), "%d", book->pages);
+        snprintf(nums[1], sizeof(nums[1]), "%d", book->size);
+        snprintf(nums[2], sizeof(nums[2]), "%d", book->scaned);
+        snprintf(nums[3], sizeof(nums[3]), "%d", book->years);
+        snprintf(nums[4], sizeof(nums[4]), "%d", book->popular);
+        snprintf(nums[5], sizeof(nums[5]), "%.4f", book->price);
+        for (j = 0; j < 25; j++) {
+            if (g_db_snapshot_columns[j] < 0) {
+                argv[j] = nums[j - 15];
+            } else {
+                argv[j] = gbs_snapshot_str(snap, book, g_db_snapshot_columns[j]);
+            }
+        }
+
+        ret = gbs_db_load_book_cb(NULL, 25, argv, NULL);
+    }
+
+    gbs_snapshot_close(snap);
+    return ret;
+}
+
 int gbs_db_read(char *filename)
 {
+    int ret;
     sqlite3 *db;
     char *errmsg;
 
@@ -470,7 +769,7 @@ int gbs_db_read(char *filename)
     char *genre_sql = "select * from gbs_genre";
     char *book_sql = "select * from gbs_book";
 
-    if (sqlite3_open(filename, &db) != 0) {
+    if (db_open_file(filename, &db) < 0) {
         gbs_error("Error: %s\n", sqlite3_errmsg(db));
         return -GBS_ERROR_DB;
     }
@@ -499,12 +798,925 @@ int gbs_db_read(char *filename)
         sqlite3_free(errmsg);
     }
 
-    if (sqlite3_exec(db, book_sql, gbs_db_load_book_cb, 0,
-            &errmsg) != SQLITE_OK) {
-        gbs_error("Error: %s\n", errmsg);
-        sqlite3_free(errmsg);
+    /* the snapshot spares the books from sqlite, it's written with gbs.db */
+    ret = gbs_db_load_snapshot(filename);
+    if (ret == -GBS_ERROR_NOT_EXIST) {
+        ret = 0;
+        if (sqlite3_exec(db, book_sql, gbs_db_load_book_cb, 0,
+                &errmsg) != SQLITE_OK) {
+            gbs_error("Error: %s\n", errmsg);
+            sqlite3_free(errmsg);
+        }
     }
 
     sqlite3_close(db);
+    return ret;
+}
+
+static int db_exec_all(sqlite3 *db, char **sqls)
+{
+    int i;
+    char *msg = NULL;
+
+    for (i = 0; sqls[i]; i++) {
+        if (sqlite3_exec(db, sqls[i], NULL, NULL, &msg) != SQLITE_OK) {
+            gbs_error("sqlite3_exec: %s failed, msg %s\n", sqls[i], msg);
+            sqlite3_free(msg);
+            return -GBS_ERROR_DB;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * create the tables, indexes and triggers of the normal or compact schema
+ * which are not exist yet.
+ */
+int db_create_schema(sqlite3 *db, int compact)
+{
+    int ret;
+
+    /* only takes effect on the empty database, the old ones use db_vacuum */
+    sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL;", NULL, NULL, NULL);
+
+    ret = db_exec_all(db, g_sql_tables);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!compact) {
+        ret = db_exec_all(db, g_sql_book_tables);
+        if (ret == 0) {
+            ret = db_changelog_create(db, "gbs_book");
+        }
+        return ret;
+    }
+
+    /* the fts4 keeps its own copy of text, compress it too if we can */
+    if (sqlite3_libversion_number() >= 3007011) {
+        sqlite3_exec(db, "CREATE VIRTUAL TABLE if not exists gbs_book_fts USING "
+                "fts4(title, subtitle, introduction, contents, compress=gbs_lz, uncompress=gbs_unlz)",
+                NULL, NULL, NULL);
+    }
+
+    ret = db_exec_all(db, g_sql_compact_tables);
+    if (ret == 0) {
+        ret = db_changelog_create(db, "gbs_book_compact");
+    }
+    if (ret == 0) {
+        ret = db_compact_attach(db);
+    }
+    return ret;
+}
+
+/**
+ * create the dictionary tables only, the main database of the sharded one
+ * keeps the books in the shards, see gbs_shard.c.
+ */
+int db_create_dict_tables(sqlite3 *db)
+{
+    int ret;
+
+    ret = db_exec_all(db, g_sql_tables);
+    if (ret == 0) {
+        ret = db_changelog_create(db, NULL);
+    }
+    return ret;
+}
+
+/**
+ * create the tables, indexes and triggers which are not exist yet.
+ */
+int db_create_tables(sqlite3 *db)
+{
+    /* created by db_shard_attach before the views of shards */
+    if (db_is_sharded(db)) {
+        return 0;
+    }
+
+    return db_create_schema(db, db_is_compact(db));
+}
+
+/**
+ * open the gbs database with the gbs sql functions registered, and the
+ * gbs_book view if it's compact, every connection should be opened by it.
+ */
+int db_open_file(char *filename, sqlite3 **db)
+{
+    int ret;
+
+    if (sqlite3_open(filename, db) != SQLITE_OK) {
+        sqlite3_close(*db);
+        *db = NULL;
+        return -GBS_ERROR_DB;
+    }
+
+    ret = db_functions_attach(*db);
+    if (ret == 0) {
+        ret = db_compact_attach(*db);
+    }
+    if (ret == 0) {
+        ret = db_shard_attach(*db, filename);
+    }
+    if (ret < 0) {
+        sqlite3_close(*db);
+        *db = NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * rebuild the child tables of the books matched by the condition from the
+ * flat columns of gbs_book, all the books if the condition is NULL.
+ */
+int db_child_rebuild(sqlite3 *db, char *cond)
+{
+    int n;
+    int id;
+    int ret = 0;
+    char *msg = NULL;
+    char **values;
+    mbs_t sql = NULL;
+    sqlite3_stmt *stmt = NULL;
+    db_child_table_t *child;
+
+    for (child = g_db_child_tables; child->table && ret == 0; child++) {
+        if (cond) {
+            mbscpyfmt(&sql, "DELETE FROM %s WHERE book_id IN (SELECT id FROM gbs_book WHERE %s);", child->table, cond);
+        } else {
+            mbscpyfmt(&sql, "DELETE FROM %s;", child->table);
+        }
+        if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+            gbs_error("sqlite3_exec: %s failed, msg %s\n", sql, msg);
+            sqlite3_free(msg);
+            ret = -GBS_ERROR_DB;
+            break;
+        }
+
+        mbscpyfmt(&sql, "SELECT id, %s FROM gbs_book WHERE %s IS NOT NULL AND %s != '' AND %s;",
+            child->flat, child->flat, child->flat, cond ? cond : "1");
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+            gbs_error("invalid sql: %s\n", sql);
+            ret = -GBS_ERROR_DB;
+            break;
+        }
+
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            id = sqlite3_column_int(stmt, 0);
+            n = parse_wordlist((char *)sqlite3_column_text(stmt, 1), GBS_DB_VALUE_SEPARATOR, &values);
+            if (n <= 0) {
+                continue;
+            }
+
+            ret = db_child_insert(db, NULL, child, id, n, values);
+            free_wordlist(n, values);
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        sqlite3_finalize(stmt);
+    }
+
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * rebuild the child tables and the full text index from the flat columns
+ * of gbs_book, it's used to upgrade the database created by old version.
+ */
+int db_book_reindex(char *filename)
+{
+    int ret = 0;
+    char *msg = NULL;
+    sqlite3 *db;
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+
+    if (db_is_sharded(db)) {
+        gbs_error("%s is sharded, reindex the shards one by one\n", filename);
+        sqlite3_close(db);
+        return -GBS_ERROR_INVAL;
+    }
+
+    if (sqlite3_exec(db, "BEGIN;", NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("sqlite3_exec: BEGIN failed, msg %s\n", msg);
+        sqlite3_free(msg);
+        sqlite3_close(db);
+        return -GBS_ERROR_DB;
+    }
+
+    ret = db_child_rebuild(db, NULL);
+    if (ret == 0) {
+        if (sqlite3_exec(db, "DELETE FROM gbs_book_fts; "
+                    "INSERT INTO gbs_book_fts(docid, title, subtitle, introduction, contents) "
+                    "SELECT id, title, subtitle, introduction, contents FROM gbs_book;",
+                    NULL, NULL, &msg) != SQLITE_OK) {
+            gbs_error("rebuild full text index failed, msg %s\n", msg);
+            sqlite3_free(msg);
+            ret = -GBS_ERROR_DB;
+        }
+    }
+
+    sqlite3_exec(db, ret == 0 ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+    sqlite3_close(db);
+    return ret;
+}
+
+/**
+ * the columns of gbs_book except id, in the order of the create sql.
+ */
+char *g_db_book_columns[] = {
+    "md5", "title", "subtitle", "isbn", "format", "genre", "subgenre",
+    "language", "date", "version", "series", "volume", "publisher", "path",
+    "contents", "introduction", "pages", "size", "scaned", "years", "popular",
+    "price", "authors", "keywords", "urls", "customs", "repository",
+    "libgenid", "doi", "quality", "ctime", "mtime",
+    NULL
+};
+
+static char *g_db_merge_rule_names[] = {
+    [GBS_MERGE_KEEP] = "keep",
+    [GBS_MERGE_SOURCE] = "source",
+    [GBS_MERGE_FILL] = "fill",
+    [GBS_MERGE_NEWER] = "newer",
+};
+
+static int db_merge_rule_parse(char *name)
+{
+    int i;
+
+    for (i = 0; i < GBS_MERGE_MAX; i++) {
+        if (!strcasecmp(name, g_db_merge_rule_names[i])) {
+            return i;
+        }
+    }
+
+    return -GBS_ERROR_INVAL;
+}
+
+/**
+ * parse the rules like "*=fill,title=source,price=newer" into the rule of
+ * each column in g_db_book_columns, the "*" is the default rule.
+ */
+static int db_merge_rules_parse(char *rules, int *column_rules)
+{
+    int i, j;
+    int n;
+    int rule;
+    int ret = 0;
+    char *eq;
+    char **items = NULL;
+
+    for (j = 0; g_db_book_columns[j]; j++) {
+        column_rules[j] = GBS_MERGE_FILL;
+    }
+
+    if (rules == NULL || *rules == 0) {
+        return 0;
+    }
+
+    n = parse_wordlist(rules, ",", &items);
+    if (n <= 0) {
+        return -GBS_ERROR_INVAL;
+    }
+
+    for (i = 0; i < n && ret == 0; i++) {
+        eq = strchr(items[i], '=');
+        if (eq == NULL) {
+            gbs_error("invalid merge rule %s\n", items[i]);
+            ret = -GBS_ERROR_INVAL;
+            break;
+        }
+
+        *eq = 0;
+        rule = db_merge_rule_parse(eq + 1);
+        if (rule < 0) {
+            gbs_error("unknown merge rule %s, use keep, source, fill or newer\n", eq + 1);
+            ret = rule;
+            break;
+        }
+
+        if (!strcmp(items[i], "*")) {
+            for (j = 0; g_db_book_columns[j]; j++) {
+                column_rules[j] = rule;
+            }
+            continue;
+        }
+
+        for (j = 0; g_db_book_columns[j]; j++) {
+            if (!strcasecmp(items[i], g_db_book_columns[j])) {
+                column_rules[j] = rule;
+                break;
+            }
+        }
+        if (g_db_book_columns[j] == NULL) {
+            gbs_error("unknown column %s in merge rule\n", items[i]);
+            ret = -GBS_ERROR_INVAL;
+        }
+    }
+
+    free_wordlist(n, items);
+    return ret;
+}
+
+static int db_merge_exec(sqlite3 *db, char *sql, char *what, int *changes)
+{
+    char *msg = NULL;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("merge %s failed, sql %s, msg %s\n", what, sql, msg);
+        sqlite3_free(msg);
+        return -GBS_ERROR_DB;
+    }
+
+    if (changes) {
+        *changes = sqlite3_changes(db);
+    }
     return 0;
 }
+
+/**
+ * merge the source database into the target database as set operations.
+ *
+ * the formats, languages, publishers and genres are merged by name. The books
+ * are matched by md5, the new ones are inserted and the conflicts are updated
+ * column by column with the rules, see db_merge_rules_parse.
+ */
+int db_merge(char *filename, char *source, char *rules)
+{
+    int i;
+    int ret;
+    int maxid = 0;
+    int conflicts = 0;
+    int updated = 0;
+    int inserted = 0;
+    int formats = 0, languages = 0, publishers = 0, genres = 0;
+    int column_rules[sizeof(g_db_book_columns) / sizeof(g_db_book_columns[0])];
+    char *col;
+    sqlite3 *db;
+    mbs_t sql = NULL;
+    mbs_t src = NULL;
+    mbs_t columns = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    ret = db_merge_rules_parse(rules, column_rules);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+
+    if (db_is_compact(db)) {
+        gbs_error("%s is compact, expand it before merging\n", filename);
+        sqlite3_close(db);
+        return -GBS_ERROR_INVAL;
+    }
+
+    if (db_is_sharded(db)) {
+        gbs_error("%s is sharded, merge into the shards one by one\n", filename);
+        sqlite3_close(db);
+        return -GBS_ERROR_INVAL;
+    }
+
+    ret = db_create_tables(db);
+    if (ret < 0) {
+        sqlite3_close(db);
+        return ret;
+    }
+
+    src = mbsnewescapesqlite(source);
+    mbscpyfmt(&sql, "ATTACH DATABASE '%s' AS src;", src);
+    mbsfree(src);
+    ret = db_merge_exec(db, sql, "attach", NULL);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = db_merge_exec(db, "BEGIN;", "begin", NULL);
+    if (ret < 0) {
+        goto detach;
+    }
+
+    ret = db_merge_exec(db, "INSERT INTO main.gbs_format(format, description) "
+            "SELECT format, description FROM src.gbs_format "
+            "WHERE format NOT IN (SELECT format FROM main.gbs_format) GROUP BY format;",
+            "formats", &formats);
+    if (ret == 0)
+        ret = db_merge_exec(db, "INSERT INTO main.gbs_language(language, description) "
+            "SELECT language, description FROM src.gbs_language "
+            "WHERE language NOT IN (SELECT language FROM main.gbs_language) GROUP BY language;",
+            "languages", &languages);
+    if (ret == 0)
+        ret = db_merge_exec(db, "INSERT INTO main.gbs_publisher(publisher, website, description) "
+            "SELECT publisher, website, description FROM src.gbs_publisher "
+            "WHERE publisher NOT IN (SELECT publisher FROM main.gbs_publisher) GROUP BY publisher;",
+            "publishers", &publishers);
+    if (ret == 0)
+        ret = db_merge_exec(db, "INSERT INTO main.gbs_genre(path, genre, keywords) "
+            "SELECT s.path, s.genre, s.keywords FROM src.gbs_genre s WHERE NOT EXISTS "
+            "(SELECT 1 FROM main.gbs_genre g WHERE g.path = s.path AND g.genre = s.genre) "
+            "GROUP BY s.path, s.genre;",
+            "genres", &genres);
+    if (ret < 0) {
+        goto rollback;
+    }
+
+    /* the conflicting source books, one row per md5, indexed for the updates */
+    ret = db_merge_exec(db, "CREATE TEMP TABLE merge_conflict AS SELECT * FROM src.gbs_book "
+            "WHERE md5 IN (SELECT md5 FROM main.gbs_book) GROUP BY md5; "
+            "CREATE UNIQUE INDEX temp.merge_conflict_md5 ON merge_conflict(md5);",
+            "conflicts", NULL);
+    if (ret < 0) {
+        goto rollback;
+    }
+
+    if (sqlite3_prepare_v2(db, "SELECT (SELECT count(*) FROM temp.merge_conflict), "
+                "(SELECT ifnull(max(id), 0) FROM main.gbs_book);", -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            conflicts = sqlite3_column_int(stmt, 0);
+            maxid = sqlite3_column_int(stmt, 1);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    /* all the expressions of one UPDATE see the old row, so newer is stable */
+    mbscpyfmt(&sql, "UPDATE main.gbs_book SET id = id");
+    for (i = 0; g_db_book_columns[i]; i++) {
+        col = g_db_book_columns[i];
+        switch (column_rules[i]) {
+        case GBS_MERGE_SOURCE:
+            mbscatfmt(&sql, ", %s = (SELECT s.%s FROM temp.merge_conflict s WHERE s.md5 = gbs_book.md5)", col, col);
+            break;
+        case GBS_MERGE_FILL:
+            mbscatfmt(&sql, ", %s = CASE WHEN %s IS NULL OR %s = '' "
+                "THEN (SELECT s.%s FROM temp.merge_conflict s WHERE s.md5 = gbs_book.md5) ELSE %s END",
+                col, col, col, col, col);
+            break;
+        case GBS_MERGE_NEWER:
+            mbscatfmt(&sql, ", %s = CASE WHEN (SELECT s.mtime FROM temp.merge_conflict s WHERE s.md5 = gbs_book.md5) > ifnull(mtime, 0) "
+                "THEN (SELECT s.%s FROM temp.merge_conflict s WHERE s.md5 = gbs_book.md5) ELSE %s END",
+                col, col, col);
+            break;
+        default:
+            break;
+        }
+    }
+    mbscatfmt(&sql, " WHERE md5 IN (SELECT md5 FROM temp.merge_conflict);");
+    ret = db_merge_exec(db, sql, "books", &updated);
+    if (ret < 0) {
+        goto rollback;
+    }
+
+    for (i = 0; g_db_book_columns[i]; i++) {
+        mbscatfmt(&columns, "%s%s", i ? ", " : "", g_db_book_columns[i]);
+    }
+    mbscpyfmt(&sql, "INSERT INTO main.gbs_book(%s) SELECT %s FROM src.gbs_book "
+        "WHERE md5 NOT IN (SELECT md5 FROM main.gbs_book) GROUP BY md5;", columns, columns);
+    ret = db_merge_exec(db, sql, "books", &inserted);
+    if (ret < 0) {
+        goto rollback;
+    }
+
+    /* the fts index follows by the triggers, the child tables are rebuilt */
+    mbscpyfmt(&sql, "id > %d OR md5 IN (SELECT md5 FROM temp.merge_conflict)", maxid);
+    ret = db_child_rebuild(db, sql);
+    if (ret < 0) {
+        goto rollback;
+    }
+
+    ret = db_merge_exec(db, "COMMIT;", "commit", NULL);
+    if (ret == 0) {
+        gbs_print("merge %s into %s:\n", source, filename);
+        gbs_print("  books: %d inserted, %d conflicts by md5, %d updated\n", inserted, conflicts, updated);
+        gbs_print("  formats: %d, languages: %d, publishers: %d, genres: %d inserted\n",
+            formats, languages, publishers, genres);
+        goto detach;
+    }
+
+rollback:
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+detach:
+    sqlite3_exec(db, "DROP TABLE IF EXISTS temp.merge_conflict;", NULL, NULL, NULL);
+    sqlite3_exec(db, "DETACH DATABASE src;", NULL, NULL, NULL);
+out:
+    sqlite3_close(db);
+    mbsfree(columns);
+    mbsfree(sql);
+    return ret;
+}
+
+static void db_print_row(sqlite3_stmt *stmt)
+{
+    int i;
+    const unsigned char *text;
+
+    for (i = 0; i < sqlite3_column_count(stmt); i++) {
+        text = sqlite3_column_text(stmt, i);
+        gbs_print("%s%s", i ? "\t" : "", text ? (char *)text : "");
+    }
+    gbs_print("\n");
+}
+
+/**
+ * list the books matched by the sql with one text parameter,
+ * the rows are printed as soon as they are stepped out.
+ */
+static int db_list_by_stmt(sqlite3 *db, char *sql, char *param)
+{
+    int n = 0;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        gbs_error("invalid sql: %s, msg %s\n", sql, sqlite3_errmsg(db));
+        return -GBS_ERROR_DB;
+    }
+
+    sqlite3_bind_text(stmt, 1, param, -1, SQLITE_STATIC);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        db_print_row(stmt);
+        n++;
+    }
+
+    sqlite3_finalize(stmt);
+    return n;
+}
+
+static int db_list_by_param(char *filename, char *sql, char *param)
+{
+    int n;
+    sqlite3 *db;
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+
+    n = db_list_by_stmt(db, sql, param);
+    sqlite3_close(db);
+    return n;
+}
+
+static int db_list_by_child(char *filename, char *table, char *column, char *value, char *displays)
+{
+    int ret;
+    mbs_t sql = NULL;
+
+    mbscatfmt(&sql, "SELECT %s FROM gbs_book WHERE id IN (SELECT book_id FROM %s WHERE %s = ?);",
+            displays, table, column);
+    ret = db_list_by_param(filename, sql, value);
+    mbsfree(sql);
+    return ret;
+}
+
+int db_list_by_author(char *filename, char *author, char *displays)
+{
+    return db_list_by_child(filename, "book_author", "author", author, displays);
+}
+
+int db_list_by_keyword(char *filename, char *keyword, char *displays)
+{
+    return db_list_by_child(filename, "book_keyword", "keyword", keyword, displays);
+}
+
+int db_list_by_url(char *filename, char *url, char *displays)
+{
+    return db_list_by_child(filename, "book_url", "url", url, displays);
+}
+
+/**
+ * full text search in title, subtitle, introduction and contents,
+ * the match expression is passed to fts4 as is, eg. "linux kernel" or "gtk*".
+ * The MATCH is asked of the fts4 of every shard if the database is sharded,
+ * the ids are unique over the shards.
+ */
+int db_list_by_text(char *filename, char *match, char *displays)
+{
+    int i;
+    int n;
+    int ret;
+    sqlite3 *db;
+    mbs_t sql = NULL;
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+
+    mbscatfmt(&sql, "SELECT %s FROM gbs_book WHERE id IN (", displays);
+    n = db_shard_count(db);
+    if (n == 0) {
+        mbscat(&sql, "SELECT docid FROM gbs_book_fts WHERE gbs_book_fts MATCH ?1");
+    }
+    for (i = 0; i < n; i++) {
+        /* the left of MATCH is the column named after the table, it can't be qualified */
+        mbscatfmt(&sql, "%sSELECT docid FROM shard%d.gbs_book_fts WHERE gbs_book_fts MATCH ?1",
+                i ? " UNION ALL " : "", i);
+    }
+    mbscat(&sql, ");");
+
+    ret = db_list_by_stmt(db, sql, match);
+    sqlite3_close(db);
+    mbsfree(sql);
+    return ret;
+}
+
+#define DB_PAGE_KEY_MAX     8
+
+typedef struct db_page_key_st {
+    char *column;
+    int desc;
+} db_page_key_t;
+
+/**
+ * the identifier which can be pasted into sql without quoting.
+ */
+int db_is_column_name(char *name)
+{
+    if (!isalpha((unsigned char)*name) && *name != '_') {
+        return 0;
+    }
+
+    for (name++; *name; name++) {
+        if (!isalnum((unsigned char)*name) && *name != '_') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * parse the orders like "title ASC,size DESC" in place into keys, the id is
+ * always appended as the tie-breaker in the direction of the last key. The
+ * keys must be in the same direction, or the page can't be read from the
+ * index in order.
+ */
+static int db_page_keys_parse(char *orders, db_page_key_t *keys)
+{
+    int i;
+    int nkey = 0;
+    int iddesc = -1;
+    char *item;
+    char *next;
+    char *dir;
+
+    for (item = orders; item && nkey < DB_PAGE_KEY_MAX - 1; item = next) {
+        next = strchr(item, ',');
+        if (next) {
+            *next++ = 0;
+        }
+
+        item = strtrim(item, NULL);
+        dir = strpbrk(item, " \t");
+        keys[nkey].column = item;
+        keys[nkey].desc = 0;
+        if (dir) {
+            *dir++ = 0;
+            keys[nkey].desc = !strcasecmp(strtrim(dir, NULL), "DESC");
+        }
+
+        if (*item == 0) {
+            continue;
+        }
+        if (!db_is_column_name(item)) {
+            gbs_error("invalid sort key %s\n", item);
+            return -GBS_ERROR_INVAL;
+        }
+        if (strcasecmp(item, "id")) {
+            nkey++;
+        } else {
+            iddesc = keys[nkey].desc;
+        }
+    }
+
+    keys[nkey].column = "id";
+    if (iddesc >= 0) {
+        keys[nkey].desc = iddesc;
+    } else {
+        keys[nkey].desc = nkey ? keys[nkey - 1].desc : 0;
+    }
+
+    for (i = 1; i <= nkey; i++) {
+        if (keys[i].desc != keys[0].desc) {
+            gbs_error("the sort keys mix ASC and DESC, it's not supported\n");
+            return -GBS_ERROR_INVAL;
+        }
+    }
+    return nkey + 1;
+}
+
+/**
+ * the index on the sort keys and id, so the seek and the ordered scan of
+ * one page don't touch the other rows.
+ */
+static int db_page_index(sqlite3 *db, db_page_key_t *keys, int nkey)
+{
+    int i;
+    int ret = 0;
+    char *msg = NULL;
+    mbs_t name = NULL;
+    mbs_t sql = NULL;
+
+    /* the compact and the sharded gbs_book are views, they have the md5 and id indexes only */
+    if (nkey == 1 || db_is_compact(db) || db_is_sharded(db)) {
+        return 0;
+    }
+
+    mbscpy(&name, "gbs_book_page");
+    for (i = 0; i < nkey - 1; i++) {
+        mbscatfmt(&name, "_%s", keys[i].column);
+    }
+
+    mbscpyfmt(&sql, "CREATE INDEX IF NOT EXISTS %s ON gbs_book(", name);
+    for (i = 0; i < nkey; i++) {
+        mbscatfmt(&sql, "%s%s", i ? ", " : "", keys[i].column);
+    }
+    mbscat(&sql, ");");
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("sqlite3_exec: %s failed, msg %s\n", sql, msg);
+        sqlite3_free(msg);
+        ret = -GBS_ERROR_DB;
+    }
+
+    mbsfree(name);
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * the seek condition of (k1, k2, ..., id) after the cursor row, which is
+ * the parameters ?1..?n. The NULL sorts first like sqlite does. The range
+ * of k1 is ANDed in front, so sqlite seeks the index instead of scanning.
+ *
+ * return 1 if the rows whose k1 is NULL are left out, they are after the
+ * others in DESC and out of the range of k1, the caller reads them after.
+ */
+static int db_page_seek(mbs_t *sql, db_page_key_t *keys, int nkey, sqlite3_stmt *cursor)
+{
+    int i, j;
+    int null;
+    int first = 1;
+    int tail = 0;
+
+    null = sqlite3_column_type(cursor, 0) == SQLITE_NULL;
+    if (null && !keys[0].desc) {
+        /* all the others are after NULL */
+        mbscat(sql, " WHERE (");
+    } else if (null) {
+        mbscatfmt(sql, " WHERE %s IS NULL AND (", keys[0].column);
+    } else {
+        mbscatfmt(sql, " WHERE %s %s ?1 AND (", keys[0].column, keys[0].desc ? "<=" : ">=");
+        tail = keys[0].desc;
+    }
+
+    for (i = 0; i < nkey; i++) {
+        null = sqlite3_column_type(cursor, i) == SQLITE_NULL;
+        if (keys[i].desc && null) {
+            /* nothing is less than NULL */
+            continue;
+        }
+
+        mbscat(sql, first ? "(" : " OR (");
+        first = 0;
+        for (j = 0; j < i; j++) {
+            mbscatfmt(sql, "%s IS ?%d AND ", keys[j].column, j + 1);
+        }
+
+        if (!keys[i].desc) {
+            if (null) {
+                mbscatfmt(sql, "%s IS NOT NULL)", keys[i].column);
+            } else {
+                mbscatfmt(sql, "%s > ?%d)", keys[i].column, i + 1);
+            }
+        } else if (i == 0) {
+            mbscatfmt(sql, "%s < ?%d)", keys[i].column, i + 1);
+        } else {
+            mbscatfmt(sql, "(%s < ?%d OR %s IS NULL))", keys[i].column, i + 1, keys[i].column);
+        }
+    }
+    mbscat(sql, first ? "0)" : ")");
+    return tail;
+}
+
+/**
+ * list one page of books in the orders with keyset pagination, the page
+ * starts after the book whose id is after, or from the first if after is 0.
+ * the id of the last row is printed to stderr as the cursor of next page.
+ */
+int db_list_page(char *filename, char *orders, char *displays, int limit, int after)
+{
+    int i;
+    int part;
+    int tail = 0;
+    int n = 0;
+    int nkey;
+    int last = 0;
+    int ncol;
+    sqlite3 *db;
+    mbs_t sql = NULL;
+    mbs_t buf = NULL;
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_stmt *cursor = NULL;
+    db_page_key_t keys[DB_PAGE_KEY_MAX];
+    const unsigned char *text;
+
+    buf = orders ? mbsnew(orders) : NULL;
+    nkey = db_page_keys_parse(buf, keys);
+    if (nkey < 0) {
+        mbsfree(buf);
+        return nkey;
+    }
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        n = -GBS_ERROR_DB;
+        goto out;
+    }
+
+    n = db_page_index(db, keys, nkey);
+    if (n < 0) {
+        goto out;
+    }
+
+    if (after > 0) {
+        mbscpy(&sql, "SELECT ");
+        for (i = 0; i < nkey; i++) {
+            mbscatfmt(&sql, "%s%s", i ? ", " : "", keys[i].column);
+        }
+        mbscatfmt(&sql, " FROM gbs_book WHERE id = %d;", after);
+        if (sqlite3_prepare_v2(db, sql, -1, &cursor, NULL) != SQLITE_OK
+                || sqlite3_step(cursor) != SQLITE_ROW) {
+            gbs_error("the cursor %d is not found, msg %s\n", after, sqlite3_errmsg(db));
+            n = -GBS_ERROR_NOT_EXIST;
+            goto out;
+        }
+    }
+
+    for (part = 0; part < 2; part++) {
+        mbscpyfmt(&sql, "SELECT id, %s FROM gbs_book", displays);
+        if (part == 1) {
+            /* the NULL of DESC k1 left out by the seek */
+            mbscatfmt(&sql, " WHERE %s IS NULL", keys[0].column);
+        } else if (cursor) {
+            tail = db_page_seek(&sql, keys, nkey, cursor);
+        }
+        mbscat(&sql, " ORDER BY ");
+        for (i = 0; i < nkey; i++) {
+            mbscatfmt(&sql, "%s%s %s", i ? ", " : "", keys[i].column, keys[i].desc ? "DESC" : "ASC");
+        }
+        if (limit > 0) {
+            mbscatfmt(&sql, " LIMIT %d", limit - n);
+        }
+        mbscat(&sql, ";");
+
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+            gbs_error("invalid sql: %s, msg %s\n", sql, sqlite3_errmsg(db));
+            n = -GBS_ERROR_DB;
+            goto out;
+        }
+
+        for (i = 0; part == 0 && cursor && i < nkey; i++) {
+            sqlite3_bind_value(stmt, i + 1, sqlite3_column_value(cursor, i));
+        }
+
+        ncol = sqlite3_column_count(stmt);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            last = sqlite3_column_int(stmt, 0);
+            for (i = 1; i < ncol; i++) {
+                text = sqlite3_column_text(stmt, i);
+                gbs_print("%s%s", i > 1 ? "\t" : "", text ? (char *)text : "");
+            }
+            gbs_print("\n");
+            n++;
+        }
+
+        if (!tail || (limit > 0 && n == limit)) {
+            break;
+        }
+    }
+
+    if (limit > 0 && n == limit) {
+        fprintf(stderr, "next page: --after %d\n", last);
+    }
+
+out:
+    sqlite3_finalize(cursor);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    mbsfree(buf);
+    mbsfree(sql);
+    return n;
+}
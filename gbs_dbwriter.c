@@ -0,0 +1,409 @@
+#include "gbookshelf.h"
+
+/**
+ * gbs database writer, the write-behind queue of database mutations.
+ *
+ * the GTK dialogs push typed mutation records into the queue and return at
+ * once, the writer thread pops them, executes them with the db_xxx api and
+ * commits them in groups. The completion is reported back to the main loop
+ * through g_idle_add, so the callbacks run in the GTK thread.
+ *
+ * if the writer is not started (eg. in gbsmgr), the mutations are executed
+ * synchronously and the callbacks are called before return. Without an
+ * opened database (eg. a new catalog not saved yet) they are kept in the
+ * catalog only and reach the file with gbs_db_write.
+ *
+ * gbs_dbw_start opens g_db_ctx and hands it to the writer thread until
+ * gbs_dbw_stop, the GTK thread must not use the db_xxx api on it directly.
+ * Only the mutations the dialogs make go here: the dictionaries, the genres
+ * and the new books, books are neither modified nor deleted in the GUI.
+ *
+ * each mutation runs in its own savepoint, a failed one is rolled back alone
+ * and the others of its group are still committed.
+ */
+
+#define GBS_DBW_BATCH_MAX   256     /*< the max mutations in one transaction */
+#define GBS_DBW_SAVEPOINT   "gbs_dbw_op"
+
+enum {
+    GBS_DBW_FORMAT_INSERT,
+    GBS_DBW_FORMAT_DELETE,
+    GBS_DBW_LANGUAGE_INSERT,
+    GBS_DBW_LANGUAGE_DELETE,
+    GBS_DBW_PUBLISHER_INSERT,
+    GBS_DBW_PUBLISHER_DELETE,
+    GBS_DBW_GENRE_INSERT,
+    GBS_DBW_GENRE_DELETE,
+    GBS_DBW_BOOK_INSERT,
+    GBS_DBW_FLUSH,
+    GBS_DBW_QUIT,
+};
+
+typedef struct gbs_dbw_op_st {
+    int type;
+    int ret;
+    mbs_t args[3];
+    gbs_book_t *book;           /*< the private copy of the book, see gbs_dbw_book_insert */
+    GAsyncQueue *reply;         /*< only for GBS_DBW_FLUSH and GBS_DBW_QUIT */
+    gbs_dbw_done_t done;
+    void *data;
+} gbs_dbw_op_t;
+
+static GThread *g_dbw_thread = NULL;
+static GAsyncQueue *g_dbw_queue = NULL;
+
+static gbs_dbw_op_t *gbs_dbw_op_new(int type, char *arg0, char *arg1, char *arg2, gbs_dbw_done_t done, void *data)
+{
+    gbs_dbw_op_t *op;
+
+    op = malloc(sizeof(gbs_dbw_op_t));
+    if (op == NULL) {
+        return NULL;
+    }
+
+    memset(op, 0, sizeof(gbs_dbw_op_t));
+    op->type = type;
+    op->args[0] = arg0 ? mbsnew(arg0) : NULL;
+    op->args[1] = arg1 ? mbsnew(arg1) : NULL;
+    op->args[2] = arg2 ? mbsnew(arg2) : NULL;
+    op->done = done;
+    op->data = data;
+    return op;
+}
+
+static void gbs_dbw_book_free(gbs_book_t *book)
+{
+    int i;
+    dpa_t *dpas[] = { &book->_authors, &book->_keywords, &book->_urls, &book->_customs };
+    mbs_t *fields[] = {
+        &book->md5, &book->isbn, &book->format, &book->genre, &book->subgenre, &book->language,
+        &book->date, &book->version, &book->series, &book->title, &book->subtitle, &book->publisher,
+        &book->path, &book->contents, &book->introduction, &book->doi, &book->libgenid,
+        &book->repository, &book->urls, &book->authors, &book->keywords, &book->customs,
+    };
+
+    for (i = 0; i < sizeof(dpas) / sizeof(dpas[0]); i++) {
+        while (dpas[i]->used > 0) {
+            mbsfree(dpas[i]->array[--dpas[i]->used]);
+        }
+        free(dpas[i]->array - dpas[i]->shift);
+    }
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        mbsfree(*fields[i]);
+    }
+
+    free(book);
+}
+
+static void gbs_dbw_op_free(gbs_dbw_op_t *op)
+{
+    if (op) {
+        mbsfree(op->args[0]);
+        mbsfree(op->args[1]);
+        mbsfree(op->args[2]);
+        if (op->book) {
+            gbs_dbw_book_free(op->book);
+        }
+        free(op);
+    }
+}
+
+static int gbs_dbw_op_exec(gbs_dbw_op_t *op)
+{
+    int ret;
+
+    switch (op->type) {
+    case GBS_DBW_FORMAT_INSERT:
+        return db_format_insert(op->args[0], op->args[1]);
+    case GBS_DBW_FORMAT_DELETE:
+        return db_format_delete(op->args[0]);
+    case GBS_DBW_LANGUAGE_INSERT:
+        return db_language_insert(op->args[0], op->args[1]);
+    case GBS_DBW_LANGUAGE_DELETE:
+        return db_language_delete(op->args[0]);
+    case GBS_DBW_PUBLISHER_INSERT:
+        return db_publisher_insert(op->args[0], op->args[1], op->args[2]);
+    case GBS_DBW_PUBLISHER_DELETE:
+        return db_publisher_delete(op->args[0]);
+    case GBS_DBW_GENRE_INSERT:
+        return db_genre_insert(op->args[0], op->args[1], op->args[2]);
+    case GBS_DBW_GENRE_DELETE:
+        return db_genre_delete(op->args[0], op->args[1]);
+    case GBS_DBW_BOOK_INSERT:
+        ret = db_book_insert(op->book);
+        return ret < 0 ? ret : op->book->id;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * execute the mutation in a savepoint, so a failed one leaves nothing
+ * behind in the transaction of its group.
+ */
+static int gbs_dbw_op_run(gbs_dbw_op_t *op)
+{
+    int ret;
+
+    if (op->type == GBS_DBW_FLUSH || op->type == GBS_DBW_QUIT) {
+        return 0;
+    }
+
+    if (g_db_ctx == NULL) {
+        return -GBS_ERROR_NOT_EXIST;
+    }
+
+    ret = db_savepoint(GBS_DBW_SAVEPOINT);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = gbs_dbw_op_exec(op);
+    db_release(GBS_DBW_SAVEPOINT, ret < 0);
+    return ret;
+}
+
+static gboolean gbs_dbw_done_idle(gpointer data)
+{
+    gbs_dbw_op_t *op = (gbs_dbw_op_t *)data;
+
+    op->done(op->ret, op->data);
+    gbs_dbw_op_free(op);
+    return FALSE;
+}
+
+static void gbs_dbw_op_finish(gbs_dbw_op_t *op, int async)
+{
+    if (op->reply) {
+        g_async_queue_push(op->reply, op);
+        return;
+    }
+
+    if (op->done == NULL) {
+        gbs_dbw_op_free(op);
+    } else if (async) {
+        g_idle_add(gbs_dbw_done_idle, op);
+    } else {
+        gbs_dbw_done_idle(op);
+    }
+}
+
+static gpointer gbs_dbw_thread(gpointer data)
+{
+    int i;
+    int n;
+    int quit = 0;
+    gbs_dbw_op_t *op;
+    gbs_dbw_op_t *batch[GBS_DBW_BATCH_MAX];
+
+    while (!quit) {
+        /* wait for the first one, then take all the pending ones */
+        batch[0] = g_async_queue_pop(g_dbw_queue);
+        for (n = 1; n < GBS_DBW_BATCH_MAX; n++) {
+            batch[n] = g_async_queue_try_pop(g_dbw_queue);
+            if (batch[n] == NULL) {
+                break;
+            }
+        }
+
+        db_begin();
+        for (i = 0; i < n; i++) {
+            op = batch[i];
+            op->ret = gbs_dbw_op_run(op);
+        }
+
+        /* the committed ids are lost with the group, report the failure */
+        if (db_commit() < 0) {
+            for (i = 0; i < n; i++) {
+                if (batch[i]->ret >= 0) {
+                    batch[i]->ret = -GBS_ERROR_DB;
+                }
+            }
+        }
+
+        /* the barriers are released after the group was committed */
+        for (i = 0; i < n; i++) {
+            if (batch[i]->type == GBS_DBW_QUIT) {
+                quit = 1;
+            }
+            gbs_dbw_op_finish(batch[i], 1);
+        }
+    }
+
+    return NULL;
+}
+
+static int gbs_dbw_push(gbs_dbw_op_t *op)
+{
+    if (op == NULL) {
+        return -GBS_ERROR_NOMEM;
+    }
+
+    if (g_dbw_thread == NULL) {
+        op->ret = gbs_dbw_op_run(op);
+        gbs_dbw_op_finish(op, 0);
+        return 0;
+    }
+
+    g_async_queue_push(g_dbw_queue, op);
+    return 0;
+}
+
+/**
+ * push a barrier and wait until it's committed, all the mutations pushed
+ * before are in the database after return.
+ */
+static int gbs_dbw_barrier(int type)
+{
+    gbs_dbw_op_t *op;
+    GAsyncQueue *reply;
+
+    if (g_dbw_thread == NULL) {
+        return 0;
+    }
+
+    op = gbs_dbw_op_new(type, NULL, NULL, NULL, NULL, NULL);
+    if (op == NULL) {
+        return -GBS_ERROR_NOMEM;
+    }
+
+    reply = g_async_queue_new();
+    op->reply = reply;
+    g_async_queue_push(g_dbw_queue, op);
+    g_async_queue_pop(reply);
+    g_async_queue_unref(reply);
+    gbs_dbw_op_free(op);
+    return 0;
+}
+
+int gbs_dbw_flush(void)
+{
+    return gbs_dbw_barrier(GBS_DBW_FLUSH);
+}
+
+int gbs_dbw_format_insert(char *format, char *description, gbs_dbw_done_t done, void *data)
+{
+    return gbs_dbw_push(gbs_dbw_op_new(GBS_DBW_FORMAT_INSERT, format, description, NULL, done, data));
+}
+
+int gbs_dbw_format_delete(char *format, gbs_dbw_done_t done, void *data)
+{
+    return gbs_dbw_push(gbs_dbw_op_new(GBS_DBW_FORMAT_DELETE, format, NULL, NULL, done, data));
+}
+
+int gbs_dbw_language_insert(char *language, char *description, gbs_dbw_done_t done, void *data)
+{
+    return gbs_dbw_push(gbs_dbw_op_new(GBS_DBW_LANGUAGE_INSERT, language, description, NULL, done, data));
+}
+
+int gbs_dbw_language_delete(char *language, gbs_dbw_done_t done, void *data)
+{
+    return gbs_dbw_push(gbs_dbw_op_new(GBS_DBW_LANGUAGE_DELETE, language, NULL, NULL, done, data));
+}
+
+int gbs_dbw_publisher_insert(char *publisher, char *website, char *description, gbs_dbw_done_t done, void *data)
+{
+    return gbs_dbw_push(gbs_dbw_op_new(GBS_DBW_PUBLISHER_INSERT, publisher, website, description, done, data));
+}
+
+int gbs_dbw_publisher_delete(char *publisher, gbs_dbw_done_t done, void *data)
+{
+    return gbs_dbw_push(gbs_dbw_op_new(GBS_DBW_PUBLISHER_DELETE, publisher, NULL, NULL, done, data));
+}
+
+int gbs_dbw_genre_insert(char *path, char *genre, char *keywords, gbs_dbw_done_t done, void *data)
+{
+    return gbs_dbw_push(gbs_dbw_op_new(GBS_DBW_GENRE_INSERT, path, genre, keywords, done, data));
+}
+
+int gbs_dbw_genre_delete(char *path, char *genre, gbs_dbw_done_t done, void *data)
+{
+    return gbs_dbw_push(gbs_dbw_op_new(GBS_DBW_GENRE_DELETE, path, genre, NULL, done, data));
+}
+
+/**
+ * the writer inserts a copy of the book, the catalog may change or free it
+ * meanwhile. The new id is passed to done as ret, the caller looks the
+ * book up again with it.
+ */
+int gbs_dbw_book_insert(gbs_book_t *book, gbs_dbw_done_t done, void *data)
+{
+    gbs_dbw_op_t *op;
+
+    op = gbs_dbw_op_new(GBS_DBW_BOOK_INSERT, NULL, NULL, NULL, done, data);
+    if (op == NULL) {
+        return -GBS_ERROR_NOMEM;
+    }
+
+    op->book = malloc(sizeof(gbs_book_t));
+    if (op->book == NULL) {
+        gbs_dbw_op_free(op);
+        return -GBS_ERROR_NOMEM;
+    }
+
+    memset(op->book, 0, sizeof(gbs_book_t));
+    if (gbs_book_copy(op->book, book) < 0) {
+        gbs_dbw_op_free(op);
+        return -GBS_ERROR_NOMEM;
+    }
+
+    return gbs_dbw_push(op);
+}
+
+/**
+ * open the database filename and start the writer on it, the writer
+ * running on another database is stopped first.
+ */
+int gbs_dbw_start(char *filename)
+{
+    int ret;
+
+    gbs_dbw_stop();
+
+    ret = db_open(filename);
+    if (ret < 0) {
+        return ret;
+    }
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+    if (!g_thread_supported()) {
+        g_thread_init(NULL);
+    }
+#endif
+
+    g_dbw_queue = g_async_queue_new();
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    g_dbw_thread = g_thread_new("gbs-dbwriter", gbs_dbw_thread, NULL);
+#else
+    g_dbw_thread = g_thread_create(gbs_dbw_thread, NULL, TRUE, NULL);
+#endif
+    if (g_dbw_thread == NULL) {
+        g_async_queue_unref(g_dbw_queue);
+        g_dbw_queue = NULL;
+        db_close();
+        return -GBS_ERROR_NOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * flush the pending mutations, stop the writer and close its database.
+ */
+void gbs_dbw_stop(void)
+{
+    if (g_dbw_thread == NULL) {
+        return;
+    }
+
+    gbs_dbw_barrier(GBS_DBW_QUIT);
+    g_thread_join(g_dbw_thread);
+    g_dbw_thread = NULL;
+
+    g_async_queue_unref(g_dbw_queue);
+    g_dbw_queue = NULL;
+    db_close();
+}
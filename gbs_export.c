@@ -0,0 +1,959 @@
+#include "gbookshelf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/**
+ * gbs export and import, stream the tables to and from JSONL or CSV.
+ *
+ * the rows are stepped out of sqlite and escaped straight into one fixed
+ * output buffer which is written with large write() calls, the input is
+ * read in the same sized chunks and parsed record by record in place, so
+ * the memory is constant whatever the size of the table.
+ */
+
+#define GBS_EXPORT_BUFSIZE      (256 * 1024)
+#define GBS_IMPORT_BATCH        10000       /*< rows in one transaction */
+#define GBS_IMPORT_FIELD_MAX    64
+
+typedef struct gbs_outbuf_st {
+    int fd;
+    int len;
+    int error;
+    char buf[GBS_EXPORT_BUFSIZE];
+} gbs_outbuf_t;
+
+typedef struct gbs_inbuf_st {
+    int fd;
+    int pos;
+    int len;
+    char *rec;                  /*< the current record, grows to the longest one */
+    int rec_len;
+    int rec_size;
+    char buf[GBS_EXPORT_BUFSIZE];
+} gbs_inbuf_t;
+
+enum {
+    GBS_FIELD_NULL,
+    GBS_FIELD_TEXT,
+    GBS_FIELD_NUMBER,
+};
+
+typedef struct gbs_field_st {
+    char *key;
+    char *value;
+    int type;
+} gbs_field_t;
+
+static char *g_export_tables[] = {
+    "gbs_book", "gbs_format", "gbs_language", "gbs_publisher", "gbs_genre",
+    NULL
+};
+
+/**
+ * accept the table name with or without the gbs_ prefix.
+ */
+static char *gbs_export_table(char *table)
+{
+    int i;
+
+    if (table == NULL) {
+        return g_export_tables[0];
+    }
+
+    for (i = 0; g_export_tables[i]; i++) {
+        if (!strcmp(table, g_export_tables[i]) || !strcmp(table, g_export_tables[i] + 4)) {
+            return g_export_tables[i];
+        }
+    }
+
+    gbs_error("unknown table %s, use book, format, language, publisher or genre\n", table);
+    return NULL;
+}
+
+static void outbuf_flush(gbs_outbuf_t *ob)
+{
+    int ret;
+    int off = 0;
+
+    while (off < ob->len && !ob->error) {
+        ret = write(ob->fd, ob->buf + off, ob->len - off);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            gbs_error("write failed, %s\n", strerror(errno));
+            ob->error = 1;
+            break;
+        }
+        off += ret;
+    }
+
+    ob->len = 0;
+}
+
+static inline void outbuf_putn(gbs_outbuf_t *ob, const char *str, int n)
+{
+    if (ob->len + n > GBS_EXPORT_BUFSIZE) {
+        outbuf_flush(ob);
+        while (n > GBS_EXPORT_BUFSIZE) {
+            memcpy(ob->buf, str, GBS_EXPORT_BUFSIZE);
+            ob->len = GBS_EXPORT_BUFSIZE;
+            outbuf_flush(ob);
+            str += GBS_EXPORT_BUFSIZE;
+            n -= GBS_EXPORT_BUFSIZE;
+        }
+    }
+
+    memcpy(ob->buf + ob->len, str, n);
+    ob->len += n;
+}
+
+static inline void outbuf_putc(gbs_outbuf_t *ob, char c)
+{
+    if (ob->len == GBS_EXPORT_BUFSIZE) {
+        outbuf_flush(ob);
+    }
+    ob->buf[ob->len++] = c;
+}
+
+static inline void outbuf_puts(gbs_outbuf_t *ob, const char *str)
+{
+    outbuf_putn(ob, str, strlen(str));
+}
+
+/**
+ * the same escapes as mbsescapejson, plus \u00XX for the other control
+ * characters, the runs of plain characters are copied at once.
+ */
+static void outbuf_json_string(gbs_outbuf_t *ob, const unsigned char *str)
+{
+    char esc[8];
+    const unsigned char *run = str;
+
+    outbuf_putc(ob, '"');
+    for (; *str; str++) {
+        if (*str >= 0x20 && *str != '"' && *str != '\\' && *str != '/') {
+            continue;
+        }
+
+        outbuf_putn(ob, (const char *)run, str - run);
+        run = str + 1;
+        switch (*str) {
+        case '"': outbuf_putn(ob, "\\\"", 2); break;
+        case '\\': outbuf_putn(ob, "\\\\", 2); break;
+        case '/': outbuf_putn(ob, "\\/", 2); break;
+        case '\b': outbuf_putn(ob, "\\b", 2); break;
+        case '\f': outbuf_putn(ob, "\\f", 2); break;
+        case '\n': outbuf_putn(ob, "\\n", 2); break;
+        case '\r': outbuf_putn(ob, "\\r", 2); break;
+        case '\t': outbuf_putn(ob, "\\t", 2); break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%04x", *str);
+            outbuf_putn(ob, esc, 6);
+            break;
+        }
+    }
+    outbuf_putn(ob, (const char *)run, str - run);
+    outbuf_putc(ob, '"');
+}
+
+/**
+ * the empty string is quoted to tell it from NULL, which is empty.
+ */
+static void outbuf_csv_string(gbs_outbuf_t *ob, const unsigned char *str)
+{
+    const unsigned char *run;
+
+    if (*str && strpbrk((const char *)str, ",\"\r\n") == NULL) {
+        outbuf_puts(ob, (const char *)str);
+        return;
+    }
+
+    outbuf_putc(ob, '"');
+    for (run = str; *str; str++) {
+        if (*str == '"') {
+            outbuf_putn(ob, (const char *)run, str - run + 1);
+            run = str;
+        }
+    }
+    outbuf_putn(ob, (const char *)run, str - run);
+    outbuf_putc(ob, '"');
+}
+
+static void gbs_export_row(gbs_outbuf_t *ob, sqlite3_stmt *stmt, int format)
+{
+    int i;
+    int type;
+    int first = 1;
+
+    if (format == GBS_EXPORT_JSONL) {
+        outbuf_putc(ob, '{');
+    }
+
+    for (i = 0; i < sqlite3_column_count(stmt); i++) {
+        type = sqlite3_column_type(stmt, i);
+        if (format == GBS_EXPORT_JSONL) {
+            if (type == SQLITE_NULL) {
+                continue;
+            }
+            if (!first) {
+                outbuf_putc(ob, ',');
+            }
+            first = 0;
+            outbuf_json_string(ob, (const unsigned char *)sqlite3_column_name(stmt, i));
+            outbuf_putc(ob, ':');
+        } else if (i) {
+            outbuf_putc(ob, ',');
+        }
+
+        if (type == SQLITE_INTEGER || type == SQLITE_FLOAT) {
+            outbuf_puts(ob, (const char *)sqlite3_column_text(stmt, i));
+        } else if (type != SQLITE_NULL) {
+            if (format == GBS_EXPORT_JSONL) {
+                outbuf_json_string(ob, sqlite3_column_text(stmt, i));
+            } else {
+                outbuf_csv_string(ob, sqlite3_column_text(stmt, i));
+            }
+        }
+    }
+
+    if (format == GBS_EXPORT_JSONL) {
+        outbuf_putc(ob, '}');
+    }
+    outbuf_putc(ob, '\n');
+}
+
+/**
+ * export the table of gbs database into output, "-" is the stdout.
+ * return the number of rows exported.
+ */
+int gbs_export(char *filename, char *table, int format, char *output)
+{
+    int i;
+    int n = 0;
+    sqlite3 *db;
+    mbs_t sql = NULL;
+    sqlite3_stmt *stmt = NULL;
+    gbs_outbuf_t *ob;
+
+    table = gbs_export_table(table);
+    if (table == NULL) {
+        return -GBS_ERROR_INVAL;
+    }
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+
+    mbscpyfmt(&sql, "SELECT * FROM %s ORDER BY id;", table);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        gbs_error("invalid sql: %s, msg %s\n", sql, sqlite3_errmsg(db));
+        mbsfree(sql);
+        sqlite3_close(db);
+        return -GBS_ERROR_DB;
+    }
+    mbsfree(sql);
+
+    ob = malloc(sizeof(gbs_outbuf_t));
+    if (ob == NULL) {
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+        return -GBS_ERROR_NOMEM;
+    }
+
+    ob->len = 0;
+    ob->error = 0;
+    if (!strcmp(output, "-")) {
+        ob->fd = STDOUT_FILENO;
+    } else {
+        ob->fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (ob->fd < 0) {
+            gbs_error("open %s failed, %s\n", output, strerror(errno));
+            free(ob);
+            sqlite3_finalize(stmt);
+            sqlite3_close(db);
+            return -GBS_ERROR_FILE;
+        }
+    }
+
+    if (format == GBS_EXPORT_CSV) {
+        for (i = 0; i < sqlite3_column_count(stmt); i++) {
+            if (i) {
+                outbuf_putc(ob, ',');
+            }
+            outbuf_csv_string(ob, (const unsigned char *)sqlite3_column_name(stmt, i));
+        }
+        outbuf_putc(ob, '\n');
+    }
+
+    while (!ob->error && sqlite3_step(stmt) == SQLITE_ROW) {
+        gbs_export_row(ob, stmt, format);
+        n++;
+    }
+
+    outbuf_flush(ob);
+    if (ob->error) {
+        n = -GBS_ERROR_FILE;
+    }
+    if (ob->fd != STDOUT_FILENO) {
+        close(ob->fd);
+    }
+
+    free(ob);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return n;
+}
+
+static int inbuf_fill(gbs_inbuf_t *ib)
+{
+    int ret;
+
+    do {
+        ret = read(ib->fd, ib->buf, GBS_EXPORT_BUFSIZE);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        gbs_error("read failed, %s\n", strerror(errno));
+        return -GBS_ERROR_FILE;
+    }
+
+    ib->pos = 0;
+    ib->len = ret;
+    return ret;
+}
+
+static int inbuf_append(gbs_inbuf_t *ib, char *str, int n)
+{
+    char *rec;
+    int size;
+
+    if (ib->rec_len + n + 1 > ib->rec_size) {
+        size = ib->rec_size ? ib->rec_size : 4096;
+        while (size < ib->rec_len + n + 1) {
+            size *= 2;
+        }
+        rec = realloc(ib->rec, size);
+        if (rec == NULL) {
+            return -GBS_ERROR_NOMEM;
+        }
+        ib->rec = rec;
+        ib->rec_size = size;
+    }
+
+    memcpy(ib->rec + ib->rec_len, str, n);
+    ib->rec_len += n;
+    ib->rec[ib->rec_len] = 0;
+    return 0;
+}
+
+/**
+ * read the next record into ib->rec without the line end, the newlines
+ * in the quoted field of CSV don't end the record.
+ * return the record length, or -1 if there is no more record.
+ */
+static int inbuf_record(gbs_inbuf_t *ib, int format)
+{
+    int i;
+    int ret;
+    int quoted = 0;
+    char *line;
+
+    ib->rec_len = 0;
+    for (;;) {
+        if (ib->pos == ib->len) {
+            ret = inbuf_fill(ib);
+            if (ret < 0) {
+                return ret;
+            }
+            if (ret == 0) {
+                return ib->rec_len ? ib->rec_len : -1;
+            }
+        }
+
+        line = ib->buf + ib->pos;
+        if (format == GBS_EXPORT_JSONL) {
+            char *end = memchr(line, '\n', ib->len - ib->pos);
+            i = end ? end - line : ib->len - ib->pos;
+        } else {
+            for (i = 0; i < ib->len - ib->pos; i++) {
+                if (line[i] == '"') {
+                    quoted = !quoted;
+                } else if (line[i] == '\n' && !quoted) {
+                    break;
+                }
+            }
+        }
+
+        ret = inbuf_append(ib, line, i);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (ib->pos + i < ib->len) {
+            ib->pos += i + 1;
+            if (ib->rec_len && ib->rec[ib->rec_len - 1] == '\r') {
+                ib->rec[--ib->rec_len] = 0;
+            }
+            return ib->rec_len;
+        }
+        ib->pos = ib->len;
+    }
+}
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* the 4 hex digits of a \u escape at p, or -1 */
+static int json_hex4(char *p)
+{
+    int i;
+    int u = 0;
+
+    for (i = 0; i < 4; i++) {
+        if (hexval(p[i]) < 0) {
+            return -1;
+        }
+        u = (u << 4) | hexval(p[i]);
+    }
+    return u;
+}
+
+/**
+ * unescape the json string starting after the quote in place, the result
+ * is never longer than the source. a surrogate pair is one character, a
+ * lone surrogate becomes U+FFFD.
+ * return the position after the closing quote, or NULL if it's invalid.
+ */
+static char *json_unescape(char *p)
+{
+    int lo;
+    unsigned int u;
+    char *q = p;
+
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            *q++ = *p++;
+            continue;
+        }
+
+        p++;
+        switch (*p) {
+        case 'b': *q++ = '\b'; break;
+        case 'f': *q++ = '\f'; break;
+        case 'n': *q++ = '\n'; break;
+        case 'r': *q++ = '\r'; break;
+        case 't': *q++ = '\t'; break;
+        case 'u':
+            if ((lo = json_hex4(p + 1)) < 0) {
+                return NULL;
+            }
+            u = lo;
+            p += 4;
+            if (u >= 0xd800 && u < 0xdc00 && p[1] == '\\' && p[2] == 'u'
+                    && (lo = json_hex4(p + 3)) >= 0xdc00 && lo < 0xe000) {
+                u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+                p += 6;
+            } else if (u >= 0xd800 && u < 0xe000) {
+                u = 0xfffd;
+            }
+
+            if (u < 0x80) {
+                *q++ = u;
+            } else if (u < 0x800) {
+                *q++ = 0xc0 | (u >> 6);
+                *q++ = 0x80 | (u & 0x3f);
+            } else if (u < 0x10000) {
+                *q++ = 0xe0 | (u >> 12);
+                *q++ = 0x80 | ((u >> 6) & 0x3f);
+                *q++ = 0x80 | (u & 0x3f);
+            } else {
+                *q++ = 0xf0 | (u >> 18);
+                *q++ = 0x80 | ((u >> 12) & 0x3f);
+                *q++ = 0x80 | ((u >> 6) & 0x3f);
+                *q++ = 0x80 | (u & 0x3f);
+            }
+            break;
+        case 0:
+            return NULL;
+        default:
+            *q++ = *p;
+            break;
+        }
+        p++;
+    }
+
+    if (*p != '"') {
+        return NULL;
+    }
+
+    *q = 0;
+    return p + 1;
+}
+
+static char *skip_space(char *p)
+{
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * parse the flat json object in place, the nested values are not allowed.
+ * return the number of fields, or negative if it's invalid.
+ */
+static int json_parse_record(char *rec, gbs_field_t *fields)
+{
+    int n = 0;
+    char *end = NULL;           /*< the end of the number to terminate */
+    char *p = skip_space(rec);
+
+    if (*p++ != '{') {
+        return -GBS_ERROR_INVAL;
+    }
+
+    p = skip_space(p);
+    if (*p == '}') {
+        return 0;
+    }
+
+    while (n < GBS_IMPORT_FIELD_MAX) {
+        if (*p++ != '"') {
+            return -GBS_ERROR_INVAL;
+        }
+        fields[n].key = p;
+        p = json_unescape(p);
+        if (p == NULL) {
+            return -GBS_ERROR_INVAL;
+        }
+
+        p = skip_space(p);
+        if (*p++ != ':') {
+            return -GBS_ERROR_INVAL;
+        }
+        p = skip_space(p);
+
+        if (*p == '"') {
+            fields[n].type = GBS_FIELD_TEXT;
+            fields[n].value = p + 1;
+            p = json_unescape(p + 1);
+            if (p == NULL) {
+                return -GBS_ERROR_INVAL;
+            }
+        } else {
+            fields[n].value = p;
+            while (*p && *p != ',' && *p != '}' && *p != ' ' && *p != '\t') {
+                p++;
+            }
+            end = p;
+            if (!strncmp(fields[n].value, "null", 4)) {
+                fields[n].type = GBS_FIELD_NULL;
+            } else if (!strncmp(fields[n].value, "true", 4)) {
+                fields[n].type = GBS_FIELD_NUMBER;
+                fields[n].value = "1";
+            } else if (!strncmp(fields[n].value, "false", 5)) {
+                fields[n].type = GBS_FIELD_NUMBER;
+                fields[n].value = "0";
+            } else {
+                fields[n].type = GBS_FIELD_NUMBER;
+            }
+        }
+
+        n++;
+        p = skip_space(p);
+        if (*p != ',' && *p != '}') {
+            return -GBS_ERROR_INVAL;
+        }
+        if (*p == '}') {
+            if (end) {
+                *end = 0;
+            }
+            return n;
+        }
+        p++;
+        if (end) {
+            *end = 0;
+        }
+        end = NULL;
+        p = skip_space(p);
+    }
+
+    return -GBS_ERROR_INVAL;
+}
+
+/**
+ * split the CSV record in place, the quoted field is unescaped, the empty
+ * unquoted field is NULL.
+ */
+static int csv_parse_record(char *rec, gbs_field_t *fields)
+{
+    int n = 0;
+    char *p = rec;
+    char *q;
+
+    while (n < GBS_IMPORT_FIELD_MAX) {
+        if (*p == '"') {
+            fields[n].type = GBS_FIELD_TEXT;
+            fields[n].value = q = ++p;
+            while (*p) {
+                if (*p == '"') {
+                    if (p[1] != '"') {
+                        break;
+                    }
+                    p++;
+                }
+                *q++ = *p++;
+            }
+            if (*p != '"') {
+                return -GBS_ERROR_INVAL;
+            }
+            p++;
+            *q = 0;
+        } else {
+            fields[n].value = p;
+            while (*p && *p != ',') {
+                p++;
+            }
+            fields[n].type = p == fields[n].value ? GBS_FIELD_NULL : GBS_FIELD_TEXT;
+        }
+
+        n++;
+        if (*p == 0) {
+            return n;
+        }
+        if (*p != ',') {
+            return -GBS_ERROR_INVAL;
+        }
+        *p++ = 0;
+    }
+
+    return -GBS_ERROR_INVAL;
+}
+
+/**
+ * the id column is dropped, the rows get the new ids of target database.
+ */
+static int gbs_import_columns(gbs_field_t *fields, int n, mbs_t *columns)
+{
+    int i;
+
+    mbscpy(columns, "");
+    for (i = 0; i < n; i++) {
+        if (!db_is_column_name(fields[i].key)) {
+            gbs_error("invalid column name %s\n", fields[i].key);
+            return -GBS_ERROR_INVAL;
+        }
+        if (!strcasecmp(fields[i].key, "id")) {
+            continue;
+        }
+        mbscatfmt(columns, "%s%s", mbslen(*columns) ? "," : "", fields[i].key);
+    }
+
+    return 0;
+}
+
+static int gbs_import_prepare(sqlite3 *db, char *table, gbs_field_t *fields, int n, sqlite3_stmt **stmt)
+{
+    int i;
+    int first = 1;
+    mbs_t sql = NULL;
+
+    mbscpyfmt(&sql, "INSERT INTO %s(", table);
+    for (i = 0; i < n; i++) {
+        if (strcasecmp(fields[i].key, "id")) {
+            mbscatfmt(&sql, "%s%s", first ? "" : ", ", fields[i].key);
+            first = 0;
+        }
+    }
+    mbscat(&sql, ") VALUES (");
+    for (first = 1, i = 0; i < n; i++) {
+        if (strcasecmp(fields[i].key, "id")) {
+            mbscat(&sql, first ? "?" : ", ?");
+            first = 0;
+        }
+    }
+    mbscat(&sql, ");");
+
+    sqlite3_finalize(*stmt);
+    *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, stmt, NULL) != SQLITE_OK) {
+        gbs_error("invalid sql: %s, msg %s\n", sql, sqlite3_errmsg(db));
+        mbsfree(sql);
+        return -GBS_ERROR_DB;
+    }
+
+    mbsfree(sql);
+    return 0;
+}
+
+static int gbs_import_row(sqlite3 *db, sqlite3_stmt *stmt, gbs_field_t *fields, int n)
+{
+    int i;
+    int idx = 1;
+    char *end;
+    sqlite3_int64 ival;
+
+    sqlite3_reset(stmt);
+    for (i = 0; i < n; i++) {
+        if (!strcasecmp(fields[i].key, "id")) {
+            continue;
+        }
+
+        if (fields[i].type == GBS_FIELD_NULL) {
+            sqlite3_bind_null(stmt, idx++);
+        } else if (fields[i].type == GBS_FIELD_NUMBER) {
+            ival = strtoll(fields[i].value, &end, 10);
+            if (*end == 0) {
+                sqlite3_bind_int64(stmt, idx++, ival);
+            } else {
+                sqlite3_bind_double(stmt, idx++, strtod(fields[i].value, NULL));
+            }
+        } else {
+            sqlite3_bind_text(stmt, idx++, fields[i].value, -1, SQLITE_STATIC);
+        }
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        gbs_error("insert failed, msg %s\n", sqlite3_errmsg(db));
+        return -GBS_ERROR_DB;
+    }
+
+    return 0;
+}
+
+/**
+ * commit the batch, the child tables of the books imported in the batch are
+ * rebuilt before, so a committed batch is complete. maxid is the max id of
+ * gbs_book committed before, it's updated after the commit.
+ */
+static int gbs_import_commit(sqlite3 *db, char *table, int *maxid)
+{
+    int ret;
+    char *msg = NULL;
+    mbs_t cond = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    if (!strcmp(table, "gbs_book")) {
+        mbscpyfmt(&cond, "id > %d", *maxid);
+        ret = db_child_rebuild(db, cond);
+        mbsfree(cond);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("commit failed, msg %s\n", msg);
+        sqlite3_free(msg);
+        return -GBS_ERROR_DB;
+    }
+
+    if (!strcmp(table, "gbs_book")) {
+        sqlite3_prepare_v2(db, "SELECT ifnull(max(id), 0) FROM gbs_book;", -1, &stmt, NULL);
+        if (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+            *maxid = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    return 0;
+}
+
+/**
+ * import the rows from input into the table of gbs database, "-" is the
+ * stdin. The rows are committed in batches of GBS_IMPORT_BATCH, the batches
+ * committed before a failure are kept and their number of rows is reported.
+ * return the number of rows imported.
+ */
+int gbs_import(char *filename, char *table, int format, char *input)
+{
+    int i;
+    int n;
+    int ret = 0;
+    int rows = 0;
+    int committed = 0;
+    int nheader = 0;
+    int maxid = 0;
+    sqlite3 *db;
+    mbs_t columns = NULL;
+    mbs_t prepared = NULL;
+    sqlite3_stmt *stmt = NULL;
+    gbs_inbuf_t *ib;
+    gbs_field_t fields[GBS_IMPORT_FIELD_MAX];
+    char *header[GBS_IMPORT_FIELD_MAX];
+
+    table = gbs_export_table(table);
+    if (table == NULL) {
+        return -GBS_ERROR_INVAL;
+    }
+
+    ib = malloc(sizeof(gbs_inbuf_t));
+    if (ib == NULL) {
+        return -GBS_ERROR_NOMEM;
+    }
+    memset(ib, 0, offsetof(gbs_inbuf_t, buf));
+
+    if (!strcmp(input, "-")) {
+        ib->fd = STDIN_FILENO;
+    } else {
+        ib->fd = open(input, O_RDONLY | O_BINARY);
+        if (ib->fd < 0) {
+            gbs_error("open %s failed, %s\n", input, strerror(errno));
+            free(ib);
+            return -GBS_ERROR_FILE;
+        }
+    }
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        ret = -GBS_ERROR_DB;
+        goto out;
+    }
+
+    if (db_is_sharded(db)) {
+        gbs_error("%s is sharded, import into the shards one by one\n", filename);
+        ret = -GBS_ERROR_INVAL;
+        goto out;
+    }
+
+    ret = db_create_tables(db);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (!strcmp(table, "gbs_book")) {
+        sqlite3_prepare_v2(db, "SELECT ifnull(max(id), 0) FROM gbs_book;", -1, &stmt, NULL);
+        if (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+            maxid = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+    }
+
+    if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+        gbs_error("begin failed, msg %s\n", sqlite3_errmsg(db));
+        ret = -GBS_ERROR_DB;
+        goto out;
+    }
+
+    while ((n = inbuf_record(ib, format)) >= 0) {
+        if (n == 0) {
+            continue;
+        }
+
+        if (format == GBS_EXPORT_CSV) {
+            n = csv_parse_record(ib->rec, fields);
+            if (n < 0) {
+                gbs_error("invalid record %d: %s\n", rows + 1, ib->rec);
+                ret = n;
+                break;
+            }
+            if (nheader == 0) {
+                /* the header is kept for the whole file */
+                for (i = 0; i < n; i++) {
+                    header[i] = strdup(fields[i].value);
+                }
+                nheader = n;
+                continue;
+            }
+            if (n != nheader) {
+                gbs_error("record %d has %d fields, but the header has %d\n", rows + 1, n, nheader);
+                ret = -GBS_ERROR_INVAL;
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                fields[i].key = header[i];
+            }
+        } else {
+            n = json_parse_record(ib->rec, fields);
+        }
+
+        if (n < 0) {
+            gbs_error("invalid record %d: %s\n", rows + 1, ib->rec);
+            ret = n;
+            break;
+        }
+
+        /* the json records may have different keys, prepare again if so */
+        ret = gbs_import_columns(fields, n, &columns);
+        if (ret < 0) {
+            break;
+        }
+        if (prepared == NULL || strcmp(prepared, columns)) {
+            ret = gbs_import_prepare(db, table, fields, n, &stmt);
+            if (ret < 0) {
+                break;
+            }
+            mbscpy(&prepared, columns);
+        }
+
+        ret = gbs_import_row(db, stmt, fields, n);
+        if (ret < 0) {
+            break;
+        }
+
+        if (++rows % GBS_IMPORT_BATCH == 0) {
+            ret = gbs_import_commit(db, table, &maxid);
+            if (ret < 0) {
+                break;
+            }
+            committed = rows;
+            if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+                gbs_error("begin failed, msg %s\n", sqlite3_errmsg(db));
+                ret = -GBS_ERROR_DB;
+                goto out;
+            }
+        }
+    }
+
+    if (n < -1) {
+        ret = n;
+    }
+
+    if (ret == 0) {
+        ret = gbs_import_commit(db, table, &maxid);
+    }
+
+    if (ret == 0) {
+        ret = rows;
+    } else {
+        /* the transaction may be gone after a failed commit, no harm then */
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    }
+
+out:
+    if (ret < 0) {
+        gbs_error("import %s failed, %d rows committed\n", input, committed);
+    }
+
+    for (i = 0; i < nheader; i++) {
+        free(header[i]);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    if (ib->fd != STDIN_FILENO) {
+        close(ib->fd);
+    }
+    free(ib->rec);
+    free(ib);
+    mbsfree(columns);
+    mbsfree(prepared);
+    return ret;
+}
@@ -55,7 +55,8 @@ int gbs_format_combox_insert_new(GtkComboBox * combo, char *suffix)
 
     if (!actived) {
         gchar *nfmt = g_ascii_strup(suffix, -1);
-        gbs_format_insert(nfmt, "System insert automatically");
+        if (gbs_format_insert(nfmt, "System insert automatically") == 0)
+            gbs_dbw_format_insert(nfmt, "System insert automatically", NULL, NULL);
         gtk_combo_box_append_text(combo, nfmt);
         gtk_combo_box_set_active(combo, index);
         g_free(nfmt);
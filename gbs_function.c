@@ -0,0 +1,288 @@
+#include "gbookshelf.h"
+#include "gbs_abbr.h"
+
+/**
+ * gbs sql functions, the filename normalization, the genre classification
+ * and the abbreviation lookup, so the whole database can be re-normalized
+ * or re-classified in one sql pass, eg.
+ *
+ *   UPDATE gbs_book SET genre = gbs_genre(title), subgenre = gbs_subgenre(title);
+ *
+ * gbs_book of a sharded database is a read only view, run it on every shard
+ * instead, eg. UPDATE shard0.gbs_book SET genre = gbs_genre(title). The
+ * child tables don't follow an UPDATE of authors, keywords, urls or
+ * customs, reindex the database after it.
+ */
+
+#ifdef SQLITE_DETERMINISTIC
+#define GBS_FUNC_FLAGS      (SQLITE_UTF8 | SQLITE_DETERMINISTIC)
+#else
+#define GBS_FUNC_FLAGS      SQLITE_UTF8
+#endif
+
+/**
+ * the genres of one connection, loaded from its gbs_genre table on the first
+ * call and again after gbs_genre changed, which is told by the seq of its
+ * latest change in gbs_changelog, by this connection or any other. The seq
+ * is looked up only after this connection wrote gbs_genre or the database
+ * file was committed to, not for every row. The GTK catalog is not touched
+ * since the writer thread calls us too.
+ */
+typedef struct gbs_func_genres_st {
+    int loaded;
+    int stale;          /** gbs_genre written by this connection */
+    uint32_t counter;   /** the change counter of the file at the seq */
+    sqlite3_int64 seq;
+    struct list_head list;
+    gbs_genre_matcher_t *matcher;
+} gbs_func_genres_t;
+
+static void gbs_func_genres_clear(gbs_func_genres_t *genres)
+{
+    gbs_genre_t *cur, *next;
+
+    gbs_genre_matcher_free(genres->matcher);
+    genres->matcher = NULL;
+    list_for_each_entry_safe(cur, next, &genres->list, node) {
+        list_del(&cur->node);
+        gbs_genre_free(cur);
+    }
+    genres->loaded = 0;
+}
+
+static void gbs_func_genres_free(void *data)
+{
+    gbs_func_genres_t *genres = (gbs_func_genres_t *)data;
+
+    gbs_func_genres_clear(genres);
+    free(genres);
+}
+
+/* the update hook of the connection, it's told of the rows changed by triggers too */
+static void gbs_func_genres_hook(void *data, int op, char const *schema, char const *table, sqlite3_int64 rowid)
+{
+    gbs_func_genres_t *genres = (gbs_func_genres_t *)data;
+
+    if (!strcmp(table, "gbs_genre")) {
+        genres->stale = 1;
+    }
+}
+
+/**
+ * the change counter in the header of the main database file, every commit
+ * bumps it. 0 if there's no file.
+ */
+static uint32_t gbs_func_counter(sqlite3 *db)
+{
+    uint8_t hdr[4];
+    sqlite3_file *file = NULL;
+
+    if (sqlite3_file_control(db, "main", SQLITE_FCNTL_FILE_POINTER, &file) != SQLITE_OK
+            || file == NULL || file->pMethods == NULL
+            || file->pMethods->xRead(file, hdr, sizeof(hdr), 24) != SQLITE_OK) {
+        return 0;
+    }
+
+    return (hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+}
+
+static int gbs_func_genres_load(sqlite3 *db, gbs_func_genres_t *genres)
+{
+    int rc;
+    sqlite3_stmt *stmt = NULL;
+    gbs_genre_t *gen;
+
+    genres->loaded = 1;
+    if (sqlite3_prepare_v2(db, "SELECT path, genre, keywords FROM gbs_genre ORDER BY id;", -1, &stmt, NULL) != SQLITE_OK) {
+        return -GBS_ERROR_DB;
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (sqlite3_column_text(stmt, 2) == NULL || sqlite3_column_bytes(stmt, 2) == 0) {
+            continue;
+        }
+
+        gen = gbs_genre_alloc();
+        if (gen == NULL) {
+            sqlite3_finalize(stmt);
+            return -GBS_ERROR_NOMEM;
+        }
+
+        gen->path = mbsnew((char *)sqlite3_column_text(stmt, 0));
+        gen->genre = mbsnew((char *)sqlite3_column_text(stmt, 1));
+        gen->keywords = mbsnew((char *)sqlite3_column_text(stmt, 2));
+        if (!gbs_genre_literal(gen->keywords)) {
+            gen->pattern = gbs_genre_pattern(gen->keywords);
+            if (gen->pattern == NULL) {
+                gbs_genre_free(gen);
+                continue;
+            }
+        }
+        list_add_tail(&gen->node, &genres->list);
+    }
+
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        return -GBS_ERROR_DB;
+    }
+
+    genres->matcher = gbs_genre_matcher_new(&genres->list);
+    return genres->matcher ? 0 : -GBS_ERROR_NOMEM;
+}
+
+/**
+ * the genre matched leftmost in the text, the smaller id wins a tie.
+ */
+static gbs_genre_t *gbs_func_genre_match(sqlite3_context *ctx, sqlite3_value *value)
+{
+    int len;
+    char *text;
+    uint32_t counter;
+    sqlite3_int64 seq;
+    sqlite3 *db = sqlite3_context_db_handle(ctx);
+    gbs_func_genres_t *genres = (gbs_func_genres_t *)sqlite3_user_data(ctx);
+
+    text = (char *)sqlite3_value_text(value);
+    len = sqlite3_value_bytes(value);
+    if (text == NULL || len == 0) {
+        return NULL;
+    }
+
+    /* the db without gbs_changelog is loaded only once */
+    counter = gbs_func_counter(db);
+    if (!genres->loaded || genres->stale || counter != genres->counter) {
+        genres->stale = 0;
+        genres->counter = counter;
+        seq = db_changes_last_of(db, "gbs_genre");
+        if (genres->loaded && seq != genres->seq && seq >= 0) {
+            gbs_func_genres_clear(genres);
+        }
+        if (!genres->loaded) {
+            gbs_func_genres_load(db, genres);
+            genres->seq = seq;
+        }
+    }
+
+    return gbs_genre_matcher_match(genres->matcher, text, len);
+}
+
+static void gbs_genre_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    gbs_genre_t *gen = gbs_func_genre_match(ctx, argv[0]);
+
+    if (gen == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    sqlite3_result_text(ctx, gen->path, -1, SQLITE_TRANSIENT);
+}
+
+static void gbs_subgenre_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    gbs_genre_t *gen = gbs_func_genre_match(ctx, argv[0]);
+
+    if (gen == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    sqlite3_result_text(ctx, gen->genre, -1, SQLITE_TRANSIENT);
+}
+
+static void gbs_uniform_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    char *name;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    /* uniform replaces the malloc'ed input with the normalized one */
+    name = strdup((char *)sqlite3_value_text(argv[0]));
+    if (name == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    uniform(&name);
+    sqlite3_result_text(ctx, name, -1, SQLITE_TRANSIENT);
+    free(name);
+}
+
+static void gbs_abbr_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    char *word;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    /* the dictionary is keyed by lowercase, and dict_search may capitalize the word in place */
+    word = strdup((char *)sqlite3_value_text(argv[0]));
+    if (word == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    strtolower(word);
+    sqlite3_result_text(ctx, dict_search(word), -1, SQLITE_TRANSIENT);
+    free(word);
+}
+
+/**
+ * register gbs_uniform, gbs_genre, gbs_subgenre and gbs_abbr on the
+ * connection, it's called by db_open_file.
+ */
+int db_functions_attach(sqlite3 *db)
+{
+    int i;
+    gbs_func_genres_t *genres;
+    static struct {
+        char *name;
+        void (*func)(sqlite3_context *, int, sqlite3_value **);
+    } funcs[] = {
+        { "gbs_uniform", gbs_uniform_func },
+        { "gbs_abbr", gbs_abbr_func },
+    };
+
+    dict_init();
+    for (i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
+        if (sqlite3_create_function_v2(db, funcs[i].name, 1, GBS_FUNC_FLAGS, NULL, funcs[i].func, NULL, NULL, NULL) != SQLITE_OK) {
+            gbs_error("create function %s failed, msg %s\n", funcs[i].name, sqlite3_errmsg(db));
+            return -GBS_ERROR_DB;
+        }
+    }
+
+    genres = malloc(sizeof(gbs_func_genres_t));
+    if (genres == NULL) {
+        return -GBS_ERROR_NOMEM;
+    }
+
+    genres->loaded = 0;
+    genres->stale = 0;
+    genres->counter = 0;
+    genres->seq = 0;
+    genres->matcher = NULL;
+    INIT_LIST_HEAD(&genres->list);
+
+    /* both share the genres, it's freed with the last one */
+    if (sqlite3_create_function_v2(db, "gbs_genre", 1, GBS_FUNC_FLAGS, genres, gbs_genre_func, NULL, NULL, NULL) != SQLITE_OK) {
+        gbs_error("create function gbs_genre failed, msg %s\n", sqlite3_errmsg(db));
+        free(genres);
+        return -GBS_ERROR_DB;
+    }
+
+    /* sqlite calls the destructor if it fails, gbs_genre must not keep the genres then */
+    if (sqlite3_create_function_v2(db, "gbs_subgenre", 1, GBS_FUNC_FLAGS, genres, gbs_subgenre_func, NULL, NULL,
+                gbs_func_genres_free) != SQLITE_OK) {
+        gbs_error("create function gbs_subgenre failed, msg %s\n", sqlite3_errmsg(db));
+        sqlite3_create_function_v2(db, "gbs_genre", 1, GBS_FUNC_FLAGS, NULL, NULL, NULL, NULL, NULL);
+        return -GBS_ERROR_DB;
+    }
+
+    sqlite3_update_hook(db, gbs_func_genres_hook, genres);
+    return 0;
+}
@@ -8,6 +8,9 @@ unsigned int g_genre_cnt;
 struct list_head g_genre_list;
 gbs_genre_t *g_genre_root = NULL;
 
+static gbs_genre_matcher_t *g_genre_matcher = NULL;
+static int g_genre_matcher_dirty = 1;
+
 static gbs_genre_name_t g_default_genres[] = {
     { "/Arts", "Architectural", "建筑设计|土木工程|Civil Engineering|Architectural" },
     { "/Arts", "Chinaware", "磁器|陶瓷|Ceramics|Chinaware" },
@@ -275,22 +278,196 @@ void gbs_genre_free(gbs_genre_t * genre)
     }
 }
 
-int gbs_genre_insert(char *path, char *genre, char *keywords)
+/**
+ * if the keywords go to the Aho-Corasick automaton, which folds ASCII only,
+ * the ones with the non-ASCII cased letters are left to the dfa.
+ */
+int gbs_genre_literal(char *keywords)
+{
+    return ac_literal(keywords) && !dfa_utf8_cased(keywords);
+}
+
+/**
+ * the lazy dfa of the regex keywords, it only tells the keywords compile,
+ * no state is built since the genres are matched by the combined automaton
+ * of gbs_genre_matcher_new. NULL if the keywords don't compile.
+ */
+mdfa_t *gbs_genre_pattern(char *keywords)
+{
+    return dfa_compile_lazy(keywords, REF_IGNORECASE, 0);
+}
+
+/**
+ * combine the keywords of the genres in list, the plain literal ones into
+ * the Aho-Corasick automaton and the others into one dfa. The genres
+ * without keywords or whose keywords don't compile are left out. The genres
+ * must live longer than the matcher.
+ */
+gbs_genre_matcher_t *gbs_genre_matcher_new(struct list_head *list)
 {
+    int n = 0;
     int ret;
-    char *dirname = NULL;
-    gbs_genre_t *gen = NULL;
+    int *flags = NULL;
+    char **regex = NULL;
+    gbs_genre_t *gen;
+    gbs_genre_matcher_t *matcher;
 
-    ret = db_genre_insert(path, genre, keywords);
-    if (ret < 0) {
-        return ret;
+    matcher = malloc(sizeof(gbs_genre_matcher_t));
+    if (matcher == NULL)
+        return NULL;
+
+    memset(matcher, 0, sizeof(gbs_genre_matcher_t));
+    list_for_each_entry(gen, list, node) {
+        n++;
+    }
+
+    matcher->ac = ac_create(AC_IGNORECASE);
+    if (matcher->ac == NULL)
+        goto errout;
+
+    if (n > 0) {
+        matcher->genres = malloc(n * sizeof(gbs_genre_t *));
+        matcher->mdfa_genres = malloc(n * sizeof(int));
+        regex = malloc(n * sizeof(char *));
+        flags = malloc(n * sizeof(int));
+        if (!matcher->genres || !matcher->mdfa_genres || !regex || !flags)
+            goto errout;
     }
 
+    list_for_each_entry(gen, list, node) {
+        /* the empty keywords match everything */
+        if (gen->keywords == NULL || gen->keywords[0] == '\0')
+            continue;
+
+        if (gbs_genre_literal(gen->keywords)) {
+            ret = ac_add_alternation(matcher->ac, gen->keywords, matcher->n);
+            if (ret < 0)
+                goto errout;
+            if (ret == 0)
+                continue;
+        } else if (gen->pattern) {
+            regex[matcher->nmdfa] = gen->keywords;
+            flags[matcher->nmdfa] = REF_IGNORECASE;
+            matcher->mdfa_genres[matcher->nmdfa++] = matcher->n;
+        } else {
+            continue;
+        }
+
+        matcher->genres[matcher->n++] = gen;
+    }
+
+    if (ac_compile(matcher->ac) < 0)
+        goto errout;
+
+    if (matcher->nmdfa > 0) {
+        /* the states are built while matching, the complex keywords can't blow up */
+        matcher->mdfa = mdfa_compile_lazy(matcher->nmdfa, regex, flags, GBS_GENRE_DFA_BUDGET);
+        if (matcher->mdfa == NULL)
+            goto errout;
+    }
+
+    gbs_debug("combine %d genres, %d literal in %d states, %d regex in %d states\n", matcher->n,
+            matcher->n - matcher->nmdfa, ac_nstate(matcher->ac), matcher->nmdfa, dfa_nstate(matcher->mdfa));
+    free(regex);
+    free(flags);
+    return matcher;
+
+errout:
+    free(regex);
+    free(flags);
+    gbs_genre_matcher_free(matcher);
+    return NULL;
+}
+
+void gbs_genre_matcher_free(gbs_genre_matcher_t *matcher)
+{
+    if (matcher) {
+        ac_destroy(matcher->ac);
+        dfa_destroy(matcher->mdfa);
+        free(matcher->mdfa_genres);
+        free(matcher->genres);
+        free(matcher);
+    }
+}
+
+/**
+ * classify the text in one pass of each automaton, the genre matched
+ * leftmost wins, then the longer match, then the first one in the list.
+ */
+gbs_genre_t *gbs_genre_matcher_match(gbs_genre_matcher_t *matcher, char *text, int len)
+{
+    int pid, start = 0, end = 0;
+    int id, s, e;
+
+    if (matcher == NULL || text == NULL || len <= 0)
+        return NULL;
+
+    pid = ac_match(matcher->ac, (uint8_t *)text, len, &start, &end);
+    if (matcher->mdfa) {
+        id = dfa_match(matcher->mdfa, (uint8_t *)text, len, &s, &e, 0);
+        if (id >= 0 && id < matcher->nmdfa) {
+            id = matcher->mdfa_genres[id];
+            if (pid < 0 || s < start || (s == start && (e > end || (e == end && id < pid))))
+                pid = id;
+        }
+    }
+
+    if (pid < 0 || pid >= matcher->n)
+        return NULL;
+
+    return matcher->genres[pid];
+}
+
+/**
+ * guess the genre of the file by its name, the matcher is rebuilt on the
+ * first call after the genres changed.
+ */
+gbs_genre_t *gbs_genre_classify(char *name)
+{
+    if (g_genre_matcher_dirty) {
+        gbs_genre_matcher_free(g_genre_matcher);
+        g_genre_matcher = gbs_genre_matcher_new(&g_genre_list);
+        g_genre_matcher_dirty = 0;
+    }
+
+    return gbs_genre_matcher_match(g_genre_matcher, name, name ? strlen(name) : 0);
+}
+
+/**
+ * the genre id is unknown until the writer committed the insertion, look it
+ * up again by the full path because the genre may be deleted meanwhile.
+ */
+static void gbs_genre_insert_done(int ret, void *data)
+{
+    mbs_t fullpath = (mbs_t)data;
+    gbs_genre_t *gen;
+
+    if (ret >= 0) {
+        list_for_each_entry(gen, &g_genre_list, node) {
+            if (!strcmp(gen->fullpath, fullpath)) {
+                gen->id = ret;
+                break;
+            }
+        }
+    }
+
+    mbsfree(fullpath);
+}
+
+/**
+ * add the genre into the catalog only, for the genres which are in the
+ * database already or will be written with it.
+ */
+static gbs_genre_t *gbs_genre_add_one(char *path, char *genre, char *keywords)
+{
+    char *dirname = NULL;
+    gbs_genre_t *gen = NULL;
+
     gen = gbs_genre_alloc();
     if (gen == NULL)
-        return -GBS_ERROR_NOMEM;
+        return NULL;
 
-    gen->id = ret;
+    gen->id = 0;
     gen->path = mbsnew(path);
     gen->genre = mbsnew(genre);
     parse_dirname(gen->path, &dirname);
@@ -299,13 +476,35 @@ int gbs_genre_insert(char *path, char *genre, char *keywords)
     gen->fullpath = NULL;
     mbscatfmt(&gen->fullpath, "%s/%s", gen->path, gen->genre);
     gen->keywords = mbsnew(keywords);
-    gen->pattern = dfa_compile(keywords, REF_IGNORECASE);
+    /* the literal keywords go to the Aho-Corasick automaton, no dfa needed */
+    gen->pattern = gbs_genre_literal(keywords) ? NULL : gbs_genre_pattern(keywords);
     list_add_tail(&gen->node, &g_genre_list);
     dpa_append(&g_main_genres, mbsdup(gen->path), dpa_str_cmp, NULL);
     dpa_append(&g_main_genres, mbsdup(gen->parent), dpa_str_cmp, NULL);
     dpa_append(&g_main_genres, mbsdup(gen->fullpath), dpa_str_cmp, NULL);
     g_genre_cnt++;
-    return 0;
+    g_genre_matcher_dirty = 1;
+
+    return gen;
+}
+
+int gbs_genre_add(char *path, char *genre, char *keywords)
+{
+    return gbs_genre_add_one(path, genre, keywords) ? 0 : -GBS_ERROR_NOMEM;
+}
+
+/**
+ * add the genre into the catalog and the database, for the new genres.
+ */
+int gbs_genre_insert(char *path, char *genre, char *keywords)
+{
+    gbs_genre_t *gen;
+
+    gen = gbs_genre_add_one(path, genre, keywords);
+    if (gen == NULL)
+        return -GBS_ERROR_NOMEM;
+
+    return gbs_dbw_genre_insert(path, genre, keywords, gbs_genre_insert_done, mbsdup(gen->fullpath));
 }
 
 int gbs_genre_delete(char *path, char *genre)
@@ -317,7 +516,8 @@ int gbs_genre_delete(char *path, char *genre)
             list_del(&cur_genre->node);
             gbs_genre_free(cur_genre);
             g_genre_cnt--;
-            return db_genre_delete(path, genre);
+            g_genre_matcher_dirty = 1;
+            return gbs_dbw_genre_delete(path, genre, NULL, NULL);
         }
     }
 
@@ -329,7 +529,7 @@ int gbs_genre_default_init(void)
     gbs_genre_name_t *gname;
 
     for (gname = g_default_genres; gname->genre; gname++) {
-        gbs_genre_insert(gname->path, gname->genre, gname->keywords);
+        gbs_genre_add(gname->path, gname->genre, gname->keywords);
     }
 
     return 0;
@@ -367,6 +567,10 @@ void gbs_genre_fini(void)
 {
     gbs_genre_t *cur_genre, *next_genre;
 
+    gbs_genre_matcher_free(g_genre_matcher);
+    g_genre_matcher = NULL;
+    g_genre_matcher_dirty = 1;
+
     dpa_clean(&g_main_genres, mbsfree);
     list_for_each_entry_safe(cur_genre, next_genre, &g_genre_list, node) {
         list_del(&cur_genre->node);
@@ -70,7 +70,7 @@ int gbs_language_default_init(void)
     gbs_language_name_t *lang;
 
     for (lang = g_default_languages; lang->language; lang++) {
-        db_language_insert(lang->language, lang->description);
+        gbs_dbw_language_insert(lang->language, lang->description, NULL, NULL);
     }
 
     return 0;
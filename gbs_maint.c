@@ -0,0 +1,281 @@
+#include "gbookshelf.h"
+
+#include <time.h>
+
+/**
+ * gbs database maintenance, the hot backup and the incremental vacuum.
+ *
+ * both of them work in small steps and release the locks between steps,
+ * so the database can be read and written by others meanwhile. they go
+ * over the shards of a sharded database as well, one after another.
+ */
+
+#define GBS_BACKUP_PAGES    256     /*< the default pages to copy in one step */
+#define GBS_VACUUM_PAGES    1024    /*< the default pages to free in one step */
+#define GBS_MAINT_SLEEP     10      /*< milliseconds to sleep between steps */
+
+static sqlite3_int64 db_pragma_int(sqlite3 *db, char *schema, char *pragma)
+{
+    sqlite3_int64 value = -1;
+    mbs_t sql = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    mbscpyfmt(&sql, "PRAGMA %s.%s;", schema, pragma);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    mbsfree(sql);
+    return value;
+}
+
+static sqlite3_int64 db_size(sqlite3 *db, char *schema)
+{
+    return db_pragma_int(db, schema, "page_count") * db_pragma_int(db, schema, "page_size");
+}
+
+/**
+ * copy the schema of src into the new database file with sqlite3_backup_step,
+ * pages in one step, the backup restarts by itself if the source is changed
+ * by others.
+ */
+static int db_backup_schema(sqlite3 *src, char *schema, char *file, int pages)
+{
+    int rc;
+    int ret = 0;
+    sqlite3 *dst;
+    sqlite3_backup *backup;
+
+    unlink(file);
+    if (sqlite3_open(file, &dst) != SQLITE_OK) {
+        gbs_error("Error: open db %s failed\n", file);
+        sqlite3_close(dst);
+        return -GBS_ERROR_DB;
+    }
+
+    backup = sqlite3_backup_init(dst, "main", src, schema);
+    if (backup == NULL) {
+        gbs_error("backup %s failed, msg %s\n", schema, sqlite3_errmsg(dst));
+        sqlite3_close(dst);
+        return -GBS_ERROR_DB;
+    }
+
+    do {
+        rc = sqlite3_backup_step(backup, pages);
+        gbs_debug("backup %s %d/%d pages\n", schema, sqlite3_backup_pagecount(backup) - sqlite3_backup_remaining(backup),
+            sqlite3_backup_pagecount(backup));
+        if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+            sqlite3_sleep(GBS_MAINT_SLEEP);
+        }
+    } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+
+    sqlite3_backup_finish(backup);
+    if (rc != SQLITE_DONE) {
+        gbs_error("backup %s failed, msg %s\n", schema, sqlite3_errmsg(dst));
+        ret = -GBS_ERROR_DB;
+    } else {
+        gbs_print("backup %s into %s, %lld bytes\n", schema, file, (long long)db_size(dst, "main"));
+    }
+
+    sqlite3_close(dst);
+    return ret;
+}
+
+/* the shards of the copy are next to it, "output.shardN" */
+static int db_backup_relink(char *tmpfile, char *output)
+{
+    int ret = 0;
+    char *msg = NULL;
+    char *base = NULL;
+    mbs_t sql = NULL;
+    mbs_t path = NULL;
+    sqlite3 *db;
+
+    if (sqlite3_open(tmpfile, &db) != SQLITE_OK) {
+        gbs_error("Error: open db %s failed\n", tmpfile);
+        sqlite3_close(db);
+        return -GBS_ERROR_DB;
+    }
+
+    parse_basename(output, &base);
+    path = mbsnewescapesqlite(base);
+    mbscpyfmt(&sql, "UPDATE gbs_shard SET path = '%s.shard' || id;", path);
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("sqlite3_exec: %s failed, msg %s\n", sql, msg);
+        sqlite3_free(msg);
+        ret = -GBS_ERROR_DB;
+    }
+
+    sqlite3_close(db);
+    free(base);
+    mbsfree(path);
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * copy the gbs database into output, and the shards of it into
+ * "output.shardN" if it's sharded, see db_backup_schema. every file is
+ * written as a temporary one and renamed at last, the shards before the
+ * main one, so they are always consistent databases. each file is a
+ * snapshot by itself, the shards are copied one after another.
+ */
+int db_backup(char *filename, char *output, int pages)
+{
+    int i, n;
+    int ret = 0;
+    sqlite3 *src;
+    mbs_t schema = NULL;
+    mbs_t file = NULL;
+    mbs_t tmpfile = NULL;
+
+    if (pages <= 0) {
+        pages = GBS_BACKUP_PAGES;
+    }
+
+    if (db_open_file(filename, &src) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+
+    /* shard i is attached as "shardi", see db_shard_attach */
+    n = db_shard_count(src);
+    for (i = -1; i < n && ret == 0; i++) {
+        if (i < 0) {
+            mbscpy(&schema, "main");
+            mbscpyfmt(&tmpfile, "%s.tmp", output);
+        } else {
+            mbscpyfmt(&schema, "shard%d", i);
+            mbscpyfmt(&tmpfile, "%s.shard%d.tmp", output, i);
+        }
+        ret = db_backup_schema(src, schema, tmpfile, pages);
+    }
+    sqlite3_close(src);
+
+    if (ret == 0 && n > 0) {
+        mbscpyfmt(&tmpfile, "%s.tmp", output);
+        ret = db_backup_relink(tmpfile, output);
+    }
+
+    for (i = n - 1; i >= -1; i--) {
+        if (i < 0) {
+            mbscpy(&file, output);
+        } else {
+            mbscpyfmt(&file, "%s.shard%d", output, i);
+        }
+        mbscpyfmt(&tmpfile, "%s.tmp", file);
+        if (ret < 0) {
+            unlink(tmpfile);
+            continue;
+        }
+
+#ifdef _WIN32
+        unlink(file);
+#endif
+        if (rename(tmpfile, file) != 0) {
+            gbs_error("rename %s to %s failed\n", tmpfile, file);
+            unlink(tmpfile);
+            ret = -GBS_ERROR_FILE;
+        }
+    }
+
+    mbsfree(schema);
+    mbsfree(file);
+    mbsfree(tmpfile);
+    return ret;
+}
+
+/**
+ * free the unused pages of one schema of db, see db_vacuum, the time limit
+ * is counted from start.
+ */
+static int db_vacuum_schema(sqlite3 *db, char *schema, int pages, int seconds, time_t start)
+{
+    int rc;
+    int ret = 0;
+    char *msg = NULL;
+    mbs_t sql = NULL;
+    sqlite3_int64 before;
+    sqlite3_int64 freelist;
+
+    before = db_size(db, schema);
+    if (db_pragma_int(db, schema, "auto_vacuum") != 2) {
+        gbs_print("switch %s to auto_vacuum=incremental by a full VACUUM\n", schema);
+        mbscpyfmt(&sql, "PRAGMA %s.auto_vacuum = INCREMENTAL; VACUUM %s;", schema, schema);
+        if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+            gbs_error("vacuum %s failed, msg %s\n", schema, msg);
+            sqlite3_free(msg);
+            ret = -GBS_ERROR_DB;
+            goto out;
+        }
+    }
+
+    mbscpyfmt(&sql, "PRAGMA %s.incremental_vacuum(%d);", schema, pages);
+    while ((freelist = db_pragma_int(db, schema, "freelist_count")) > 0) {
+        if (seconds > 0 && time(NULL) - start >= seconds) {
+            gbs_print("time is up, %lld free pages left in %s\n", (long long)freelist, schema);
+            break;
+        }
+
+        rc = sqlite3_exec(db, sql, NULL, NULL, &msg);
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) {
+            gbs_error("incremental vacuum %s failed, msg %s\n", schema, msg);
+            sqlite3_free(msg);
+            ret = -GBS_ERROR_DB;
+            goto out;
+        }
+        /* somebody is writing if busy, try again later */
+        sqlite3_free(msg);
+        msg = NULL;
+        sqlite3_sleep(GBS_MAINT_SLEEP);
+    }
+
+    gbs_print("vacuum %s, %lld bytes before, %lld bytes after\n", schema, (long long)before, (long long)db_size(db, schema));
+
+out:
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * free the unused pages of the gbs database and its shards with the
+ * incremental vacuum, pages in one step, until no free page or seconds
+ * passed.
+ *
+ * the database created before auto_vacuum is not incremental, it needs
+ * one full VACUUM to switch, which blocks the others while it runs.
+ */
+int db_vacuum(char *filename, int pages, int seconds)
+{
+    int i, n;
+    int ret = 0;
+    mbs_t schema = NULL;
+    sqlite3 *db;
+    time_t start;
+
+    if (pages <= 0) {
+        pages = GBS_VACUUM_PAGES;
+    }
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+
+    sqlite3_busy_timeout(db, 1000);
+    start = time(NULL);
+    n = db_shard_count(db);
+    for (i = -1; i < n && ret == 0; i++) {
+        if (i < 0) {
+            mbscpy(&schema, "main");
+        } else {
+            mbscpyfmt(&schema, "shard%d", i);
+        }
+        ret = db_vacuum_schema(db, schema, pages, seconds, start);
+    }
+
+    sqlite3_close(db);
+    mbsfree(schema);
+    return ret;
+}
@@ -146,6 +146,7 @@ run:
             gbs_message_dialog (GTK_MESSAGE_INFO, "Add publisher failed!", "add publisher <i>%s</i>: <b>%s</b>", publisher, gbs_err(ret));
             goto run;
         }
+        gbs_dbw_publisher_insert(publisher, website, description, NULL, NULL);
         if (g_sidebar_flag == 1)
             gbs_sidebar_update_tree_model(1);
         g_modify_flag = 1;
@@ -213,6 +214,7 @@ run:
             gbs_message_dialog (GTK_MESSAGE_INFO, "Delete publisher failed!", "delete publisher <i>%s</i>: <b>%s</b>", publisher, gbs_err(ret));
             goto run;
         }
+        gbs_dbw_publisher_delete(publisher, NULL, NULL);
         if (g_sidebar_flag == 1)
             gbs_sidebar_update_tree_model(1);
         g_modify_flag = 1;
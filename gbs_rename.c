@@ -7,7 +7,7 @@
 #include <unistd.h>
 #include <ctype.h>
 
-#include "dict.h"
+#include "gbs_abbr.h"
 #include "libstring.h"
 
 enum {
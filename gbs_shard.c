@@ -0,0 +1,453 @@
+#include "gbookshelf.h"
+
+#include <unistd.h>
+
+/**
+ * gbs sharded database, the books are spread over N shard files by a key,
+ * the md5, the genre or the volume (the share of the path), and the main
+ * file keeps the formats, languages, publishers, genres and the gbs_shard
+ * table which lists the shards.
+ *
+ * every shard is a complete normal gbs database, db_open_file attaches them
+ * as shard0 .. shardN-1 and creates the temporary views gbs_book, book_author,
+ * book_keyword, book_url and book_custom which are the UNION ALL of shards,
+ * so all the readers work as before. The fts4 MATCH can't go through a
+ * view, the full text search asks shardN.gbs_book_fts one by one. The book
+ * is inserted into its shard directly, the writers of different shards lock
+ * different files, and so does the UPDATE of a sql function over the books,
+ * it's run on shardN.gbs_book since the views are read only. The changes of
+ * the books are logged into the gbs_changelog of main as well, see
+ * gbs_changelog.c.
+ *
+ * the ids of shard i start from i * GBS_SHARD_STRIDE, so they are unique
+ * in the views.
+ */
+
+#define GBS_SHARD_STRIDE    100000000   /*< the id range of one shard */
+
+typedef struct db_shard_key_st {
+    char *key;
+    char *expr;         /*< the sql expression of the key on gbs_book */
+} db_shard_key_t;
+
+static db_shard_key_t g_db_shard_keys[] = {
+    { "md5", "md5" },
+    { "genre", "genre" },
+    { "volume", "gbs_volume(path)" },
+
+    { NULL, NULL },
+};
+
+/* the tables of shards which are viewed as one by the main database */
+static char *g_db_shard_tables[] = {
+    "gbs_book", "book_author", "book_keyword", "book_url", "book_custom",
+    NULL
+};
+
+static db_shard_key_t *db_shard_key(char *key)
+{
+    db_shard_key_t *k;
+
+    for (k = g_db_shard_keys; k->key; k++) {
+        if (!strcasecmp(k->key, key)) {
+            return k;
+        }
+    }
+
+    return NULL;
+}
+
+static inline int issepchar(char c)
+{
+    return c == '/' || c == '\\';
+}
+
+/**
+ * the length of the volume of path, eg. "//nas/books" of
+ * "//nas/books/a.pdf", "D:" of "D:/books/a.pdf" and "/mnt" of "/mnt/a.pdf".
+ */
+static int db_shard_volume(const char *path)
+{
+    int n = 1;
+    const char *p = path;
+
+    if (issepchar(p[0]) && issepchar(p[1])) {
+        n = 2;
+    }
+
+    while (n-- > 0) {
+        while (issepchar(*p)) {
+            p++;
+        }
+        while (*p && !issepchar(*p)) {
+            p++;
+        }
+    }
+
+    return p - path;
+}
+
+/**
+ * FNV-1a, it must never change, or the books are looked up in wrong shards.
+ */
+static int db_shard_hash(const char *value, int len, int n)
+{
+    int i;
+    unsigned int hash = 2166136261U;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)value[i];
+        hash *= 16777619U;
+    }
+
+    return hash % n;
+}
+
+static void gbs_shard_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    int n = sqlite3_value_int(argv[1]);
+    const char *value = (const char *)sqlite3_value_text(argv[0]);
+
+    if (n <= 0) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    sqlite3_result_int(ctx, db_shard_hash(value ? value : "", value ? sqlite3_value_bytes(argv[0]) : 0, n));
+}
+
+static void gbs_volume_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const char *path = (const char *)sqlite3_value_text(argv[0]);
+
+    if (path == NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    sqlite3_result_text(ctx, path, db_shard_volume(path), SQLITE_TRANSIENT);
+}
+
+static int db_shard_index(char *key, int n, gbs_book_t *book)
+{
+    char *value = NULL;
+    int len;
+
+    if (!strcasecmp(key, "md5")) {
+        value = book->md5;
+    } else if (!strcasecmp(key, "genre")) {
+        value = book->genre;
+    } else if (!strcasecmp(key, "volume")) {
+        value = book->path;
+    }
+
+    if (value == NULL) {
+        return db_shard_hash("", 0, n);
+    }
+
+    len = strcasecmp(key, "volume") ? strlen(value) : db_shard_volume(value);
+    return db_shard_hash(value, len, n);
+}
+
+/**
+ * the number of shards, 0 if the database is not sharded.
+ */
+int db_shard_count(sqlite3 *db)
+{
+    int n = 0;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, "SELECT count(*) FROM main.gbs_shard;", -1, &stmt, NULL) == SQLITE_OK
+            && sqlite3_step(stmt) == SQLITE_ROW) {
+        n = sqlite3_column_int(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    return n;
+}
+
+int db_is_sharded(sqlite3 *db)
+{
+    return db_shard_count(db) > 0;
+}
+
+/**
+ * register gbs_shard and gbs_volume, and attach the shards with the views
+ * if the database is sharded, it's called by db_open_file.
+ */
+int db_shard_attach(sqlite3 *db, char *filename)
+{
+    int i, j;
+    int n = 0;
+    int ret = 0;
+    char *msg = NULL;
+    char *path;
+    char *dirname = NULL;
+    mbs_t sql = NULL;
+    mbs_t file = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_create_function(db, "gbs_shard", 2, SQLITE_UTF8, NULL, gbs_shard_func, NULL, NULL) != SQLITE_OK
+            || sqlite3_create_function(db, "gbs_volume", 1, SQLITE_UTF8, NULL, gbs_volume_func, NULL, NULL) != SQLITE_OK) {
+        gbs_error("create function gbs_shard failed, msg %s\n", sqlite3_errmsg(db));
+        return -GBS_ERROR_DB;
+    }
+
+    if (!db_is_sharded(db)) {
+        return 0;
+    }
+
+    /* the views shadow the tables of main, create them before */
+    ret = db_create_dict_tables(db);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* the shard files are relative to the main one */
+    parse_dirname(filename, &dirname);
+    sqlite3_prepare_v2(db, "SELECT id, path FROM main.gbs_shard ORDER BY id;", -1, &stmt, NULL);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        path = (char *)sqlite3_column_text(stmt, 1);
+        if (issepchar(path[0]) || (path[0] && path[1] == ':')) {
+            mbscpy(&file, path);
+        } else {
+            mbscpyfmt(&file, "%s/%s", dirname, path);
+        }
+        path = mbsnewescapesqlite(file);
+        mbscatfmt(&sql, "ATTACH '%s' AS shard%d;", path, sqlite3_column_int(stmt, 0));
+        mbsfree(path);
+        n++;
+    }
+    sqlite3_finalize(stmt);
+    free(dirname);
+    mbsfree(file);
+
+    for (i = 0; g_db_shard_tables[i]; i++) {
+        mbscatfmt(&sql, "CREATE TEMP VIEW %s AS ", g_db_shard_tables[i]);
+        for (j = 0; j < n; j++) {
+            mbscatfmt(&sql, "%sSELECT * FROM shard%d.%s", j ? " UNION ALL " : "", j, g_db_shard_tables[i]);
+        }
+        mbscat(&sql, ";");
+    }
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("attach shards of %s failed, msg %s\n", filename, msg);
+        sqlite3_free(msg);
+        ret = -GBS_ERROR_DB;
+    }
+
+    /* the changes of the books reach the feed of main */
+    for (j = 0; j < n && ret == 0; j++) {
+        mbscpyfmt(&sql, "shard%d", j);
+        ret = db_changelog_attach(db, sql);
+    }
+
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * the schema prefix of the shard the book belongs to, eg. "shard3.", or NULL
+ * if the database is not sharded, free it by mbsfree.
+ */
+mbs_t db_shard_prefix(sqlite3 *db, gbs_book_t *book)
+{
+    int n;
+    mbs_t prefix = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, "SELECT key, count(*) FROM main.gbs_shard;", -1, &stmt, NULL) == SQLITE_OK
+            && sqlite3_step(stmt) == SQLITE_ROW) {
+        n = sqlite3_column_int(stmt, 1);
+        if (n > 0) {
+            prefix = mbsnewfmt("shard%d.", db_shard_index((char *)sqlite3_column_text(stmt, 0), n, book));
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    return prefix;
+}
+
+static int db_shard_exec(sqlite3 *db, char *sql)
+{
+    char *msg = NULL;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &msg) != SQLITE_OK) {
+        gbs_error("sqlite3_exec: %s failed, msg %s\n", sql, msg);
+        sqlite3_free(msg);
+        return -GBS_ERROR_DB;
+    }
+
+    return 0;
+}
+
+/**
+ * fill one shard with the books of source whose key falls into it, and move
+ * its id sequence to its own range.
+ */
+static int db_shard_fill(char *shardfile, char *source, db_shard_key_t *key, int i, int n, sqlite3_int64 maxid)
+{
+    int j;
+    int ret;
+    sqlite3 *db;
+    mbs_t sql = NULL;
+    mbs_t columns = NULL;
+    mbs_t src = mbsnewescapesqlite(source);
+
+    if (db_open_file(shardfile, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", shardfile);
+        mbsfree(src);
+        return -GBS_ERROR_DB;
+    }
+
+    for (j = 0; g_db_book_columns[j]; j++) {
+        mbscatfmt(&columns, ", %s", g_db_book_columns[j]);
+    }
+
+    mbscpyfmt(&sql, "ATTACH '%s' AS src;", src);
+    ret = db_create_schema(db, 0);
+    if (ret == 0) {
+        ret = db_shard_exec(db, sql);
+    }
+    if (ret == 0) {
+        ret = db_shard_exec(db, "BEGIN;");
+    }
+    if (ret == 0) {
+        mbscpyfmt(&sql, "INSERT INTO gbs_book(id%s) SELECT id%s FROM src.gbs_book WHERE gbs_shard(%s, %d) = %d;",
+                columns, columns, key->expr, n, i);
+        ret = db_shard_exec(db, sql);
+    }
+    if (ret == 0) {
+        gbs_print("  shard %d: %d books\n", i, sqlite3_changes(db));
+        ret = db_child_rebuild(db, NULL);
+    }
+    if (ret == 0) {
+        mbscpyfmt(&sql, "UPDATE sqlite_sequence SET seq = %lld WHERE name = 'gbs_book';",
+                (long long)(maxid + (sqlite3_int64)i * GBS_SHARD_STRIDE));
+        ret = db_shard_exec(db, sql);
+    }
+    if (ret == 0 && sqlite3_changes(db) == 0) {
+        mbscpyfmt(&sql, "INSERT INTO sqlite_sequence(name, seq) VALUES ('gbs_book', %lld);",
+                (long long)(maxid + (sqlite3_int64)i * GBS_SHARD_STRIDE));
+        ret = db_shard_exec(db, sql);
+    }
+    if (ret == 0) {
+        /* the copy is not a change */
+        ret = db_shard_exec(db, "DELETE FROM gbs_changelog;");
+    }
+
+    sqlite3_exec(db, ret == 0 ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+    sqlite3_close(db);
+    mbsfree(columns);
+    mbsfree(sql);
+    mbsfree(src);
+    return ret;
+}
+
+/**
+ * split the gbs database into the sharded output of n shards by key, the
+ * output and its shards "output.shardN" must not exist.
+ */
+int db_shard(char *filename, char *output, char *key, int n)
+{
+    int i;
+    int ret = 0;
+    sqlite3 *db;
+    char *base = NULL;
+    mbs_t sql = NULL;
+    mbs_t src = NULL;
+    mbs_t shardfile = NULL;
+    sqlite3_int64 maxid = 0;
+    sqlite3_stmt *stmt = NULL;
+    db_shard_key_t *k;
+    static char *dicts[] = { "gbs_format", "gbs_language", "gbs_publisher", "gbs_genre", NULL };
+
+    k = db_shard_key(key);
+    if (k == NULL) {
+        gbs_error("unknown shard key %s, it's md5, genre or volume\n", key);
+        return -GBS_ERROR_INVAL;
+    }
+
+    if (access(output, F_OK) == 0) {
+        gbs_error("%s is exist\n", output);
+        return -GBS_ERROR_EXIST;
+    }
+    for (i = 0; i < n; i++) {
+        mbscpyfmt(&shardfile, "%s.shard%d", output, i);
+        if (access(shardfile, F_OK) == 0) {
+            gbs_error("%s is exist\n", shardfile);
+            mbsfree(shardfile);
+            return -GBS_ERROR_EXIST;
+        }
+    }
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        mbsfree(shardfile);
+        return -GBS_ERROR_DB;
+    }
+
+    if (n < 2 || n > sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1)) {
+        gbs_error("the number of shards must be 2 to %d\n", sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1));
+        ret = -GBS_ERROR_INVAL;
+    } else if (db_is_compact(db) || db_is_sharded(db)) {
+        gbs_error("%s is compact or sharded already\n", filename);
+        ret = -GBS_ERROR_INVAL;
+    } else if (sqlite3_prepare_v2(db, "SELECT ifnull(max(id), 0) FROM gbs_book;", -1, &stmt, NULL) == SQLITE_OK
+            && sqlite3_step(stmt) == SQLITE_ROW) {
+        maxid = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    if (ret < 0) {
+        mbsfree(shardfile);
+        return ret;
+    }
+
+    gbs_print("shard %s into %s by %s:\n", filename, output, k->key);
+
+    /* the main database, the dictionaries and the list of shards */
+    if (db_open_file(output, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", output);
+        mbsfree(shardfile);
+        return -GBS_ERROR_DB;
+    }
+
+    src = mbsnewescapesqlite(filename);
+    parse_basename(output, &base);
+    mbscpyfmt(&sql, "CREATE TABLE gbs_shard (id INTEGER PRIMARY KEY, path TEXT NOT NULL, key TEXT NOT NULL);"
+            "ATTACH '%s' AS src; BEGIN;", src);
+    for (i = 0; dicts[i]; i++) {
+        mbscatfmt(&sql, "INSERT INTO main.%s SELECT * FROM src.%s;", dicts[i], dicts[i]);
+    }
+    for (i = 0; i < n; i++) {
+        mbscatfmt(&sql, "INSERT INTO gbs_shard(id, path, key) VALUES (%d, '%s.shard%d', '%s');", i, base, i, k->key);
+    }
+    mbscat(&sql, "DELETE FROM gbs_changelog;");
+
+    ret = db_create_dict_tables(db);
+    if (ret == 0) {
+        ret = db_shard_exec(db, sql);
+    }
+    sqlite3_exec(db, ret == 0 ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+    sqlite3_close(db);
+
+    for (i = 0; i < n && ret == 0; i++) {
+        mbscpyfmt(&shardfile, "%s.shard%d", output, i);
+        ret = db_shard_fill(shardfile, filename, k, i, n, maxid);
+    }
+
+    if (ret < 0) {
+        unlink(output);
+        for (i = 0; i < n; i++) {
+            mbscpyfmt(&shardfile, "%s.shard%d", output, i);
+            unlink(shardfile);
+        }
+    }
+
+    free(base);
+    mbsfree(shardfile);
+    mbsfree(src);
+    mbsfree(sql);
+    return ret;
+}
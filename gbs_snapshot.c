@@ -0,0 +1,719 @@
+#include "gbookshelf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/**
+ * gbs_book snapshot, a read-only binary image of the gbs_book table.
+ *
+ * the snapshot file is written alongside gbs.db, it's layout is:
+ *
+ * +--------------------+ 0
+ * | header             |
+ * +--------------------+ book_offset
+ * | book records       | nbook * gbs_snapshot_book_t
+ * +--------------------+ hash_offset
+ * | md5 hash table     | hash_size * uint32_t, record index + 1, 0 is empty
+ * +--------------------+ title_offset
+ * | title order        | nbook * uint32_t, record indexes sorted by title
+ * +--------------------+ heap_offset
+ * | string heap        | NUL terminated strings, offset 0 is ""
+ * +--------------------+ file_size
+ *
+ * every section starts at 8 bytes alignment, so the snapshot can be
+ * mmaped and used in place. The gbs.db is still the source of truth,
+ * the snapshot is dropped once the stamp of gbs.db, its file change
+ * counter, page count and size and those of its shards, is not the same
+ * as the one recorded in the header.
+ */
+
+#define GBS_SNAPSHOT_MAGIC      "GBSSNAP"
+#define GBS_SNAPSHOT_VERSION    2
+#define GBS_SNAPSHOT_ALIGN(x)   (((x) + 7) & ~((uint64_t)7))
+
+/**
+ * the counter alone is not enough, a recreated or restored gbs.db may
+ * have the same one, and the writes of a shard never touch the main file.
+ */
+typedef struct gbs_snapshot_stamp_st {
+    uint32_t change_counter;    /*< file change counter of gbs.db */
+    uint32_t page_count;        /*< database size in pages of gbs.db */
+    uint64_t db_size;           /*< file size of gbs.db */
+    uint32_t nshard;
+    uint32_t shard_checksum;    /*< of the names, counters, page counts and sizes of the shards */
+} gbs_snapshot_stamp_t;
+
+typedef struct gbs_snapshot_header_st {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    gbs_snapshot_stamp_t stamp;
+    uint32_t nbook;
+    uint32_t nfield;
+    uint32_t hash_size;         /*< power of 2 */
+    uint64_t book_offset;
+    uint64_t hash_offset;
+    uint64_t title_offset;
+    uint64_t heap_offset;
+    uint64_t heap_size;
+    uint64_t file_size;
+    uint32_t body_checksum;
+    uint32_t header_checksum;   /*< must be the last member */
+} gbs_snapshot_header_t;
+
+struct gbs_snapshot_st {
+    uint8_t *base;
+    uint64_t size;
+    gbs_snapshot_header_t *header;
+    gbs_snapshot_book_t *books;
+    uint32_t *hash;
+    uint32_t *title;
+    char *heap;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+/* the columns of gbs_book in the order of GBS_SNAPSHOT_FIELD_XXX */
+static char *g_snapshot_fields[GBS_SNAPSHOT_FIELD_MAX] = {
+    "md5", "isbn", "format", "genre", "subgenre", "language",
+    "date", "version", "series", "title", "subtitle", "publisher",
+    "path", "contents", "introduction", "doi", "libgenid", "repository",
+    "urls", "authors", "keywords", "customs",
+};
+
+static inline uint32_t snapshot_checksum(uint32_t hval, void *buf, uint64_t len)
+{
+    uint8_t *p = buf;
+
+    /* FNV-1a */
+    while (len--) {
+        hval ^= *p++;
+        hval *= 0x01000193;
+    }
+
+    return hval;
+}
+
+static inline uint32_t snapshot_md5_hash(char *md5, int len)
+{
+    return DJBHash(md5, len);
+}
+
+/**
+ * the file change counter is the 4 bytes big-endian integer at offset 24
+ * in the header of sqlite database, it's increased by every write transaction,
+ * the database size in pages follows it at offset 28.
+ */
+static int snapshot_db_file_stamp(const char *dbfile, uint32_t *counter, uint32_t *pages, uint64_t *size)
+{
+    FILE *fp;
+    uint8_t hdr[32];
+    struct stat st;
+
+    if (stat(dbfile, &st) < 0) {
+        return -GBS_ERROR_FILE;
+    }
+
+    fp = fopen(dbfile, "rb");
+    if (fp == NULL) {
+        return -GBS_ERROR_FILE;
+    }
+
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) {
+        fclose(fp);
+        return -GBS_ERROR_FILE;
+    }
+
+    fclose(fp);
+    *counter = (hdr[24] << 24) | (hdr[25] << 16) | (hdr[26] << 8) | hdr[27];
+    *pages = (hdr[28] << 24) | (hdr[29] << 16) | (hdr[30] << 8) | hdr[31];
+    *size = st.st_size;
+    return 0;
+}
+
+/**
+ * the stamp of the main database of db and the shards attached to it, the
+ * read lock of every one is taken first, so the caller must be in a
+ * transaction to keep them until the rows are read.
+ */
+static int snapshot_db_stamp(sqlite3 *db, gbs_snapshot_stamp_t *stamp)
+{
+    int ret = 0;
+    mbs_t sql = NULL;
+    const char *name;
+    const char *file;
+    uint32_t counter, pages;
+    uint64_t size;
+    sqlite3_stmt *stmt = NULL;
+
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->shard_checksum = 0x811C9DC5;
+    if (sqlite3_prepare_v2(db, "PRAGMA database_list;", -1, &stmt, NULL) != SQLITE_OK) {
+        return -GBS_ERROR_DB;
+    }
+
+    while (ret == 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+        name = (const char *)sqlite3_column_text(stmt, 1);
+        file = (const char *)sqlite3_column_text(stmt, 2);
+        if (name == NULL || file == NULL || file[0] == '\0' || !strcmp(name, "temp")) {
+            continue;
+        }
+
+        mbscpyfmt(&sql, "SELECT COUNT(*) FROM \"%s\".sqlite_master;", name);
+        if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+            ret = -GBS_ERROR_DB;
+            break;
+        }
+
+        ret = snapshot_db_file_stamp(file, &counter, &pages, &size);
+        if (ret < 0) {
+            break;
+        }
+
+        if (!strcmp(name, "main")) {
+            stamp->change_counter = counter;
+            stamp->page_count = pages;
+            stamp->db_size = size;
+        } else {
+            stamp->nshard++;
+            stamp->shard_checksum = snapshot_checksum(stamp->shard_checksum, (void *)name, strlen(name));
+            stamp->shard_checksum = snapshot_checksum(stamp->shard_checksum, &counter, sizeof(counter));
+            stamp->shard_checksum = snapshot_checksum(stamp->shard_checksum, &pages, sizeof(pages));
+            stamp->shard_checksum = snapshot_checksum(stamp->shard_checksum, &size, sizeof(size));
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    mbsfree(sql);
+    return ret;
+}
+
+/**
+ * growable buffer used when building the snapshot.
+ */
+typedef struct snapshot_buf_st {
+    uint8_t *data;
+    uint64_t len;
+    uint64_t size;
+} snapshot_buf_t;
+
+static int snapshot_buf_reserve(snapshot_buf_t *buf, uint64_t len)
+{
+    uint8_t *data;
+    uint64_t size;
+
+    if (buf->len + len <= buf->size) {
+        return 0;
+    }
+
+    size = buf->size ? buf->size : 4096;
+    while (size < buf->len + len) {
+        size *= 2;
+    }
+
+    data = realloc(buf->data, size);
+    if (data == NULL) {
+        return -GBS_ERROR_NOMEM;
+    }
+
+    buf->data = data;
+    buf->size = size;
+    return 0;
+}
+
+static int64_t snapshot_buf_append(snapshot_buf_t *buf, void *data, uint64_t len)
+{
+    uint64_t offset = buf->len;
+
+    if (snapshot_buf_reserve(buf, len) < 0) {
+        return -GBS_ERROR_NOMEM;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return offset;
+}
+
+static int snapshot_write_section(FILE *fp, uint32_t *checksum, void *data, uint64_t len, uint64_t aligned)
+{
+    static uint8_t zeros[8] = {0, };
+
+    if (len && fwrite(data, 1, len, fp) != len) {
+        return -GBS_ERROR_FILE;
+    }
+    *checksum = snapshot_checksum(*checksum, data, len);
+
+    if (aligned > len) {
+        if (fwrite(zeros, 1, aligned - len, fp) != aligned - len) {
+            return -GBS_ERROR_FILE;
+        }
+        *checksum = snapshot_checksum(*checksum, zeros, aligned - len);
+    }
+
+    return 0;
+}
+
+static gbs_snapshot_book_t *g_sort_books;
+static char *g_sort_heap;
+
+static int snapshot_title_cmp(const void *a, const void *b)
+{
+    gbs_snapshot_book_t *b1 = g_sort_books + *(uint32_t *)a;
+    gbs_snapshot_book_t *b2 = g_sort_books + *(uint32_t *)b;
+    int cmp;
+
+    cmp = strcmp(g_sort_heap + b1->str[GBS_SNAPSHOT_FIELD_TITLE],
+            g_sort_heap + b2->str[GBS_SNAPSHOT_FIELD_TITLE]);
+    if (cmp == 0) {
+        cmp = b1->id - b2->id;
+    }
+
+    return cmp;
+}
+
+/**
+ * build the snapshot of dbfile into snapfile, the snapshot is written into
+ * a temporary file and renamed, so the readers never see a partial file.
+ */
+int gbs_snapshot_write(char *dbfile, char *snapfile)
+{
+    int i;
+    int ret = 0;
+    FILE *fp = NULL;
+    sqlite3 *db = NULL;
+    mbs_t sql = NULL;
+    mbs_t tmpfile = NULL;
+    sqlite3_stmt *stmt = NULL;
+    uint32_t *hash = NULL;
+    uint32_t *title = NULL;
+    uint32_t slot, hval;
+    int64_t offset;
+    const unsigned char *text;
+    gbs_snapshot_book_t rec;
+    gbs_snapshot_book_t *books;
+    gbs_snapshot_header_t header;
+    snapshot_buf_t bookbuf = { NULL, 0, 0 };
+    snapshot_buf_t heapbuf = { NULL, 0, 0 };
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GBS_SNAPSHOT_MAGIC, sizeof(GBS_SNAPSHOT_MAGIC));
+    header.version = GBS_SNAPSHOT_VERSION;
+    header.header_size = sizeof(header);
+    header.nfield = GBS_SNAPSHOT_FIELD_MAX;
+
+    if (db_open_file(dbfile, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", dbfile);
+        return -GBS_ERROR_DB;
+    }
+
+    /* hold the read locks, so the stamp matches the rows we read */
+    sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+    ret = snapshot_db_stamp(db, &header.stamp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    mbscatfmt(&sql, "SELECT id, size, pages, scaned, years, popular, quality, ctime, mtime, price");
+    for (i = 0; i < GBS_SNAPSHOT_FIELD_MAX; i++) {
+        mbscatfmt(&sql, ", %s", g_snapshot_fields[i]);
+    }
+    mbscatfmt(&sql, " FROM gbs_book ORDER BY id;");
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        gbs_error("invalid sql: %s, msg %s\n", sql, sqlite3_errmsg(db));
+        ret = -GBS_ERROR_DB;
+        goto out;
+    }
+
+    /* offset 0 of the heap is the empty string */
+    if (snapshot_buf_append(&heapbuf, "", 1) < 0) {
+        ret = -GBS_ERROR_NOMEM;
+        goto out;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        memset(&rec, 0, sizeof(rec));
+        rec.id = sqlite3_column_int(stmt, 0);
+        rec.size = sqlite3_column_int(stmt, 1);
+        rec.pages = sqlite3_column_int(stmt, 2);
+        rec.scaned = sqlite3_column_int(stmt, 3);
+        rec.years = sqlite3_column_int(stmt, 4);
+        rec.popular = sqlite3_column_int(stmt, 5);
+        rec.quality = sqlite3_column_int(stmt, 6);
+        rec.ctime = sqlite3_column_int64(stmt, 7);
+        rec.mtime = sqlite3_column_int64(stmt, 8);
+        rec.price = sqlite3_column_double(stmt, 9);
+        for (i = 0; i < GBS_SNAPSHOT_FIELD_MAX; i++) {
+            text = sqlite3_column_text(stmt, 10 + i);
+            if (text == NULL || text[0] == '\0') {
+                continue;
+            }
+
+            offset = snapshot_buf_append(&heapbuf, (void *)text, sqlite3_column_bytes(stmt, 10 + i) + 1);
+            if (offset < 0 || offset > UINT32_MAX) {
+                gbs_error("the string heap of snapshot is too large\n");
+                ret = -GBS_ERROR_NOMEM;
+                goto out;
+            }
+            rec.str[i] = offset;
+        }
+
+        if (snapshot_buf_append(&bookbuf, &rec, sizeof(rec)) < 0) {
+            ret = -GBS_ERROR_NOMEM;
+            goto out;
+        }
+        header.nbook++;
+    }
+
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+
+    books = (gbs_snapshot_book_t *)bookbuf.data;
+
+    /* the md5 hash table is half full at most */
+    header.hash_size = 16;
+    while (header.hash_size < header.nbook * 2) {
+        header.hash_size <<= 1;
+    }
+
+    hash = calloc(header.hash_size, sizeof(uint32_t));
+    title = malloc((header.nbook + 1) * sizeof(uint32_t));
+    if (hash == NULL || title == NULL) {
+        ret = -GBS_ERROR_NOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < header.nbook; i++) {
+        char *md5 = (char *)heapbuf.data + books[i].str[GBS_SNAPSHOT_FIELD_MD5];
+
+        hval = snapshot_md5_hash(md5, strlen(md5));
+        for (slot = hval & (header.hash_size - 1); hash[slot]; slot = (slot + 1) & (header.hash_size - 1));
+        hash[slot] = i + 1;
+        title[i] = i;
+    }
+
+    g_sort_books = books;
+    g_sort_heap = (char *)heapbuf.data;
+    qsort(title, header.nbook, sizeof(uint32_t), snapshot_title_cmp);
+    g_sort_books = NULL;
+    g_sort_heap = NULL;
+
+    header.book_offset = GBS_SNAPSHOT_ALIGN(sizeof(header));
+    header.hash_offset = GBS_SNAPSHOT_ALIGN(header.book_offset + bookbuf.len);
+    header.title_offset = GBS_SNAPSHOT_ALIGN(header.hash_offset + header.hash_size * sizeof(uint32_t));
+    header.heap_offset = GBS_SNAPSHOT_ALIGN(header.title_offset + header.nbook * sizeof(uint32_t));
+    header.heap_size = heapbuf.len;
+    header.file_size = GBS_SNAPSHOT_ALIGN(header.heap_offset + heapbuf.len);
+
+    mbscatfmt(&tmpfile, "%s.tmp", snapfile);
+    fp = fopen(tmpfile, "wb");
+    if (fp == NULL) {
+        gbs_error("Error: create snapshot %s failed, %s\n", tmpfile, strerror(errno));
+        ret = -GBS_ERROR_FILE;
+        goto out;
+    }
+
+    /* write the placeholder of header, the checksums are filled at last */
+    header.body_checksum = 0x811C9DC5;
+    if (fwrite(&header, 1, header.book_offset, fp) != header.book_offset
+            || snapshot_write_section(fp, &header.body_checksum, bookbuf.data, bookbuf.len, header.hash_offset - header.book_offset) < 0
+            || snapshot_write_section(fp, &header.body_checksum, hash, header.hash_size * sizeof(uint32_t), header.title_offset - header.hash_offset) < 0
+            || snapshot_write_section(fp, &header.body_checksum, title, header.nbook * sizeof(uint32_t), header.heap_offset - header.title_offset) < 0
+            || snapshot_write_section(fp, &header.body_checksum, heapbuf.data, heapbuf.len, header.file_size - header.heap_offset) < 0) {
+        gbs_error("Error: write snapshot %s failed\n", tmpfile);
+        ret = -GBS_ERROR_FILE;
+        goto out;
+    }
+
+    header.header_checksum = snapshot_checksum(0x811C9DC5, &header, offsetof(gbs_snapshot_header_t, header_checksum));
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, 1, sizeof(header), fp) != sizeof(header)) {
+        gbs_error("Error: write snapshot header %s failed\n", tmpfile);
+        ret = -GBS_ERROR_FILE;
+        goto out;
+    }
+
+    fclose(fp);
+    fp = NULL;
+
+#ifdef _WIN32
+    remove(snapfile);
+#endif
+    if (rename(tmpfile, snapfile) != 0) {
+        gbs_error("Error: rename %s to %s failed, %s\n", tmpfile, snapfile, strerror(errno));
+        ret = -GBS_ERROR_FILE;
+    }
+
+out:
+    if (fp) {
+        fclose(fp);
+        remove(tmpfile);
+    }
+    if (stmt) {
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+    free(hash);
+    free(title);
+    free(bookbuf.data);
+    free(heapbuf.data);
+    mbsfree(tmpfile);
+    mbsfree(sql);
+    return ret;
+}
+
+static int snapshot_map(gbs_snapshot_t *snap, char *snapfile)
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    snap->file = CreateFileA(snapfile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (snap->file == INVALID_HANDLE_VALUE) {
+        return -GBS_ERROR_FILE;
+    }
+
+    if (!GetFileSizeEx(snap->file, &size) || size.QuadPart < sizeof(gbs_snapshot_header_t)) {
+        CloseHandle(snap->file);
+        return -GBS_ERROR_FILE;
+    }
+
+    snap->mapping = CreateFileMappingA(snap->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (snap->mapping == NULL) {
+        CloseHandle(snap->file);
+        return -GBS_ERROR_FILE;
+    }
+
+    snap->base = MapViewOfFile(snap->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (snap->base == NULL) {
+        CloseHandle(snap->mapping);
+        CloseHandle(snap->file);
+        return -GBS_ERROR_FILE;
+    }
+
+    snap->size = size.QuadPart;
+#else
+    int fd;
+    struct stat st;
+
+    fd = open(snapfile, O_RDONLY);
+    if (fd < 0) {
+        return -GBS_ERROR_FILE;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(gbs_snapshot_header_t)) {
+        close(fd);
+        return -GBS_ERROR_FILE;
+    }
+
+    snap->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snap->base == MAP_FAILED) {
+        snap->base = NULL;
+        return -GBS_ERROR_FILE;
+    }
+
+    snap->size = st.st_size;
+#endif
+    return 0;
+}
+
+static void snapshot_unmap(gbs_snapshot_t *snap)
+{
+    if (snap->base == NULL) {
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(snap->base);
+    CloseHandle(snap->mapping);
+    CloseHandle(snap->file);
+#else
+    munmap(snap->base, snap->size);
+#endif
+    snap->base = NULL;
+}
+
+static int snapshot_title_valid(uint32_t *title, uint32_t nbook)
+{
+    uint32_t i;
+
+    for (i = 0; i < nbook; i++) {
+        if (title[i] >= nbook) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * open and validate the snapshot of dbfile, NULL is returned if the snapshot
+ * is missing, corrupted or stale, the caller should load from dbfile then.
+ * the whole body is checksummed only if verify is set, the header, the end
+ * of the string heap and the title order are always checked.
+ */
+gbs_snapshot_t *gbs_snapshot_open(char *dbfile, char *snapfile, int verify)
+{
+    int ret;
+    sqlite3 *db;
+    gbs_snapshot_t *snap;
+    gbs_snapshot_header_t *header;
+    gbs_snapshot_stamp_t stamp;
+
+    /* the shards are known by the main database only */
+    if (access(dbfile, F_OK) != 0 || db_open_file(dbfile, &db) < 0) {
+        return NULL;
+    }
+
+    sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+    ret = snapshot_db_stamp(db, &stamp);
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    sqlite3_close(db);
+    if (ret < 0) {
+        return NULL;
+    }
+
+    snap = malloc(sizeof(gbs_snapshot_t));
+    if (snap == NULL) {
+        return NULL;
+    }
+
+    memset(snap, 0, sizeof(gbs_snapshot_t));
+    if (snapshot_map(snap, snapfile) < 0) {
+        free(snap);
+        return NULL;
+    }
+
+    header = (gbs_snapshot_header_t *)snap->base;
+    if (memcmp(header->magic, GBS_SNAPSHOT_MAGIC, sizeof(GBS_SNAPSHOT_MAGIC)) != 0
+            || header->version != GBS_SNAPSHOT_VERSION
+            || header->header_size != sizeof(gbs_snapshot_header_t)
+            || header->nfield != GBS_SNAPSHOT_FIELD_MAX
+            || header->header_checksum != snapshot_checksum(0x811C9DC5, header, offsetof(gbs_snapshot_header_t, header_checksum))) {
+        gbs_debug("snapshot %s is invalid\n", snapfile);
+        goto error;
+    }
+
+    if (header->file_size != snap->size
+            || header->book_offset + (uint64_t)header->nbook * sizeof(gbs_snapshot_book_t) > header->hash_offset
+            || header->hash_offset + (uint64_t)header->hash_size * sizeof(uint32_t) > header->title_offset
+            || header->title_offset + (uint64_t)header->nbook * sizeof(uint32_t) > header->heap_offset
+            || header->heap_offset + header->heap_size > header->file_size
+            || header->heap_size == 0
+            || (header->hash_size & (header->hash_size - 1))) {
+        gbs_debug("snapshot %s is truncated\n", snapfile);
+        goto error;
+    }
+
+    /* the strings end in the heap and the title order is of the books, verify or not */
+    if (snap->base[header->heap_offset + header->heap_size - 1] != '\0'
+            || !snapshot_title_valid((uint32_t *)(snap->base + header->title_offset), header->nbook)) {
+        gbs_debug("snapshot %s is corrupted\n", snapfile);
+        goto error;
+    }
+
+    if (memcmp(&header->stamp, &stamp, sizeof(stamp)) != 0) {
+        gbs_debug("snapshot %s is stale, counter %u != %u, pages %u != %u, shards %u != %u\n", snapfile,
+                header->stamp.change_counter, stamp.change_counter, header->stamp.page_count, stamp.page_count,
+                header->stamp.nshard, stamp.nshard);
+        goto error;
+    }
+
+    if (verify && header->body_checksum != snapshot_checksum(0x811C9DC5,
+                snap->base + header->book_offset, header->file_size - header->book_offset)) {
+        gbs_debug("snapshot %s checksum mismatch\n", snapfile);
+        goto error;
+    }
+
+    snap->header = header;
+    snap->books = (gbs_snapshot_book_t *)(snap->base + header->book_offset);
+    snap->hash = (uint32_t *)(snap->base + header->hash_offset);
+    snap->title = (uint32_t *)(snap->base + header->title_offset);
+    snap->heap = (char *)(snap->base + header->heap_offset);
+    return snap;
+
+error:
+    snapshot_unmap(snap);
+    free(snap);
+    return NULL;
+}
+
+void gbs_snapshot_close(gbs_snapshot_t *snap)
+{
+    if (snap) {
+        snapshot_unmap(snap);
+        free(snap);
+    }
+}
+
+int gbs_snapshot_count(gbs_snapshot_t *snap)
+{
+    return snap->header->nbook;
+}
+
+gbs_snapshot_book_t *gbs_snapshot_book(gbs_snapshot_t *snap, int idx)
+{
+    if (idx < 0 || idx >= snap->header->nbook) {
+        return NULL;
+    }
+
+    return snap->books + idx;
+}
+
+/**
+ * the idx-th book in the order of title.
+ */
+gbs_snapshot_book_t *gbs_snapshot_book_by_title(gbs_snapshot_t *snap, int idx)
+{
+    if (idx < 0 || idx >= snap->header->nbook) {
+        return NULL;
+    }
+
+    return snap->books + snap->title[idx];
+}
+
+char *gbs_snapshot_str(gbs_snapshot_t *snap, gbs_snapshot_book_t *book, int field)
+{
+    uint32_t offset;
+
+    if (field < 0 || field >= GBS_SNAPSHOT_FIELD_MAX) {
+        return "";
+    }
+
+    offset = book->str[field];
+    if (offset >= snap->header->heap_size) {
+        return "";
+    }
+
+    return snap->heap + offset;
+}
+
+gbs_snapshot_book_t *gbs_snapshot_find_md5(gbs_snapshot_t *snap, char *md5)
+{
+    uint32_t slot;
+    uint32_t mask = snap->header->hash_size - 1;
+    gbs_snapshot_book_t *book;
+
+    for (slot = snapshot_md5_hash(md5, strlen(md5)) & mask; snap->hash[slot]; slot = (slot + 1) & mask) {
+        if (snap->hash[slot] > snap->header->nbook) {
+            return NULL;
+        }
+
+        book = snap->books + snap->hash[slot] - 1;
+        if (str_equal(gbs_snapshot_str(snap, book, GBS_SNAPSHOT_FIELD_MD5), md5)) {
+            return book;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,613 @@
+#include "gbookshelf.h"
+#include "libcmd.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/**
+ * gbsbench, the storage benchmark of gbs database.
+ *
+ * it generates a synthetic library of N books, every book is generated from
+ * (seed, index) only, so the same books come back for the lookups without
+ * keeping them in memory, and the runs with the same seed are comparable.
+ * The result is written as one json object.
+ */
+
+#define BENCH_LIST_LIMIT    50      /*< the rows of one filtered listing */
+#define BENCH_SCAN_QUERIES  20      /*< the title lookups by sql scan the table, do less */
+
+typedef struct bench_stat_st {
+    char *name;
+    int n;
+    int size;
+    double *samples;        /*< the latency of every op in seconds */
+    double seconds;         /*< the total elapsed time */
+    long ops;               /*< the ops done in seconds, one sample may do many */
+} bench_stat_t;
+
+static uint64_t g_bench_rand;
+
+static char *g_bench_words[] = {
+    "advanced", "algorithm", "analysis", "applied", "architecture", "art", "basic", "beginning",
+    "building", "classic", "cloud", "complete", "computer", "concepts", "data", "database",
+    "deep", "design", "developer", "digital", "distributed", "effective", "embedded", "engineering",
+    "essential", "foundations", "functional", "game", "guide", "handbook", "history", "introduction",
+    "kernel", "language", "learning", "linux", "machine", "management", "mastering", "mathematics",
+    "modern", "network", "practical", "principles", "programming", "python", "reference", "science",
+    "security", "software", "systems", "theory", "thinking", "unix", "web", "windows",
+};
+
+static char *g_bench_hanzi[] = {
+    "计算机", "程序", "设计", "算法", "数据", "结构", "网络", "系统", "原理", "实践",
+    "入门", "精通", "指南", "教程", "开发", "技术", "编程", "语言", "历史", "艺术",
+    "音乐", "电影", "数学", "物理", "经济", "管理", "文学", "哲学", "中国", "世界",
+    "现代", "基础", "高级", "应用", "分析", "工程", "安全", "操作", "嵌入式", "分布式",
+};
+
+static char *g_bench_formats[] = { "pdf", "djvu", "epub", "chm", "mobi", "txt" };
+static char *g_bench_languages[] = { "English", "Chinese", "Japanese", "French", "German" };
+static char *g_bench_surnames[] = {
+    "Smith", "Johnson", "Brown", "Taylor", "Miller", "Wilson", "Moore", "Anderson",
+    "Thomas", "Jackson", "White", "Harris", "Martin", "Thompson", "Garcia", "Clark",
+    "Wang", "Li", "Zhang", "Liu", "Chen", "Yang", "Zhao", "Huang",
+};
+
+/* xorshift64*, it must never change, or the runs are not comparable */
+static uint64_t bench_rand(void)
+{
+    g_bench_rand ^= g_bench_rand >> 12;
+    g_bench_rand ^= g_bench_rand << 25;
+    g_bench_rand ^= g_bench_rand >> 27;
+    return g_bench_rand * 2685821657736338717ULL;
+}
+
+static void bench_srand(uint64_t seed, uint64_t idx)
+{
+    /* splitmix64 of (seed, idx), never zero */
+    uint64_t z = seed + (idx + 1) * 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    g_bench_rand = (z ^ (z >> 31)) | 1;
+}
+
+static double bench_uniform(void)
+{
+    return (bench_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* lo .. hi, the most are short and few are long like the real text */
+static int bench_skewed(int lo, int hi)
+{
+    double u = bench_uniform();
+
+    return lo + (int)((hi - lo) * u * u * u);
+}
+
+/* 0 .. n-1, the small ones are picked much more, like the shared publishers */
+static int bench_popular(int n)
+{
+    double u = bench_uniform();
+
+    return (int)(n * u * u);
+}
+
+#define bench_pick(array) (array[bench_rand() % (sizeof(array) / sizeof(array[0]))])
+
+static double bench_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void bench_words(mbs_t *text, int nword, int chinese)
+{
+    int i;
+    char *word;
+
+    for (i = 0; i < nword; i++) {
+        if (chinese) {
+            mbscat(text, bench_pick(g_bench_hanzi));
+        } else {
+            word = bench_pick(g_bench_words);
+            mbscatfmt(text, "%s%c%s", i ? " " : "", i ? word[0] : toupper((int)word[0]), word + 1);
+        }
+    }
+}
+
+static void bench_paragraph(mbs_t *text, int len, int chinese)
+{
+    mbscpy(text, "");
+    while (mbslen(*text) < len) {
+        bench_words(text, bench_skewed(5, 20), chinese);
+        mbscat(text, chinese ? "。" : ". ");
+    }
+}
+
+static void bench_values(dpa_t *dpa, mbs_t *flat, int n, char *fmt, int pool)
+{
+    int i;
+    mbs_t value;
+
+    for (i = 0; i < dpa->used; i++) {
+        mbsfree(dpa->array[i]);
+    }
+    dpa->used = 0;
+
+    mbscpy(flat, "");
+    for (i = 0; i < n; i++) {
+        value = mbsnewfmt(fmt, bench_pick(g_bench_surnames), bench_popular(pool));
+        mbscatfmt(flat, "%s%s", i ? GBS_DB_VALUE_SEPARATOR : "", value);
+        dpa_push(dpa, value);
+    }
+}
+
+/**
+ * fill the book with the synthetic fields of the idx-th book, the fields
+ * of the book are reused from the last call.
+ */
+static void bench_book_fill(gbs_book_t *book, uint64_t seed, long idx, long nbook)
+{
+    int chinese;
+    int genre;
+    int npublisher = nbook / 1000 + 50;
+    int nauthor = nbook / 5 + 10;
+
+    bench_srand(seed, idx);
+    chinese = bench_uniform() < 0.3;
+    genre = bench_popular(64);
+
+    book->id = 0;
+    mbscpyfmt(&book->md5, "%016llx%016llx", (unsigned long long)bench_rand(), (unsigned long long)bench_rand());
+
+    mbscpy(&book->title, "");
+    bench_words(&book->title, chinese ? bench_skewed(2, 8) : bench_skewed(2, 12), chinese);
+    mbscpy(&book->subtitle, "");
+    if (bench_uniform() < 0.4) {
+        bench_words(&book->subtitle, bench_skewed(2, 10), chinese);
+    }
+
+    mbscpyfmt(&book->isbn, "978%010llu", (unsigned long long)(bench_rand() % 10000000000ULL));
+    mbscpy(&book->format, g_bench_formats[bench_popular(sizeof(g_bench_formats) / sizeof(g_bench_formats[0]))]);
+    mbscpyfmt(&book->genre, "/Genre %d", genre / 8);
+    mbscpyfmt(&book->subgenre, "Subgenre %d", genre);
+    mbscpy(&book->language, chinese ? "Chinese" : g_bench_languages[bench_popular(sizeof(g_bench_languages) / sizeof(g_bench_languages[0]))]);
+    mbscpyfmt(&book->date, "%04d-%02d-%02d", 1980 + (int)(bench_rand() % 45), 1 + (int)(bench_rand() % 12), 1 + (int)(bench_rand() % 28));
+    mbscpyfmt(&book->version, "%d", 1 + bench_skewed(0, 8));
+    mbscpy(&book->series, "");
+    if (bench_uniform() < 0.1) {
+        bench_words(&book->series, 2, chinese);
+    }
+    mbscpyfmt(&book->publisher, "%s Press %d", bench_pick(g_bench_words), bench_popular(npublisher));
+    mbscpyfmt(&book->path, "//nas%d/books/Genre %d/%s.%s", (int)(bench_rand() % 4), genre / 8, book->md5, book->format);
+
+    bench_paragraph(&book->introduction, bench_skewed(0, 2000), chinese);
+    bench_paragraph(&book->contents, bench_uniform() < 0.5 ? 0 : bench_skewed(200, 8000), chinese);
+
+    bench_values(&book->_authors, &book->authors, 1 + bench_skewed(0, 4), "%s %d", nauthor);
+    bench_values(&book->_keywords, &book->keywords, bench_skewed(0, 6), "%s%d", 1000);
+    bench_values(&book->_urls, &book->urls, bench_skewed(0, 2), "http://%s.example.com/%d", 10000);
+    bench_values(&book->_customs, &book->customs, 0, "%s%d", 1);
+
+    mbscpy(&book->doi, "");
+    mbscpy(&book->libgenid, "");
+    mbscpy(&book->repository, "");
+
+    book->pages = bench_skewed(50, 1500);
+    book->size = book->pages * (20000 + (int)(bench_rand() % 80000));
+    book->scaned = bench_uniform() < 0.2;
+    book->years = bench_skewed(0, 30);
+    book->popular = bench_popular(100);
+    book->quality = (int)(bench_rand() % 5);
+    book->price = bench_skewed(500, 20000) / 100.0;
+    book->ctime = 1262304000 + (time_t)(bench_rand() % 473040000);
+    book->mtime = book->ctime;
+}
+
+static void bench_book_clean(gbs_book_t *book)
+{
+    int i;
+    dpa_t *dpas[] = { &book->_authors, &book->_keywords, &book->_urls, &book->_customs };
+    mbs_t *fields[] = {
+        &book->md5, &book->isbn, &book->format, &book->genre, &book->subgenre, &book->language,
+        &book->date, &book->version, &book->series, &book->title, &book->subtitle, &book->publisher,
+        &book->path, &book->contents, &book->introduction, &book->doi, &book->libgenid,
+        &book->repository, &book->urls, &book->authors, &book->keywords, &book->customs,
+    };
+
+    for (i = 0; i < sizeof(dpas) / sizeof(dpas[0]); i++) {
+        while (dpas[i]->used > 0) {
+            mbsfree(dpas[i]->array[--dpas[i]->used]);
+        }
+        free(dpas[i]->array - dpas[i]->shift);
+    }
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        mbsfree(*fields[i]);
+    }
+}
+
+static bench_stat_t *bench_stat_new(char *name, int size)
+{
+    bench_stat_t *stat;
+
+    stat = malloc(sizeof(bench_stat_t));
+    if (stat == NULL) {
+        return NULL;
+    }
+
+    memset(stat, 0, sizeof(bench_stat_t));
+    stat->name = name;
+    stat->size = size > 0 ? size : 1;
+    stat->samples = malloc(stat->size * sizeof(double));
+    if (stat->samples == NULL) {
+        free(stat);
+        return NULL;
+    }
+
+    return stat;
+}
+
+static void bench_stat_add(bench_stat_t *stat, double seconds, long ops)
+{
+    if (stat->n < stat->size) {
+        stat->samples[stat->n++] = seconds;
+    }
+    stat->seconds += seconds;
+    stat->ops += ops;
+}
+
+static int bench_double_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(bench_stat_t *stat, int p)
+{
+    int i;
+
+    if (stat->n == 0) {
+        return 0;
+    }
+
+    i = (int)((stat->n - 1) * (p / 100.0) + 0.5);
+    return stat->samples[i] * 1e6;
+}
+
+static void bench_stat_print(FILE *fp, bench_stat_t *stat, int last)
+{
+    qsort(stat->samples, stat->n, sizeof(double), bench_double_cmp);
+    fprintf(fp, "    \"%s\": {\"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+            "\"latency_us\": {\"samples\": %d, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}}%s\n",
+            stat->name, stat->ops, stat->seconds, stat->seconds > 0 ? stat->ops / stat->seconds : 0,
+            stat->n, bench_percentile(stat, 50), bench_percentile(stat, 90), bench_percentile(stat, 99),
+            bench_percentile(stat, 100), last ? "" : ",");
+    free(stat->samples);
+    free(stat);
+}
+
+static int bench_insert(char *filename, uint64_t seed, long nbook, int batch, bench_stat_t *stat)
+{
+    int ret = 0;
+    long i;
+    double start;
+    gbs_book_t book;
+    mbs_t snapfile;
+
+    /* the snapshot of the old database would be loaded instead of it */
+    memset(&book, 0, sizeof(book));
+    snapfile = mbsnewfmt("%s%s", filename, GBS_SNAPSHOT_SUFFIX);
+    unlink(snapfile);
+    mbsfree(snapfile);
+    unlink(filename);
+    ret = db_open(filename);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nbook && ret == 0; ) {
+        long n = 0;
+        double elapsed = 0;
+
+        db_begin();
+        for (; i < nbook && n < batch; i++, n++) {
+            /* the generation is not the cost of database */
+            bench_book_fill(&book, seed, i, nbook);
+            start = bench_now();
+            ret = db_book_insert(&book);
+            elapsed += bench_now() - start;
+            if (ret < 0) {
+                break;
+            }
+        }
+        start = bench_now();
+        db_commit();
+        bench_stat_add(stat, elapsed + bench_now() - start, n);
+    }
+
+    bench_book_clean(&book);
+    db_close();
+    return ret;
+}
+
+/**
+ * the md5 and title lookups in the catalog loaded by gbs_db_read.
+ */
+static void bench_lookup_memory(uint64_t seed, long nbook, int nquery, bench_stat_t *md5, bench_stat_t *title)
+{
+    int i;
+    double start;
+    gbs_book_t book, user;
+
+    memset(&book, 0, sizeof(book));
+    for (i = 0; i < nquery; i++) {
+        bench_srand(seed ^ 0x5bd1e995, i);
+        bench_book_fill(&book, seed, bench_rand() % nbook, nbook);
+
+        memset(&user, 0, sizeof(user));
+        user.md5 = book.md5;
+        start = bench_now();
+        gbs_book_table_find(&user);
+        bench_stat_add(md5, bench_now() - start, 1);
+
+        memset(&user, 0, sizeof(user));
+        user.title = book.title;
+        start = bench_now();
+        gbs_book_table_find(&user);
+        bench_stat_add(title, bench_now() - start, 1);
+    }
+
+    bench_book_clean(&book);
+}
+
+static int bench_query(sqlite3 *db, sqlite3_stmt *stmt, char *value, bench_stat_t *stat)
+{
+    int rows = 0;
+    double start;
+
+    start = bench_now();
+    sqlite3_bind_text(stmt, 1, value, -1, SQLITE_STATIC);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        rows++;
+    }
+    sqlite3_reset(stmt);
+    bench_stat_add(stat, bench_now() - start, 1);
+    return rows;
+}
+
+/**
+ * the md5 and title lookups and the filtered listing by sql, the title has
+ * no index, it's a table scan.
+ */
+static int bench_lookup_sql(char *filename, uint64_t seed, long nbook, int nquery,
+        bench_stat_t *md5, bench_stat_t *title, bench_stat_t *list)
+{
+    int i;
+    sqlite3 *db;
+    mbs_t genre = NULL;
+    gbs_book_t book;
+    sqlite3_stmt *md5_stmt = NULL, *title_stmt = NULL, *list_stmt = NULL;
+
+    if (db_open_file(filename, &db) < 0) {
+        gbs_error("Error: open db %s failed\n", filename);
+        return -GBS_ERROR_DB;
+    }
+
+    sqlite3_prepare_v2(db, "SELECT id FROM gbs_book WHERE md5 = ?;", -1, &md5_stmt, NULL);
+    sqlite3_prepare_v2(db, "SELECT id FROM gbs_book WHERE title = ?;", -1, &title_stmt, NULL);
+    sqlite3_prepare_v2(db, "SELECT id, title, publisher FROM gbs_book WHERE genre = ? ORDER BY title LIMIT ?;",
+            -1, &list_stmt, NULL);
+    if (!md5_stmt || !title_stmt || !list_stmt) {
+        gbs_error("prepare the queries failed, msg %s\n", sqlite3_errmsg(db));
+        goto out;
+    }
+
+    /* the bindings are kept by sqlite3_reset */
+    sqlite3_bind_int(list_stmt, 2, BENCH_LIST_LIMIT);
+
+    memset(&book, 0, sizeof(book));
+    for (i = 0; i < nquery; i++) {
+        bench_srand(seed ^ 0x5bd1e995, i);
+        bench_book_fill(&book, seed, bench_rand() % nbook, nbook);
+        bench_query(db, md5_stmt, book.md5, md5);
+        if (i < BENCH_SCAN_QUERIES) {
+            bench_query(db, title_stmt, book.title, title);
+        }
+        if (i < nquery / 10 + 1) {
+            mbscpy(&genre, book.genre);
+            bench_query(db, list_stmt, genre, list);
+        }
+    }
+    bench_book_clean(&book);
+
+out:
+    sqlite3_finalize(md5_stmt);
+    sqlite3_finalize(title_stmt);
+    sqlite3_finalize(list_stmt);
+    sqlite3_close(db);
+    mbsfree(genre);
+    return 0;
+}
+
+static int bench_lookup_snapshot(char *filename, char *snapfile, uint64_t seed, long nbook, int nquery, bench_stat_t *md5)
+{
+    int i;
+    double start;
+    gbs_book_t book;
+    gbs_snapshot_t *snap;
+
+    snap = gbs_snapshot_open(filename, snapfile, 0);
+    if (snap == NULL) {
+        return -GBS_ERROR_FILE;
+    }
+
+    memset(&book, 0, sizeof(book));
+    for (i = 0; i < nquery; i++) {
+        bench_srand(seed ^ 0x5bd1e995, i);
+        bench_book_fill(&book, seed, bench_rand() % nbook, nbook);
+        start = bench_now();
+        gbs_snapshot_find_md5(snap, book.md5);
+        bench_stat_add(md5, bench_now() - start, 1);
+    }
+
+    bench_book_clean(&book);
+    gbs_snapshot_close(snap);
+    return 0;
+}
+
+static int do_bench(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    int batch;
+    int nquery;
+    long nbook;
+    uint64_t seed;
+    double start;
+    FILE *fp = stdout;
+    char **output = NULL;
+    char **report = NULL;
+    var_int_t *books = NULL, *batches = NULL, *queries = NULL, *seeds = NULL;
+    mbs_t snapfile = NULL;
+    bench_stat_t *insert, *load, *snap_write;
+    bench_stat_t *mem_md5, *mem_title, *sql_md5, *sql_title, *sql_list, *snap_md5;
+
+    output = app_param_get(app, "output");
+    if (!output) {
+        goto out;
+    }
+
+    books = app_param_get(app, "books");
+    batches = app_param_get(app, "batch");
+    queries = app_param_get(app, "queries");
+    seeds = app_param_get(app, "seed");
+    report = app_param_get(app, "report");
+    nbook = books ? *books : 10000;
+    batch = batches ? *batches : 1000;
+    nquery = queries ? *queries : 10000;
+    seed = seeds ? *seeds : 1;
+    if (nbook < 1 || batch < 1 || nquery < 1) {
+        gbs_error("the books, batch and queries must be positive\n");
+        goto out;
+    }
+
+    insert = bench_stat_new("insert", nbook / batch + 1);
+    load = bench_stat_new("load", 1);
+    snap_write = bench_stat_new("snapshot_write", 1);
+    mem_md5 = bench_stat_new("memory_md5_lookup", nquery);
+    mem_title = bench_stat_new("memory_title_lookup", nquery);
+    sql_md5 = bench_stat_new("sql_md5_lookup", nquery);
+    sql_title = bench_stat_new("sql_title_lookup", BENCH_SCAN_QUERIES);
+    sql_list = bench_stat_new("sql_filtered_list", nquery / 10 + 1);
+    snap_md5 = bench_stat_new("snapshot_md5_lookup", nquery);
+
+    gbs_error("insert %ld books into %s ...\n", nbook, *output);
+    ret = bench_insert(*output, seed, nbook, batch, insert);
+    if (ret < 0) {
+        goto out;
+    }
+
+    gbs_error("load ...\n");
+    gbs_format_init();
+    gbs_language_init();
+    gbs_publisher_init();
+    gbs_genre_init();
+    gbs_book_init();
+    start = bench_now();
+    gbs_db_read(*output);
+    bench_stat_add(load, bench_now() - start, nbook);
+
+    gbs_error("lookup ...\n");
+    bench_lookup_memory(seed, nbook, nquery, mem_md5, mem_title);
+    bench_lookup_sql(*output, seed, nbook, nquery, sql_md5, sql_title, sql_list);
+
+    gbs_error("snapshot ...\n");
+    snapfile = mbsnewfmt("%s%s", *output, GBS_SNAPSHOT_SUFFIX);
+    start = bench_now();
+    ret = gbs_snapshot_write(*output, snapfile);
+    bench_stat_add(snap_write, bench_now() - start, nbook);
+    if (ret == 0) {
+        bench_lookup_snapshot(*output, snapfile, seed, nbook, nquery, snap_md5);
+    }
+
+    gbs_book_fini();
+    gbs_genre_fini();
+    gbs_publisher_fini();
+    gbs_language_fini();
+    gbs_format_fini();
+
+    if (report && strcmp(*report, "-")) {
+        fp = fopen(*report, "w");
+        if (fp == NULL) {
+            gbs_error("open %s failed\n", *report);
+            fp = stdout;
+        }
+    }
+
+    fprintf(fp, "{\n  \"books\": %ld, \"batch\": %d, \"queries\": %d, \"seed\": %llu, \"sqlite\": \"%s\",\n  \"results\": {\n",
+            nbook, batch, nquery, (unsigned long long)seed, sqlite3_libversion());
+    bench_stat_print(fp, insert, 0);
+    bench_stat_print(fp, load, 0);
+    bench_stat_print(fp, snap_write, 0);
+    bench_stat_print(fp, mem_md5, 0);
+    bench_stat_print(fp, mem_title, 0);
+    bench_stat_print(fp, sql_md5, 0);
+    bench_stat_print(fp, sql_title, 0);
+    bench_stat_print(fp, sql_list, 0);
+    bench_stat_print(fp, snap_md5, 1);
+    fprintf(fp, "  }\n}\n");
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    ret = 0;
+
+out:
+    app_param_destroy(output);
+    app_param_destroy(report);
+    app_param_destroy(books);
+    app_param_destroy(batches);
+    app_param_destroy(queries);
+    app_param_destroy(seeds);
+    mbsfree(snapfile);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+    app_t *bench;
+
+    bench = app_create("gbsbench",
+            "0.0.1",
+            "liaoxf<liaofei1128@gmail.com>",
+            "Copyright (C) liaoxf 2011-2012",
+            "the storage benchmark of gbs database with the synthetic library.");
+
+    app_add_option(bench, 'o', "output", "string", 0, "the path of gbs database to generate, it's overwritten");
+    app_add_option(bench, 'n', "books", "int", 0, "the number of books to generate, 10000 by default");
+    app_add_option(bench, 'b', "batch", "int", 0, "the number of books inserted in one transaction, 1000 by default");
+    app_add_option(bench, 'q', "queries", "int", 0, "the number of lookups, 10000 by default");
+    app_add_option(bench, 's', "seed", "int", 0, "the seed of the synthetic library, 1 by default");
+    app_add_option(bench, 'r', "report", "string", 0, "write the json report into this file, - is the stdout");
+
+    app_add_cmdline(bench, "output,[books,batch,queries,seed,report]", do_bench, "generate the library into output and measure it");
+
+    ret = app_run(bench, argc, argv);
+
+    app_destroy(bench);
+    return ret;
+}
@@ -109,8 +109,10 @@ static int do_list(app_t *app, cmdline_t *cmdline)
     int i;
     int ret = -1;
     var_range_t *id = NULL;
+    var_int_t *limit = NULL, *after = NULL;
     char **input = NULL, **filename = NULL;
     char **keyname = NULL;
+    char **value = NULL;
     char *displays = NULL;
     char *orderconditions = NULL;
 
@@ -146,11 +148,22 @@ static int do_list(app_t *app, cmdline_t *cmdline)
 
     if (orderconditions) {
         strtrim(orderconditions, ",");
-    } else {
-        orderconditions = strdup("extension ASC, size DESC");
     }
 
     input = app_param_get(app, "i");
+    limit = app_param_get(app, "n");
+    after = app_param_get(app, "c");
+    if (limit || after) {
+        ret = db_list_page(*input, orderconditions, displays, limit ? *limit : 0, after ? *after : 0);
+        app_param_destroy(limit);
+        app_param_destroy(after);
+        goto out;
+    }
+
+    if (orderconditions == NULL) {
+        orderconditions = strdup("extension ASC, size DESC");
+    }
+
     filename = app_param_get(app, "f");
     if (filename) {
         ret = rcd_list_by_title(*input, *filename, orderconditions, displays);
@@ -158,6 +171,34 @@ static int do_list(app_t *app, cmdline_t *cmdline)
         goto out;
     }
 
+    value = app_param_get(app, "a");
+    if (value) {
+        ret = db_list_by_author(*input, *value, displays);
+        app_param_destroy(value);
+        goto out;
+    }
+
+    value = app_param_get(app, "e");
+    if (value) {
+        ret = db_list_by_keyword(*input, *value, displays);
+        app_param_destroy(value);
+        goto out;
+    }
+
+    value = app_param_get(app, "u");
+    if (value) {
+        ret = db_list_by_url(*input, *value, displays);
+        app_param_destroy(value);
+        goto out;
+    }
+
+    value = app_param_get(app, "s");
+    if (value) {
+        ret = db_list_by_text(*input, *value, displays);
+        app_param_destroy(value);
+        goto out;
+    }
+
     id = app_param_get(app, "x");
     if (id) {
         do {
@@ -273,6 +314,237 @@ out:
     return ret;
 }
 
+static int do_reindex(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    char **input = NULL;
+
+    input = app_param_get(app, "i");
+    if (!input) {
+        goto out;
+    }
+
+    ret = db_book_reindex(*input);
+
+out:
+    app_param_destroy(input);
+    return ret;
+}
+
+static int do_merge(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    char **input = NULL;
+    char **output = NULL;
+    char **rules = NULL;
+
+    input = app_param_get(app, "i");
+    output = app_param_get(app, "o");
+    if (!input || !output) {
+        goto out;
+    }
+
+    rules = app_param_get(app, "r");
+    ret = db_merge(*output, *input, rules ? *rules : NULL);
+
+out:
+    app_param_destroy(input);
+    app_param_destroy(output);
+    app_param_destroy(rules);
+    return ret;
+}
+
+static int export_format(char *filename)
+{
+    char *ext = strrchr(filename, '.');
+
+    if (ext && !strcasecmp(ext, ".csv")) {
+        return GBS_EXPORT_CSV;
+    }
+
+    return GBS_EXPORT_JSONL;
+}
+
+static int do_export(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    char **input = NULL;
+    char **output = NULL;
+    char **table = NULL;
+
+    input = app_param_get(app, "i");
+    output = app_param_get(app, "o");
+    if (!input || !output) {
+        goto out;
+    }
+
+    table = app_param_get(app, "b");
+    ret = gbs_export(*input, table ? *table : NULL, export_format(*output), *output);
+    if (ret >= 0) {
+        gbs_debug("%d rows exported\n", ret);
+        ret = 0;
+    }
+
+out:
+    app_param_destroy(input);
+    app_param_destroy(output);
+    app_param_destroy(table);
+    return ret;
+}
+
+static int do_import(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    char **input = NULL;
+    char **filename = NULL;
+    char **table = NULL;
+
+    input = app_param_get(app, "i");
+    filename = app_param_get(app, "f");
+    if (!input || !filename) {
+        goto out;
+    }
+
+    table = app_param_get(app, "b");
+    ret = gbs_import(*input, table ? *table : NULL, export_format(*filename), *filename);
+    if (ret >= 0) {
+        gbs_print("%d rows imported\n", ret);
+        ret = 0;
+    }
+
+out:
+    app_param_destroy(input);
+    app_param_destroy(filename);
+    app_param_destroy(table);
+    return ret;
+}
+
+static int do_convert(app_t *app, int compact)
+{
+    int ret = -1;
+    char **input = NULL;
+    char **output = NULL;
+
+    input = app_param_get(app, "i");
+    output = app_param_get(app, "o");
+    if (!input || !output) {
+        goto out;
+    }
+
+    if (compact) {
+        ret = db_compact(*input, *output);
+    } else {
+        ret = db_expand(*input, *output);
+    }
+
+out:
+    app_param_destroy(input);
+    app_param_destroy(output);
+    return ret;
+}
+
+static int do_compact(app_t *app, cmdline_t *cmdline)
+{
+    return do_convert(app, 1);
+}
+
+static int do_expand(app_t *app, cmdline_t *cmdline)
+{
+    return do_convert(app, 0);
+}
+
+static int do_backup(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    var_int_t *pages = NULL;
+    char **input = NULL;
+    char **output = NULL;
+
+    input = app_param_get(app, "i");
+    output = app_param_get(app, "o");
+    if (!input || !output) {
+        goto out;
+    }
+
+    pages = app_param_get(app, "g");
+    ret = db_backup(*input, *output, pages ? *pages : 0);
+
+out:
+    app_param_destroy(input);
+    app_param_destroy(output);
+    app_param_destroy(pages);
+    return ret;
+}
+
+static int do_vacuum(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    var_int_t *pages = NULL;
+    var_int_t *seconds = NULL;
+    char **input = NULL;
+
+    input = app_param_get(app, "i");
+    if (!input) {
+        goto out;
+    }
+
+    pages = app_param_get(app, "g");
+    seconds = app_param_get(app, "y");
+    ret = db_vacuum(*input, pages ? *pages : 0, seconds ? *seconds : 0);
+
+out:
+    app_param_destroy(input);
+    app_param_destroy(pages);
+    app_param_destroy(seconds);
+    return ret;
+}
+
+static int do_shard(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    var_int_t *shards = NULL;
+    char **input = NULL;
+    char **output = NULL;
+    char **key = NULL;
+
+    input = app_param_get(app, "i");
+    output = app_param_get(app, "o");
+    if (!input || !output) {
+        goto out;
+    }
+
+    key = app_param_get(app, "h");
+    shards = app_param_get(app, "j");
+    ret = db_shard(*input, *output, key ? *key : "md5", shards ? *shards : 4);
+
+out:
+    app_param_destroy(input);
+    app_param_destroy(output);
+    app_param_destroy(key);
+    app_param_destroy(shards);
+    return ret;
+}
+
+static int do_snapshot(app_t *app, cmdline_t *cmdline)
+{
+    int ret = -1;
+    char **input = NULL;
+    char *snapfile = NULL;
+
+    input = app_param_get(app, "i");
+    if (!input) {
+        goto out;
+    }
+
+    strappendfmt(&snapfile, "%s%s", *input, GBS_SNAPSHOT_SUFFIX);
+    ret = gbs_snapshot_write(*input, snapfile);
+    free(snapfile);
+
+out:
+    app_param_destroy(input);
+    return ret;
+}
+
 static int do_dump_abbr(app_t *app, cmdline_t *cmdline)
 {
     dict_dump();
@@ -330,6 +602,18 @@ int main(int argc, char *argv[])
     app_add_option(gbsmgr, 'k', "keyname", "keyname", 0, "the key name to update");
     app_add_option(gbsmgr, 'v', "value", "string", 0, "the value to update");
     app_add_option(gbsmgr, 't', "extname", "string", 0, "the name of acceptable extensions");
+    app_add_option(gbsmgr, 'a', "author", "string", 0, "the author of resource");
+    app_add_option(gbsmgr, 'e', "keyword", "string", 0, "the keyword of resource");
+    app_add_option(gbsmgr, 'u', "url", "string", 0, "the url of resource");
+    app_add_option(gbsmgr, 's', "search", "string", 0, "the full text to search in title, subtitle, introduction and contents");
+    app_add_option(gbsmgr, 'n', "limit", "int", 0, "list at most this number of resources in one page");
+    app_add_option(gbsmgr, 'c', "after", "int", 0, "list the page after the resource of this id, which is printed at the end of the previous page");
+    app_add_option(gbsmgr, 'b', "table", "string", 0, "the table to export or import, book, format, language, publisher or genre");
+    app_add_option(gbsmgr, 'g', "pages", "int", 0, "the number of pages to copy or free in one step of backup or vacuum");
+    app_add_option(gbsmgr, 'y', "seconds", "int", 0, "stop the vacuum after this number of seconds, 0 is until done");
+    app_add_option(gbsmgr, 'h', "shardkey", "string", 0, "the key to shard the books by, md5, genre or volume, md5 by default");
+    app_add_option(gbsmgr, 'j', "shards", "int", 0, "the number of shard files, 4 by default");
+    app_add_option(gbsmgr, 'r', "rules", "string", 0, "the merge rules of columns, eg. \"*=fill,title=source,price=newer\", the rule is keep, source, fill or newer");
 
     app_add_option(gbsmgr, 'C', "create", "string", 0, "create one gbs database");
     app_add_option(gbsmgr, 'I', "insert", NULL, 0, "insert one resource into gbs database");
@@ -337,6 +621,16 @@ int main(int argc, char *argv[])
     app_add_option(gbsmgr, 'L', "list", NULL, 0, "list the resources from gbs database");
     app_add_option(gbsmgr, 'T', "test", NULL, 0, "test the resources if in the gbs database");
     app_add_option(gbsmgr, 'M', "modify", NULL, 0, "update the key value of resource in database");
+    app_add_option(gbsmgr, 'R', "reindex", NULL, 0, "rebuild the author, keyword, url indexes and the full text index");
+    app_add_option(gbsmgr, 'G', "merge", NULL, 0, "merge the input gbs database into the output gbs database");
+    app_add_option(gbsmgr, 'E', "export", NULL, 0, "export the table of gbs database to JSONL, or CSV if the output ends with .csv");
+    app_add_option(gbsmgr, 'J', "import", NULL, 0, "import the JSONL or CSV file into the table of gbs database");
+    app_add_option(gbsmgr, 'Z', "compact", NULL, 0, "convert the gbs database into the compact one with BLOB md5, day number date and compressed text");
+    app_add_option(gbsmgr, 'X', "expand", NULL, 0, "convert the compact gbs database back into the normal one");
+    app_add_option(gbsmgr, 'B', "backup", NULL, 0, "copy the gbs database into the output online, the others can still use it");
+    app_add_option(gbsmgr, 'W', "vacuum", NULL, 0, "free the unused pages of gbs database in slices and report the size");
+    app_add_option(gbsmgr, 'S', "shard", NULL, 0, "split the gbs database into the sharded output, the books are in output.shardN");
+    app_add_option(gbsmgr, 'N', "snapshot", NULL, 0, "write the binary snapshot of gbs database for fast loading");
     app_add_option(gbsmgr, 'P', "abbr", NULL, 0, "dump the whole abbreviations we know, you can write your own abbreviations in dict.txt");
 
     app_add_cmdline(gbsmgr, "create", do_create, "create one gbs database");
@@ -346,11 +640,27 @@ int main(int argc, char *argv[])
     app_add_cmdline(gbsmgr, 'D', "ix", do_delete, "delete the resource by id from gbs database");
     app_add_cmdline(gbsmgr, 'D', "if", do_delete, "delete the resource by filename from gbs database");
     app_add_cmdline(gbsmgr, 'L', "i[wmp]", do_list, "list the resource from gbs database");
+    app_add_cmdline(gbsmgr, 'L', "in[cwmp]", do_list, "list one page of the resource from gbs database by keyset");
+    app_add_cmdline(gbsmgr, 'L', "ic[nwmp]", do_list, "list the resource after the cursor from gbs database by keyset");
     app_add_cmdline(gbsmgr, 'L', "ix[wmp]", do_list, "list the resource by id from gbs database");
     app_add_cmdline(gbsmgr, 'L', "if[wmp]", do_list, "list the resource by filename from gbs database");
+    app_add_cmdline(gbsmgr, 'L', "ia[p]", do_list, "list the resource by author from gbs database");
+    app_add_cmdline(gbsmgr, 'L', "ie[p]", do_list, "list the resource by keyword from gbs database");
+    app_add_cmdline(gbsmgr, 'L', "iu[p]", do_list, "list the resource by url from gbs database");
+    app_add_cmdline(gbsmgr, 'L', "is[p]", do_list, "list the resource by full text search from gbs database");
     app_add_cmdline(gbsmgr, 'T', "i[fdl]", do_test, "test the resources if in the gbs database");
     app_add_cmdline(gbsmgr, 'T', "[fdl]", do_test, "test the uniform filenames of resources");
     app_add_cmdline(gbsmgr, 'M', "ixkv", do_modify, "modify the resource by id with key to value");
+    app_add_cmdline(gbsmgr, 'R', "i", do_reindex, "rebuild the indexes of gbs database");
+    app_add_cmdline(gbsmgr, 'G', "io[r]", do_merge, "merge the input gbs database into the output by md5");
+    app_add_cmdline(gbsmgr, 'E', "io[b]", do_export, "export the table of gbs database, - is the stdout");
+    app_add_cmdline(gbsmgr, 'J', "if[b]", do_import, "import the file into the table of gbs database, - is the stdin");
+    app_add_cmdline(gbsmgr, 'Z', "io", do_compact, "convert the input gbs database into the compact output");
+    app_add_cmdline(gbsmgr, 'X', "io", do_expand, "convert the compact input gbs database into the normal output");
+    app_add_cmdline(gbsmgr, 'B', "io[g]", do_backup, "backup the input gbs database into the output in batches of pages");
+    app_add_cmdline(gbsmgr, 'W', "i[gy]", do_vacuum, "vacuum the gbs database incrementally in the time limit");
+    app_add_cmdline(gbsmgr, 'S', "io[hj]", do_shard, "split the input gbs database into the shards of output by key");
+    app_add_cmdline(gbsmgr, 'N', "i", do_snapshot, "write the snapshot of gbs database");
     app_add_cmdline(gbsmgr, 'P', NULL, do_dump_abbr, "dump the whole abbreviations we know");
 
     ret = app_run(gbsmgr, argc, argv);
@@ -0,0 +1,357 @@
+/*
+ * Aho-Corasick matcher of many literal keywords.
+ *
+ * ac_compile builds the trie of the keywords and turns it into a DFA, every
+ * state has a dense row of the next states over the byte classes. The bytes
+ * never seen in any keyword share class 0, which always goes back to the
+ * root, and the upper case letters share the class of the lower case ones
+ * when AC_IGNORECASE. The output of a state is the list of keywords ending
+ * there, and the dict link is the nearest state on its failure chain which
+ * has output, so all the hits are found in one pass, O(len + hits).
+ */
+
+#include <ctype.h>
+
+#include "libac.h"
+
+/* the regex meta chars except '|' which separates the keywords */
+#define AC_METACHARS    "\\^$.[]()?*+{}"
+
+typedef struct ac_word_st {
+    int pid;
+    int len;
+    int next;           /* the next word ending at the same state, -1 at last */
+    uint8_t *text;      /* freed by ac_compile */
+} ac_word_t;
+
+struct ac_st {
+    int flags;
+    int compiled;
+    int nword;
+    int size;           /* the words allocated */
+    int maxlen;
+    int nclass;
+    int nstate;
+    uint8_t classes[256];
+    ac_word_t *words;
+    int32_t *next;      /* nstate rows of nclass */
+    int32_t *output;    /* the first word ending at the state, -1 if none */
+    int32_t *dict;      /* the nearest suffix state with output, -1 if none */
+};
+
+static inline uint8_t ac_fold(ac_t *ac, uint8_t c)
+{
+    if ((ac->flags & AC_IGNORECASE) && c < 0x80 && isupper(c))
+        return tolower(c);
+    return c;
+}
+
+ac_t *ac_create(int flags)
+{
+    ac_t *ac;
+
+    ac = malloc(sizeof(ac_t));
+    if (ac == NULL)
+        return NULL;
+
+    memset(ac, 0, sizeof(ac_t));
+    ac->flags = flags;
+    return ac;
+}
+
+void ac_destroy(ac_t *ac)
+{
+    int i;
+
+    if (ac) {
+        for (i = 0; i < ac->nword; i++) {
+            free(ac->words[i].text);
+        }
+        free(ac->words);
+        free(ac->next);
+        free(ac->output);
+        free(ac->dict);
+        free(ac);
+    }
+}
+
+/**
+ * if the regex is a plain alternation of literals, which can be added by
+ * ac_add_alternation as it is.
+ */
+int ac_literal(char *regex)
+{
+    if (regex == NULL)
+        return 0;
+
+    for (; *regex; regex++) {
+        if (strchr(AC_METACHARS, *regex))
+            return 0;
+    }
+
+    return 1;
+}
+
+int ac_add(ac_t *ac, char *word, int len, int pid)
+{
+    int i;
+    ac_word_t *words;
+
+    if (ac == NULL || ac->compiled || word == NULL)
+        return -1;
+
+    /* the empty keyword matches nothing here */
+    if (len <= 0)
+        return 0;
+
+    if (ac->nword == ac->size) {
+        words = realloc(ac->words, (ac->size * 2 + 16) * sizeof(ac_word_t));
+        if (words == NULL)
+            return -1;
+        ac->words = words;
+        ac->size = ac->size * 2 + 16;
+    }
+
+    words = ac->words + ac->nword;
+    words->text = malloc(len);
+    if (words->text == NULL)
+        return -1;
+
+    for (i = 0; i < len; i++) {
+        words->text[i] = ac_fold(ac, word[i]);
+    }
+    words->pid = pid;
+    words->len = len;
+    words->next = -1;
+    ac->nword++;
+    if (len > ac->maxlen)
+        ac->maxlen = len;
+
+    return 1;
+}
+
+/**
+ * add the keywords of list separated by '|' with the same pid, return the
+ * number of keywords added.
+ */
+int ac_add_alternation(ac_t *ac, char *list, int pid)
+{
+    int n = 0;
+    char *p, *q;
+
+    if (list == NULL)
+        return -1;
+
+    for (p = list; ; p = q + 1) {
+        q = strchr(p, '|');
+        if (q == NULL)
+            q = p + strlen(p);
+
+        if (q > p) {
+            if (ac_add(ac, p, q - p, pid) < 0)
+                return -1;
+            n++;
+        }
+
+        if (*q == '\0')
+            break;
+    }
+
+    return n;
+}
+
+static void ac_classes(ac_t *ac)
+{
+    int i, j;
+    uint8_t used[256] = {0, };
+
+    for (i = 0; i < ac->nword; i++) {
+        for (j = 0; j < ac->words[i].len; j++) {
+            used[ac->words[i].text[j]] = 1;
+        }
+    }
+
+    ac->nclass = 1;
+    memset(ac->classes, 0, sizeof(ac->classes));
+    for (i = 0; i < 256; i++) {
+        if (used[i] && ac->classes[i] == 0) {
+            ac->classes[i] = ac->nclass++;
+            if ((ac->flags & AC_IGNORECASE) && i < 0x80 && islower(i))
+                ac->classes[toupper(i)] = ac->classes[i];
+        }
+    }
+}
+
+int ac_compile(ac_t *ac)
+{
+    int i, j, c;
+    int s, t, f;
+    int nc;
+    int head, tail;
+    int maxstate = 1;
+    int32_t *fail = NULL;
+    int32_t *queue = NULL;
+    int32_t *next;
+
+    if (ac == NULL || ac->compiled)
+        return -1;
+
+    ac_classes(ac);
+    nc = ac->nclass;
+    for (i = 0; i < ac->nword; i++) {
+        maxstate += ac->words[i].len;
+    }
+
+    /* 0 is the root, which is never a child, so it means no child in the trie */
+    ac->next = calloc((size_t)maxstate * nc, sizeof(int32_t));
+    ac->output = malloc(maxstate * sizeof(int32_t));
+    ac->dict = malloc(maxstate * sizeof(int32_t));
+    fail = malloc(maxstate * sizeof(int32_t));
+    queue = malloc(maxstate * sizeof(int32_t));
+    if (!ac->next || !ac->output || !ac->dict || !fail || !queue)
+        goto errout;
+
+    for (i = 0; i < maxstate; i++) {
+        ac->output[i] = -1;
+        ac->dict[i] = -1;
+    }
+
+    ac->nstate = 1;
+    for (i = 0; i < ac->nword; i++) {
+        s = 0;
+        for (j = 0; j < ac->words[i].len; j++) {
+            c = ac->classes[ac->words[i].text[j]];
+            if (ac->next[s * nc + c] == 0)
+                ac->next[s * nc + c] = ac->nstate++;
+            s = ac->next[s * nc + c];
+        }
+        ac->words[i].next = ac->output[s];
+        ac->output[s] = i;
+    }
+
+    /* in breadth first order, the row of the failure state is complete already */
+    head = tail = 0;
+    for (c = 1; c < nc; c++) {
+        t = ac->next[c];
+        if (t) {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+        for (c = 0; c < nc; c++) {
+            t = ac->next[s * nc + c];
+            f = ac->next[fail[s] * nc + c];
+            if (t) {
+                fail[t] = f;
+                ac->dict[t] = ac->output[f] >= 0 ? f : ac->dict[f];
+                queue[tail++] = t;
+            } else {
+                ac->next[s * nc + c] = f;
+            }
+        }
+    }
+
+    next = realloc(ac->next, (size_t)ac->nstate * nc * sizeof(int32_t));
+    if (next)
+        ac->next = next;
+
+    for (i = 0; i < ac->nword; i++) {
+        free(ac->words[i].text);
+        ac->words[i].text = NULL;
+    }
+
+    free(fail);
+    free(queue);
+    ac->compiled = 1;
+    return 0;
+
+errout:
+    free(fail);
+    free(queue);
+    free(ac->next);
+    free(ac->output);
+    free(ac->dict);
+    ac->next = ac->output = ac->dict = NULL;
+    return -1;
+}
+
+/**
+ * call hit for every keyword found in text, the overlapped ones included,
+ * return the number of hits.
+ */
+int ac_search(ac_t *ac, uint8_t *text, int len, ac_hit_t hit, void *data)
+{
+    int i, w, t;
+    int s = 0;
+    int n = 0;
+    int nc;
+
+    if (ac == NULL || !ac->compiled || text == NULL)
+        return -1;
+
+    nc = ac->nclass;
+    for (i = 0; i < len; i++) {
+        s = ac->next[s * nc + ac->classes[text[i]]];
+        for (t = ac->output[s] >= 0 ? s : ac->dict[s]; t >= 0; t = ac->dict[t]) {
+            for (w = ac->output[t]; w >= 0; w = ac->words[w].next) {
+                n++;
+                if (hit && hit(ac->words[w].pid, i + 1 - ac->words[w].len, i + 1, data) < 0)
+                    return n;
+            }
+        }
+    }
+
+    return n;
+}
+
+/**
+ * the leftmost hit, the longer one and then the smaller pid win the ties,
+ * return the pid or -1 if nothing found.
+ */
+int ac_match(ac_t *ac, uint8_t *text, int len, int *start, int *end)
+{
+    int i, w, t;
+    int s = 0;
+    int nc;
+    int from;
+    int best_pid = -1, best_start = 0, best_end = 0;
+
+    if (ac == NULL || !ac->compiled || text == NULL)
+        return -1;
+
+    nc = ac->nclass;
+    for (i = 0; i < len; i++) {
+        /* the hits found later can't start before best_start */
+        if (best_pid >= 0 && i + 1 - ac->maxlen > best_start)
+            break;
+
+        s = ac->next[s * nc + ac->classes[text[i]]];
+        for (t = ac->output[s] >= 0 ? s : ac->dict[s]; t >= 0; t = ac->dict[t]) {
+            for (w = ac->output[t]; w >= 0; w = ac->words[w].next) {
+                from = i + 1 - ac->words[w].len;
+                if (best_pid < 0 || from < best_start
+                        || (from == best_start && (i + 1 > best_end
+                                || (i + 1 == best_end && ac->words[w].pid < best_pid)))) {
+                    best_pid = ac->words[w].pid;
+                    best_start = from;
+                    best_end = i + 1;
+                }
+            }
+        }
+    }
+
+    if (best_pid >= 0) {
+        *start = best_start;
+        *end = best_end;
+    }
+
+    return best_pid;
+}
+
+int ac_nstate(ac_t *ac)
+{
+    return ac ? ac->nstate : 0;
+}
@@ -0,0 +1,26 @@
+#ifndef _LIBAC_H_
+#define _LIBAC_H_ 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define AC_IGNORECASE   0x00000001 /* fold ASCII letters, same as REF_IGNORECASE */
+
+typedef struct ac_st ac_t;
+
+/* called for every keyword hit, return < 0 to stop the search */
+typedef int (*ac_hit_t)(int pid, int start, int end, void *data);
+
+extern ac_t *ac_create(int flags);
+extern void ac_destroy(ac_t *ac);
+extern int ac_literal(char *regex);
+extern int ac_add(ac_t *ac, char *word, int len, int pid);
+extern int ac_add_alternation(ac_t *ac, char *list, int pid);
+extern int ac_compile(ac_t *ac);
+extern int ac_search(ac_t *ac, uint8_t *text, int len, ac_hit_t hit, void *data);
+extern int ac_match(ac_t *ac, uint8_t *text, int len, int *start, int *end);
+extern int ac_nstate(ac_t *ac);
+
+#endif
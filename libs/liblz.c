@@ -0,0 +1,198 @@
+/*
+ * A small LZ77 codec in the style of LZ4 block format.
+ *
+ * the compressed data is a sequence of:
+ *
+ *   token, [literal length bytes], literals, offset, [match length bytes]
+ *
+ * the high 4 bits of token are the literal length and the low 4 bits are
+ * the match length minus LZ_MIN_MATCH, 15 means more length bytes follow,
+ * which are added up until one is not 255. The offset is 2 bytes in little
+ * endian. The last sequence has only the literals.
+ */
+
+#include "liblz.h"
+
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   65535
+#define LZ_HASH_BITS    12
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *lz_put_length(uint8_t *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/**
+ * compress len bytes of src into dst, the cap of dst should be at least
+ * LZ_BOUND(len). return the compressed size, or -1 if dst is too small.
+ */
+int lz_compress(const void *src, int len, void *dst, int cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = ip + len;
+    const uint8_t *mflimit = end - LZ_MIN_MATCH;
+    const uint8_t *ref;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+    uint8_t *token;
+    int table[1 << LZ_HASH_BITS];
+    int lit;
+    int mlen;
+    uint32_t h;
+
+    memset(table, 0xff, sizeof(table));
+
+    while (ip < mflimit) {
+        h = lz_hash(lz_read32(ip));
+        ref = (const uint8_t *)src + table[h];
+        table[h] = ip - (const uint8_t *)src;
+        if (ref < (const uint8_t *)src || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != lz_read32(ip)) {
+            ip++;
+            continue;
+        }
+
+        mlen = LZ_MIN_MATCH;
+        while (ip + mlen < end && ref[mlen] == ip[mlen]) {
+            mlen++;
+        }
+
+        lit = ip - anchor;
+        if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend) {
+            return -1;
+        }
+
+        token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4;
+        if (lit >= 15) {
+            op = lz_put_length(op, lit - 15);
+        }
+        memcpy(op, anchor, lit);
+        op += lit;
+
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+
+        *token |= (mlen - LZ_MIN_MATCH >= 15) ? 15 : mlen - LZ_MIN_MATCH;
+        if (mlen - LZ_MIN_MATCH >= 15) {
+            op = lz_put_length(op, mlen - LZ_MIN_MATCH - 15);
+        }
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    lit = end - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > oend) {
+        return -1;
+    }
+
+    token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) {
+        op = lz_put_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - (uint8_t *)dst;
+}
+
+/**
+ * decompress len bytes of src into dst, every read and write is checked,
+ * so the corrupted data can't overrun the buffers. the lengths are checked
+ * while they're summed, so a long run of 255 can't overflow them.
+ * return the decompressed size, or -1 if the data is invalid.
+ */
+int lz_decompress(const void *src, int len, void *dst, int cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+    const uint8_t *ref;
+    int lit;
+    int mlen;
+    int offset;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                lit += *ip;
+                if (lit > oend - op) {
+                    return -1;
+                }
+            } while (*ip++ == 255);
+        }
+
+        if (lit > iend - ip || lit > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        ref = op - offset;
+        if (offset == 0 || ref < (uint8_t *)dst) {
+            return -1;
+        }
+
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                mlen += *ip;
+                if (mlen > oend - op) {
+                    return -1;
+                }
+            } while (*ip++ == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+
+        if (mlen > oend - op) {
+            return -1;
+        }
+
+        /* the match may overlap the output, copy byte by byte */
+        while (mlen--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
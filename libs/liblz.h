@@ -0,0 +1,15 @@
+#ifndef _LIBLZ_H_
+#define _LIBLZ_H_ 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* the max size of compressed data of len bytes */
+#define LZ_BOUND(len)   ((len) + (len) / 255 + 16)
+
+extern int lz_compress(const void *src, int len, void *dst, int cap);
+extern int lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif
@@ -13,9 +13,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "liblist.h"
 #include "libmdfa.h"
+#include "libstream.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define DFA_SKIP_X86     1
+#include <immintrin.h>
+#endif
 
 #define metachar_inside   "\\^-[]"
 #define metachar_outside  "\\^$.[|()?*+{"
@@ -369,6 +376,210 @@ static inline int re_append_nocasechar(dlist_t *relist, uint8_t c)
     return -1;
 }
 
+/**
+ * the simple case folding of CaseFolding.txt in the blocks the titles run
+ * into, every step-th code point of lo to hi folds to cp + delta. the ASCII
+ * letters are left to RET_OPERAND_NOCASECHAR.
+ */
+static const struct {
+    uint32_t lo;
+    uint32_t hi;
+    int32_t delta;
+    uint32_t step;
+} re_folds[] = {
+    { 0x00C0, 0x00D6, 32, 1 },      /* latin-1 */
+    { 0x00D8, 0x00DE, 32, 1 },
+    { 0x0100, 0x012E, 1, 2 },       /* latin extended-a */
+    { 0x0132, 0x0136, 1, 2 },
+    { 0x0139, 0x0147, 1, 2 },
+    { 0x014A, 0x0176, 1, 2 },
+    { 0x0178, 0x0178, -121, 1 },
+    { 0x0179, 0x017D, 1, 2 },
+    { 0x0386, 0x0386, 38, 1 },      /* greek */
+    { 0x0388, 0x038A, 37, 1 },
+    { 0x038C, 0x038C, 64, 1 },
+    { 0x038E, 0x038F, 63, 1 },
+    { 0x0391, 0x03A1, 32, 1 },
+    { 0x03A3, 0x03AB, 32, 1 },
+    { 0x03C2, 0x03C2, 1, 1 },
+    { 0x03D8, 0x03EE, 1, 2 },
+    { 0x0400, 0x040F, 80, 1 },      /* cyrillic */
+    { 0x0410, 0x042F, 32, 1 },
+    { 0x0460, 0x0480, 1, 2 },
+    { 0x048A, 0x04BE, 1, 2 },
+    { 0x04C0, 0x04C0, 15, 1 },
+    { 0x04C1, 0x04CD, 1, 2 },
+    { 0x04D0, 0x052E, 1, 2 },
+    { 0x0531, 0x0556, 48, 1 },      /* armenian */
+    { 0x1E00, 0x1E94, 1, 2 },       /* latin extended additional */
+    { 0x1E9E, 0x1E9E, -7615, 1 },
+    { 0x1EA0, 0x1EFE, 1, 2 },
+    { 0x2160, 0x216F, 16, 1 },      /* roman numerals */
+    { 0x24B6, 0x24CF, 26, 1 },      /* circled letters */
+    { 0xFF21, 0xFF3A, 32, 1 },      /* full-width */
+};
+
+#define RE_FOLD_MAX     4           /** the most code points folding together */
+
+static uint32_t re_fold(uint32_t cp)
+{
+    int i;
+
+    for (i = 0; i < sizeof(re_folds) / sizeof(re_folds[0]); i++) {
+        if (cp >= re_folds[i].lo && cp <= re_folds[i].hi
+                && (cp - re_folds[i].lo) % re_folds[i].step == 0)
+            return cp + re_folds[i].delta;
+    }
+
+    return cp;
+}
+
+/**
+ * the code points folding to the same one as cp, cp itself first, return
+ * the number of them.
+ */
+static int re_fold_set(uint32_t cp, uint32_t *set)
+{
+    int i, n = 1;
+    uint32_t f, u;
+
+    set[0] = cp;
+    f = re_fold(cp);
+    if (f != cp)
+        set[n++] = f;
+
+    for (i = 0; i < sizeof(re_folds) / sizeof(re_folds[0]) && n < RE_FOLD_MAX; i++) {
+        u = f - re_folds[i].delta;
+        if (u != cp && u >= re_folds[i].lo && u <= re_folds[i].hi
+                && (u - re_folds[i].lo) % re_folds[i].step == 0)
+            set[n++] = u;
+    }
+
+    return n;
+}
+
+/* the length of the utf-8 char at p decoded into cp, 0 if it's invalid */
+static int re_utf8_decode(uint8_t *p, uint32_t *cp)
+{
+    int i, n;
+    uint32_t c;
+
+    if (p[0] < 0xC2) {
+        return 0;
+    } else if (p[0] < 0xE0) {
+        n = 2;
+        c = p[0] & 0x1F;
+    } else if (p[0] < 0xF0) {
+        n = 3;
+        c = p[0] & 0x0F;
+    } else if (p[0] < 0xF5) {
+        n = 4;
+        c = p[0] & 0x07;
+    } else {
+        return 0;
+    }
+
+    for (i = 1; i < n; i++) {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+
+    /* the overlong forms and the surrogates */
+    if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF))
+            || (c >= 0xD800 && c <= 0xDFFF))
+        return 0;
+
+    *cp = c;
+    return n;
+}
+
+static int re_utf8_encode(uint32_t cp, uint8_t *p)
+{
+    if (cp < 0x80) {
+        p[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        p[0] = 0xC0 | (cp >> 6);
+        p[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if (cp < 0x10000) {
+        p[0] = 0xE0 | (cp >> 12);
+        p[1] = 0x80 | ((cp >> 6) & 0x3F);
+        p[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    } else {
+        p[0] = 0xF0 | (cp >> 18);
+        p[1] = 0x80 | ((cp >> 12) & 0x3F);
+        p[2] = 0x80 | ((cp >> 6) & 0x3F);
+        p[3] = 0x80 | (cp & 0x3F);
+        return 4;
+    }
+}
+
+/**
+ * the utf-8 char at p with its other cases, as the group of the byte
+ * sequences of them, so the dfa folds the case by its transitions. return
+ * the bytes of p taken, 0 if it has no other case.
+ */
+static int re_append_nocaseutf8(dlist_t *relist, uint8_t *p)
+{
+    int i, j, m, n, len, ret;
+    uint32_t cp;
+    uint32_t set[RE_FOLD_MAX];
+    uint8_t buf[4];
+
+    len = re_utf8_decode(p, &cp);
+    if (len == 0)
+        return 0;
+
+    n = re_fold_set(cp, set);
+    if (n == 1)
+        return 0;
+
+    ret = re_append_left_parenthesis(relist);
+    for (i = 0; i < n && ret >= 0; i++) {
+        if (i > 0)
+            ret = re_append_operator(relist, REO_ALT);
+        m = re_utf8_encode(set[i], buf);
+        for (j = 0; j < m && ret >= 0; j++) {
+            ret = re_append_char(relist, buf[j]);
+        }
+    }
+    if (ret >= 0)
+        ret = re_append_right_parenthesis(relist);
+
+    return ret < 0 ? ret : len;
+}
+
+/**
+ * if the utf-8 text has a non-ASCII char with other cases, which is folded
+ * by REF_IGNORECASE here but not by the matchers folding ASCII only.
+ */
+int dfa_utf8_cased(char *text)
+{
+    int len;
+    uint32_t cp;
+    uint32_t set[RE_FOLD_MAX];
+    uint8_t *p = (uint8_t *)text;
+
+    if (p == NULL)
+        return 0;
+
+    while (*p) {
+        len = *p >= 0xC0 ? re_utf8_decode(p, &cp) : 0;
+        if (len == 0) {
+            p++;
+            continue;
+        }
+        if (re_fold_set(cp, set) > 1)
+            return 1;
+        p += len;
+    }
+
+    return 0;
+}
+
 static inline int re_append_incasechar(dlist_t *relist, uint8_t c, int nocase)
 {
     if (nocase) {
@@ -394,7 +605,6 @@ enum {
 
 typedef struct nfa_state_st {
     uint8_t type:4;
-    uint8_t marked:1;
     uint8_t bol:1;
     uint8_t eol:1;
     uint8_t ml:1;
@@ -402,6 +612,7 @@ typedef struct nfa_state_st {
     uint8_t c1;
     uint8_t c2;
     uint32_t pid; /** the pattern id, for multi-pattern */
+    uint32_t id; /** the dense number, 0 ... nstate - 1 */
     struct nfa_state_st *out;
     struct nfa_state_st *out1;
 } nfa_state_t;
@@ -430,16 +641,386 @@ typedef struct dfa_state_st {
     uint32_t eol:1;
     uint32_t ml:1;
     uint32_t accept:1;
-    slist_t *nfa_set;
+    uint32_t id;    /** the number in the frozen table */
+    uint64_t hash;  /** the hash of nfa_set */
+    uint32_t nset;
+    uint32_t *nfa_set;  /** the ids of the nfa states, sorted */
     struct dfa_state_st *next[N_CHARSET];
 } dfa_state_t;
 
+/**
+ * the frozen dfa, state 0 is the dead state and state 1 is the start, the
+ * next state of s on byte c is table[s * nclass + classes[c]], the bytes
+ * which lead every state to the same next state share one class.
+ */
+#define DFA_DEAD        0
+#define DFA_START       1
+#define DFA_UNKNOWN     0xffffffff  /** not built yet by the lazy dfa */
+
+#define DFA_ACCEPT      0x01
+#define DFA_BOL         0x02
+#define DFA_EOL         0x04
+#define DFA_ML          0x08
+
+/* how dfa_match looks for the next byte which may start a match */
+#define DFA_SKIP_NONE    0  /* every byte may, don't skip */
+#define DFA_SKIP_SCALAR  1
+#define DFA_SKIP_MEMCHR  2  /* only one byte */
+#define DFA_SKIP_SSE2    3  /* at most 3 bytes, compared 16 at a time */
+#define DFA_SKIP_SSSE3   4  /* the prefix masks, 16 at a time */
+#define DFA_SKIP_AVX2    5  /* the prefix masks, 32 at a time */
+
+#define DFA_SKIP_PAIRS   64 /* the prefix masks are good for so many 2 byte prefixes */
+#define DFA_SKIP_BUCKETS 8
+
+typedef struct dfa_skip_st {
+    uint32_t kind;
+    uint32_t nbyte;
+    uint8_t bytes[4];
+    uint8_t lo[2][16];  /** the buckets of the low nibble of the 1st and 2nd byte */
+    uint8_t hi[2][16];  /** the buckets of the high nibble of the 1st and 2nd byte */
+    uint8_t first[N_CHARSET];   /** the byte leaves the start state */
+} dfa_skip_t;
+
 struct dfa_st {
     int flags;
-    filo_t states;
+    filo_t states;      /** the states during the construction */
     dfa_state_t *start;
+
+    uint32_t nstate;
+    uint32_t nclass;
+    uint32_t wide;      /** the table is uint32_t, or uint16_t */
+    uint8_t classes[N_CHARSET];
+    void *table;
+    uint8_t *attrs;     /** DFA_ACCEPT, DFA_BOL, DFA_EOL and DFA_ML */
+    uint32_t *pids;
+    uint32_t single;    /** the start is the only state */
+    struct dfa_lazy_st *lazy;   /** the states are built by dfa_match, table is NULL */
+    dfa_skip_t skip;    /** the prefilter of dfa_match */
+    struct dfa_st *rev; /** the lazy reverse, finds the leftmost start in one pass */
 };
 
+static void dfa_lazy_destroy(struct dfa_lazy_st *lazy);
+static uint32_t dfa_lazy_next(struct dfa_st *dfa, uint32_t s, uint8_t c);
+
+static inline uint32_t dfa_next_class(struct dfa_st *dfa, uint32_t s, uint32_t k)
+{
+    uint32_t i = s * dfa->nclass + k;
+
+    return dfa->wide ? ((uint32_t *)dfa->table)[i] : ((uint16_t *)dfa->table)[i];
+}
+
+static inline uint32_t dfa_next(struct dfa_st *dfa, uint32_t s, uint8_t c)
+{
+    return dfa_next_class(dfa, s, dfa->classes[c]);
+}
+
+static inline uint32_t dfa_step(struct dfa_st *dfa, uint32_t s, uint8_t c)
+{
+    return dfa->lazy ? dfa_lazy_next(dfa, s, c) : dfa_next(dfa, s, c);
+}
+
+static int dfa_skip_scalar(dfa_skip_t *skip, uint8_t *text, int pos, int len)
+{
+    while (pos < len && !skip->first[text[pos]])
+        pos++;
+
+    return pos;
+}
+
+#ifdef DFA_SKIP_X86
+__attribute__((target("sse2")))
+static int dfa_skip_sse2(dfa_skip_t *skip, uint8_t *text, int pos, int len)
+{
+    uint32_t mask;
+    __m128i v, m;
+    __m128i b0 = _mm_set1_epi8(skip->bytes[0]);
+    __m128i b1 = _mm_set1_epi8(skip->bytes[1]);
+    __m128i b2 = _mm_set1_epi8(skip->bytes[2]);
+
+    for (; pos + 16 <= len; pos += 16) {
+        v = _mm_loadu_si128((__m128i *)(text + pos));
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b0), _mm_cmpeq_epi8(v, b1)),
+                _mm_cmpeq_epi8(v, b2));
+        mask = _mm_movemask_epi8(m);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+
+    return dfa_skip_scalar(skip, text, pos, len);
+}
+
+/**
+ * the pos is a candidate if some bucket takes the nibbles of both text[pos]
+ * and text[pos + 1], the masks may take more than the 2 byte prefixes of the
+ * dfa, so check the first byte of the candidates again.
+ */
+__attribute__((target("ssse3")))
+static int dfa_skip_ssse3(dfa_skip_t *skip, uint8_t *text, int pos, int len)
+{
+    int i;
+    uint32_t mask;
+    __m128i v0, v1, m;
+    __m128i lo0 = _mm_loadu_si128((__m128i *)skip->lo[0]);
+    __m128i hi0 = _mm_loadu_si128((__m128i *)skip->hi[0]);
+    __m128i lo1 = _mm_loadu_si128((__m128i *)skip->lo[1]);
+    __m128i hi1 = _mm_loadu_si128((__m128i *)skip->hi[1]);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i zero = _mm_setzero_si128();
+
+    for (; pos + 17 <= len; pos += 16) {
+        v0 = _mm_loadu_si128((__m128i *)(text + pos));
+        v1 = _mm_loadu_si128((__m128i *)(text + pos + 1));
+        m = _mm_and_si128(_mm_shuffle_epi8(lo0, _mm_and_si128(v0, nibble)),
+                _mm_shuffle_epi8(hi0, _mm_and_si128(_mm_srli_epi16(v0, 4), nibble)));
+        m = _mm_and_si128(m, _mm_shuffle_epi8(lo1, _mm_and_si128(v1, nibble)));
+        m = _mm_and_si128(m, _mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(v1, 4), nibble)));
+        mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) & 0xffff;
+        for (; mask; mask &= mask - 1) {
+            i = pos + __builtin_ctz(mask);
+            if (skip->first[text[i]])
+                return i;
+        }
+    }
+
+    return dfa_skip_scalar(skip, text, pos, len);
+}
+
+__attribute__((target("avx2")))
+static int dfa_skip_avx2(dfa_skip_t *skip, uint8_t *text, int pos, int len)
+{
+    int i;
+    uint32_t mask;
+    __m256i v0, v1, m;
+    __m256i lo0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)skip->lo[0]));
+    __m256i hi0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)skip->hi[0]));
+    __m256i lo1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)skip->lo[1]));
+    __m256i hi1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)skip->hi[1]));
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i zero = _mm256_setzero_si256();
+
+    for (; pos + 33 <= len; pos += 32) {
+        v0 = _mm256_loadu_si256((__m256i *)(text + pos));
+        v1 = _mm256_loadu_si256((__m256i *)(text + pos + 1));
+        m = _mm256_and_si256(_mm256_shuffle_epi8(lo0, _mm256_and_si256(v0, nibble)),
+                _mm256_shuffle_epi8(hi0, _mm256_and_si256(_mm256_srli_epi16(v0, 4), nibble)));
+        m = _mm256_and_si256(m, _mm256_shuffle_epi8(lo1, _mm256_and_si256(v1, nibble)));
+        m = _mm256_and_si256(m, _mm256_shuffle_epi8(hi1, _mm256_and_si256(_mm256_srli_epi16(v1, 4), nibble)));
+        mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(m, zero));
+        for (; mask; mask &= mask - 1) {
+            i = pos + __builtin_ctz(mask);
+            if (skip->first[text[i]])
+                return i;
+        }
+    }
+
+    return dfa_skip_ssse3(skip, text, pos, len);
+}
+#endif
+
+/**
+ * the best kind of the cpu, DFA_SKIP_SCALAR, _SSE2, _SSSE3 or _AVX2.
+ */
+static int dfa_skip_cpu(void)
+{
+    static int cpu = -1;
+
+    if (cpu < 0) {
+#ifdef DFA_SKIP_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            cpu = DFA_SKIP_AVX2;
+        else if (__builtin_cpu_supports("ssse3"))
+            cpu = DFA_SKIP_SSSE3;
+        else if (__builtin_cpu_supports("sse2"))
+            cpu = DFA_SKIP_SSE2;
+        else
+            cpu = DFA_SKIP_SCALAR;
+#else
+        cpu = DFA_SKIP_SCALAR;
+#endif
+    }
+
+    return cpu;
+}
+
+/* the nibbles of a bucket, the low and high of the 1st byte, then the 2nd */
+typedef struct dfa_skip_bucket_st {
+    uint16_t nibbles[4];
+} dfa_skip_bucket_t;
+
+/* about how many of the 64k 2 byte prefixes the bucket takes */
+static int dfa_skip_cost(dfa_skip_bucket_t *b)
+{
+    return __builtin_popcount(b->nibbles[0]) * __builtin_popcount(b->nibbles[1])
+        * __builtin_popcount(b->nibbles[2]) * __builtin_popcount(b->nibbles[3]);
+}
+
+/**
+ * every first byte starts a bucket with the bytes following it, and the two
+ * buckets which grow the least are merged until DFA_SKIP_BUCKETS are left.
+ */
+static void dfa_skip_masks(dfa_skip_t *skip, dfa_skip_bucket_t *buckets, int n)
+{
+    int i, j, k, m;
+    int cost, best, bi, bj;
+    dfa_skip_bucket_t u;
+
+    while (n > DFA_SKIP_BUCKETS) {
+        best = 1 << 30;
+        bi = bj = 0;
+        for (i = 0; i < n; i++) {
+            for (j = i + 1; j < n; j++) {
+                for (k = 0; k < 4; k++) {
+                    u.nibbles[k] = buckets[i].nibbles[k] | buckets[j].nibbles[k];
+                }
+                cost = dfa_skip_cost(&u) - dfa_skip_cost(&buckets[i]) - dfa_skip_cost(&buckets[j]);
+                if (cost < best) {
+                    best = cost;
+                    bi = i;
+                    bj = j;
+                }
+            }
+        }
+
+        for (k = 0; k < 4; k++) {
+            buckets[bi].nibbles[k] |= buckets[bj].nibbles[k];
+        }
+        buckets[bj] = buckets[--n];
+    }
+
+    for (i = 0; i < n; i++) {
+        for (m = 0; m < 16; m++) {
+            if (buckets[i].nibbles[0] & (1 << m))
+                skip->lo[0][m] |= 1 << i;
+            if (buckets[i].nibbles[1] & (1 << m))
+                skip->hi[0][m] |= 1 << i;
+            if (buckets[i].nibbles[2] & (1 << m))
+                skip->lo[1][m] |= 1 << i;
+            if (buckets[i].nibbles[3] & (1 << m))
+                skip->hi[1][m] |= 1 << i;
+        }
+    }
+}
+
+/**
+ * the bytes which don't leave the start state can't start a match, so
+ * dfa_match jumps over them when it starts again. if there are only a few
+ * 2 byte prefixes, the second byte is checked too, by the masks.
+ */
+static void dfa_skip_init(struct dfa_st *dfa)
+{
+    int c, d, cpu;
+    int n = 0;
+    uint32_t s;
+    uint32_t npair = 0;
+    dfa_skip_t *skip = &dfa->skip;
+    dfa_skip_bucket_t buckets[N_CHARSET];
+
+    memset(skip, 0, sizeof(*skip));
+    if (dfa->nstate == 0)
+        return;
+
+    for (c = 0; c < N_CHARSET; c++) {
+        s = dfa_step(dfa, DFA_START, c);
+        if (s == DFA_DEAD)
+            continue;
+
+        skip->first[c] = 1;
+        if (skip->nbyte < sizeof(skip->bytes))
+            skip->bytes[skip->nbyte] = c;
+        skip->nbyte++;
+        if (npair > DFA_SKIP_PAIRS)
+            continue;
+
+        /* the lazy states may be flushed by the steps, don't look further */
+        if (dfa->lazy || (dfa->attrs[s] & DFA_ACCEPT)) {
+            npair += N_CHARSET;
+            continue;
+        }
+
+        memset(&buckets[n], 0, sizeof(buckets[n]));
+        buckets[n].nibbles[0] = 1 << (c & 15);
+        buckets[n].nibbles[1] = 1 << (c >> 4);
+        for (d = 0; d < N_CHARSET; d++) {
+            if (dfa_next(dfa, s, d) != DFA_DEAD) {
+                buckets[n].nibbles[2] |= 1 << (d & 15);
+                buckets[n].nibbles[3] |= 1 << (d >> 4);
+                npair++;
+            }
+        }
+        n++;
+    }
+
+    cpu = dfa_skip_cpu();
+    if (skip->nbyte == N_CHARSET) {
+        skip->kind = DFA_SKIP_NONE;
+    } else if (npair <= DFA_SKIP_PAIRS && cpu >= DFA_SKIP_SSSE3) {
+        dfa_skip_masks(skip, buckets, n);
+        skip->kind = cpu;
+    } else if (skip->nbyte == 1) {
+        skip->kind = DFA_SKIP_MEMCHR;
+    } else if (skip->nbyte <= 3 && cpu >= DFA_SKIP_SSE2) {
+        if (skip->nbyte == 2)
+            skip->bytes[2] = skip->bytes[1];
+        skip->kind = DFA_SKIP_SSE2;
+    } else {
+        skip->kind = DFA_SKIP_SCALAR;
+    }
+}
+
+/**
+ * the first pos from pos on whose byte leaves the start state, or len.
+ */
+static inline int dfa_skip(struct dfa_st *dfa, uint8_t *text, int pos, int len)
+{
+    uint8_t *p;
+    dfa_skip_t *skip = &dfa->skip;
+
+    if (pos >= len)
+        return len;
+
+    switch (skip->kind) {
+    case DFA_SKIP_NONE:
+        return pos;
+    case DFA_SKIP_MEMCHR:
+        p = memchr(text + pos, skip->bytes[0], len - pos);
+        return p ? p - text : len;
+#ifdef DFA_SKIP_X86
+    case DFA_SKIP_SSE2:
+        return dfa_skip_sse2(skip, text, pos, len);
+    case DFA_SKIP_SSSE3:
+        return dfa_skip_ssse3(skip, text, pos, len);
+    case DFA_SKIP_AVX2:
+        return dfa_skip_avx2(skip, text, pos, len);
+#endif
+    default:
+        return dfa_skip_scalar(skip, text, pos, len);
+    }
+}
+
+/**
+ * start again after start_pos, return the state after the first byte, or
+ * DFA_DEAD at the end of text.
+ */
+static inline uint32_t dfa_restart(struct dfa_st *dfa, uint8_t *text, int len, int *start_pos)
+{
+    int pos = *start_pos;
+    uint32_t s;
+
+    do {
+        pos = dfa_skip(dfa, text, pos + 1, len);
+        if (pos >= len) {
+            *start_pos = len;
+            return DFA_DEAD;
+        }
+        s = dfa_step(dfa, DFA_START, text[pos]);
+    } while (s == DFA_DEAD);
+
+    *start_pos = pos;
+    return s;
+}
+
 static int regex_accept_alnum(char *accept_maps, int nocase, int negate)
 {
     int i;
@@ -1891,6 +2472,16 @@ static int regex_parse(uint8_t *regex, dlist_t *relist, int *flags)
             p++;
             continue;
         } else {
+            if (nocase && *p >= 0xC0) {
+                ret = re_append_nocaseutf8(relist, p);
+                if (ret < 0)
+                    return ret;
+                if (ret > 0) {
+                    p += ret;
+                    continue;
+                }
+            }
+
             ret = re_append_incasechar(relist, *p, nocase);
             if (ret < 0)
                 return ret;
@@ -2528,7 +3119,7 @@ static nfa_state_t *nfa_state_create(uint8_t type, uint8_t c, uint8_t c1, uint8_
     s->c = c;
     s->c1 = c1;
     s->c2 = c2;
-    s->marked = 0;
+    s->id = 0;
     s->bol = 0;
     s->eol = 0;
     s->ml = 0;
@@ -2548,14 +3139,6 @@ static void nfa_state_destroy(void *ptr)
     }
 }
 
-static void nfa_state_flush(void *ptr)
-{
-    nfa_state_t *s;
-
-    s = (nfa_state_t *)ptr;
-    s->marked = 0;
-}
-
 static nfa_outlist_t *nfa_outlist_create(nfa_state_t **ps)
 {
     nfa_outlist_t *n;
@@ -2611,16 +3194,49 @@ static void nfa_fragment_destroy(void *ptr)
     }
 }
 
+/**
+ * the reachable states by id, NULL for the ids not reachable, it must be
+ * freed by the caller.
+ */
+static nfa_state_t **nfa_states_collect(struct nfa_st *nfa)
+{
+    uint32_t top = 0;
+    nfa_state_t *s;
+    nfa_state_t **stack;
+    nfa_state_t **states;
+
+    states = calloc(nfa->nstate + 1, sizeof(nfa_state_t *));
+    stack = malloc((2 * nfa->nstate + 1) * sizeof(nfa_state_t *));
+    if (states == NULL || stack == NULL) {
+        free(states);
+        free(stack);
+        return NULL;
+    }
+
+    stack[top++] = nfa->start;
+    while (top > 0) {
+        s = stack[--top];
+        if (states[s->id])
+            continue;
+
+        states[s->id] = s;
+        if (s->out)
+            stack[top++] = s->out;
+        if (s->out1)
+            stack[top++] = s->out1;
+    }
+
+    free(stack);
+    return states;
+}
+
 static void nfa_destroy(mdfa_t *prog)
 {
+    uint32_t i;
+    nfa_state_t **states;
     struct nfa_st *nfa = (struct nfa_st *)prog;
 
     if (nfa) {
-        filo_t stack;
-        fifo_t queue;
-        void *v;
-        nfa_state_t *s;
-
         if (nfa->charset
                 && nfa->charset != g_dot_charset
                 && nfa->charset != g_default_charset) {
@@ -2629,31 +3245,15 @@ static void nfa_destroy(mdfa_t *prog)
             nfa->nchar = 0;
         }
 
-        s = nfa->start;
-        if (s == NULL)
+        if (nfa->start == NULL)
             return;
 
-        filo_init(&stack);
-        fifo_init(&queue);
-
-        filo_enqueue(&stack, s);
-        while (filo_dequeue(&stack, &v)) {
-            s = (nfa_state_t *)v;
-            if (s->marked == 0) {
-                if (s->out) {
-                    filo_enqueue(&stack, s->out);
-                }
-                if (s->out1) {
-                    filo_enqueue(&stack, s->out1);
-                }
-                fifo_enqueue(&queue, s);
-                s->marked = 1;
+        states = nfa_states_collect(nfa);
+        if (states) {
+            for (i = 0; i < nfa->nstate; i++) {
+                nfa_state_destroy(states[i]);
             }
-        }
-
-        while (fifo_dequeue(&queue, &v)) {
-            s = (nfa_state_t *)v;
-            nfa_state_destroy(s);
+            free(states);
         }
 
         nfa->start = NULL;
@@ -2682,7 +3282,7 @@ static int fragment_process_literal(struct nfa_st *nfa, filo_t *frags, uint8_t c
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     l = nfa_outlist_create(&s->out);
     if (l == NULL) {
@@ -2721,7 +3321,7 @@ static int fragment_process_nocase(struct nfa_st *nfa, filo_t *frags, uint8_t c)
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     l = nfa_outlist_create(&s->out);
     if (l == NULL) {
@@ -2760,7 +3360,7 @@ static int fragment_process_dot(struct nfa_st *nfa, filo_t *frags)
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     l = nfa_outlist_create(&s->out);
     if (l == NULL) {
@@ -2799,7 +3399,7 @@ static int fragment_process_any(struct nfa_st *nfa, filo_t *frags)
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     l = nfa_outlist_create(&s->out);
     if (l == NULL) {
@@ -2838,7 +3438,7 @@ static int fragment_process_dual(struct nfa_st *nfa, filo_t *frags, uint8_t c, u
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     l = nfa_outlist_create(&s->out);
     if (l == NULL) {
@@ -2877,7 +3477,7 @@ static int fragment_process_triad(struct nfa_st *nfa, filo_t *frags, uint8_t c,
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     l = nfa_outlist_create(&s->out);
     if (l == NULL) {
@@ -2916,7 +3516,7 @@ static int fragment_process_range(struct nfa_st *nfa, filo_t *frags, uint8_t c ,
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     l = nfa_outlist_create(&s->out);
     if (l == NULL) {
@@ -2971,7 +3571,7 @@ static int fragment_process_alt(struct nfa_st *nfa, filo_t *frags)
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     f = nfa_fragment_create(s, nfa_outlist_append(f1->outlist, f2->outlist));
     if (f == NULL) {
@@ -3055,7 +3655,7 @@ static int fragment_process_star(struct nfa_st *nfa, filo_t *frags)
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     nfa_outlist_patch(f1->outlist, s);
     f = nfa_fragment_create(s, nfa_outlist_create(&s->out1));
@@ -3100,7 +3700,7 @@ static int fragment_process_plus(struct nfa_st *nfa, filo_t *frags)
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     nfa_outlist_patch(f1->outlist, s);
     f = nfa_fragment_create(f1->start, nfa_outlist_create(&s->out1));
@@ -3147,7 +3747,7 @@ static int fragment_process_quest(struct nfa_st *nfa, filo_t *frags)
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     l = nfa_outlist_create(&s->out1);
     if (l == NULL) {
@@ -3187,7 +3787,7 @@ static int fragment_process_match(struct nfa_st *nfa, filo_t *frags)
     s->bol = !!(nfa->flags & REF_MATCHBOL);
     s->ml = !!(nfa->flags & REF_MULTILINE);
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
 
     if(filo_dequeue(frags, &v)) {
         if (!filo_empty(frags)) {
@@ -3223,8 +3823,8 @@ static int postfix2nfa(int pid, dlist_t *postfix, struct nfa_st *nfa)
     filo_t frags;
     filo_init(&frags);
 
+    /* the states are numbered from nfa->nstate on */
     nfa->pid = pid;
-    nfa->nstate = 0;
     nfa->start = NULL;
 
     if (postfix->nelm == 0) {
@@ -3431,7 +4031,8 @@ static int nfa_combine(mdfa_t *prog, void *n1, void *n2)
 
     nfa->pid = 0;
     nfa->flags = nfa1->flags | nfa2->flags;
-    nfa->nstate = nfa1->nstate + nfa2->nstate;
+    /* one was compiled after the other, their ids don't overlap */
+    nfa->nstate = nfa1->nstate > nfa2->nstate ? nfa1->nstate : nfa2->nstate;
     if (nfa1->nchar == N_CHARSET
             || nfa2->nchar == N_CHARSET) {
         if (nfa1->charset != g_default_charset
@@ -3485,13 +4086,13 @@ static int nfa_combine(mdfa_t *prog, void *n1, void *n2)
         return -1;
 
     s->pid = nfa->pid;
-    nfa->nstate++;
+    s->id = nfa->nstate++;
     nfa->start = s;
 
     return 0;
 }
 
-static dfa_state_t *dfa_state_create(void)
+static dfa_state_t *dfa_state_create(uint32_t *nfa_set, uint32_t nset, uint64_t hash)
 {
     int i;
     dfa_state_t *s;
@@ -3505,12 +4106,14 @@ static dfa_state_t *dfa_state_create(void)
     s->ml = 0;
     s->pid = -1;
     s->accept = 0;
-    s->nfa_set = malloc(sizeof(slist_t));
+    s->hash = hash;
+    s->nset = nset;
+    s->nfa_set = malloc(nset * sizeof(uint32_t) + 1);
     if (s->nfa_set == NULL) {
         free(s);
         return NULL;
     }
-    filo_init(s->nfa_set);
+    memcpy(s->nfa_set, nfa_set, nset * sizeof(uint32_t));
     for (i=0; i<N_CHARSET; i++) {
         s->next[i] = NULL;
     }
@@ -3518,33 +4121,39 @@ static dfa_state_t *dfa_state_create(void)
     return s;
 }
 
-static void dfa_state_destroy(void *ptr, void (*data_fini)(void *ptr))
+static void dfa_state_destroy(dfa_state_t *s)
 {
-    dfa_state_t *s;
-
-    s = (dfa_state_t *)ptr;
     if (s) {
-        if (s->nfa_set) {
-            slist_fini(s->nfa_set, data_fini);
-            free(s->nfa_set);
-        }
+        free(s->nfa_set);
         free(s);
     }
 }
 
+static void dfa_table_free(struct dfa_st *dfa)
+{
+    free(dfa->table);
+    free(dfa->attrs);
+    free(dfa->pids);
+
+    dfa->table = NULL;
+    dfa->attrs = NULL;
+    dfa->pids = NULL;
+}
+
 void dfa_destroy(mdfa_t *prog)
 {
     struct dfa_st *dfa = (struct dfa_st *)prog;
 
     if (dfa) {
-        dfa_state_t *s;
         void *v;
 
         while (filo_dequeue(&dfa->states, &v)) {
-            s = (dfa_state_t *)v;
-            dfa_state_destroy(s, NULL);
+            dfa_state_destroy((dfa_state_t *)v);
         }
 
+        dfa_lazy_destroy(dfa->lazy);
+        dfa_destroy(dfa->rev);
+        dfa_table_free(dfa);
         free(dfa);
     }
 }
@@ -3559,128 +4168,281 @@ static void dfa_destroy_nfa(mdfa_t *prog)
 
         for (cur = dfa->states.head; cur; cur = cur->next) {
             s = (dfa_state_t *)cur->value;
-            filo_fini(s->nfa_set, NULL);
             free(s->nfa_set);
             s->nfa_set = NULL;
+            s->nset = 0;
         }
     }
 }
 
-static dfa_state_t *dfa_state_find(slist_t *nfa_set, slist_t *dfa_states, slist_t *dfa_marked_states)
+/**
+ * the dfa states by their nfa sets, in open addressing, so the subset
+ * construction finds a state in O(1) instead of comparing with all.
+ */
+typedef struct dfa_state_table_st {
+    uint32_t size;
+    uint32_t used;
+    dfa_state_t **slots;
+} dfa_state_table_t;
+
+/* the nfa set is sorted, so the same set has the same hash */
+static uint64_t nfa_set_hash(uint32_t *nfa_set, uint32_t nset)
 {
-    slist_node_t *n;
-    dfa_state_t *s;
-
-    for (n = dfa_states->head; n; n = n->next) {
-        s = (dfa_state_t *)n->value;
-        if (slist_equal(nfa_set, s->nfa_set, NULL))
-            return s;
-    }
+    uint32_t i;
+    uint64_t h = 0xcbf29ce484222325ULL;
 
-    for (n = dfa_marked_states->head; n; n = n->next) {
-        s = (dfa_state_t *)n->value;
-        if (slist_equal(nfa_set, s->nfa_set, NULL))
-            return s;
+    for (i = 0; i < nset; i++) {
+        h ^= nfa_set[i];
+        h *= 0x100000001b3ULL;
+        h ^= h >> 29;
     }
 
-    return NULL;
+    return h;
 }
 
-static int nfa_eps_closure(struct nfa_st *nfa, slist_t *set, slist_t *closure, dfa_state_t *ds)
+static int dfa_state_table_init(dfa_state_table_t *table, uint32_t size)
 {
-    void *v;
-    nfa_state_t *s;
-
-    while (slist_del(set, &v)) {
-        s = (nfa_state_t *)v;
-        if (s->marked == 0) {
-            if (s->type == NFA_STATE_TYPE_SPLIT) {
-                if (s->out) {
-                    slist_add(set, s->out);
-                }
-                if (s->out1) {
-                    slist_add(set, s->out1);
-                }
-            }
-            slist_add_sort(closure, s, NULL);
-            s->marked = 1;
-            if (s->type == NFA_STATE_TYPE_MATCH) {
-                ds->accept = 1;
-                if (ds->pid > s->pid) {
-                    ds->pid = s->pid;
-                    ds->bol = s->bol;
-                    ds->eol = s->eol;
-                    ds->ml = s->ml;
-                }
-            }
-        }
-    }
+    table->size = size;
+    table->used = 0;
+    table->slots = calloc(size, sizeof(dfa_state_t *));
+    return table->slots ? 0 : -1;
+}
 
-    return ds->accept;
+static void dfa_state_table_fini(dfa_state_table_t *table)
+{
+    free(table->slots);
+    table->slots = NULL;
 }
 
-static int nfa_closure_flush(slist_t *closure)
+static dfa_state_t *dfa_state_find(dfa_state_table_t *table, uint64_t hash, uint32_t *nfa_set, uint32_t nset)
 {
-    slist_node_t *cur;
-    nfa_state_t *s;
+    uint32_t i;
+    dfa_state_t *t;
 
-    for (cur = closure->head; cur; cur = cur->next) {
-        s = (nfa_state_t *)cur->value;
-        s->marked = 0;
+    for (i = hash & (table->size - 1); (t = table->slots[i]) != NULL; i = (i + 1) & (table->size - 1)) {
+        if (t->hash == hash && t->nset == nset
+                && memcmp(t->nfa_set, nfa_set, nset * sizeof(uint32_t)) == 0)
+            return t;
     }
 
-    return 0;
+    return NULL;
 }
 
-static int nfa_move(struct nfa_st *nfa, slist_t *closure, uint8_t c, slist_t *set)
+static int dfa_state_table_add(dfa_state_table_t *table, dfa_state_t *s)
 {
-    slist_node_t *cur;
-    nfa_state_t *s;
+    uint32_t i, j;
+    dfa_state_table_t bigger;
 
-    for (cur = closure->head; cur; cur = cur->next) {
-        s = (nfa_state_t *)cur->value;
-        if (s->type == NFA_STATE_TYPE_LITER) {
-            if (c == s->c) {
-                slist_add_tail(set, s->out);
-            }
-        } else if (s->type == NFA_STATE_TYPE_NOCASE) {
-            if (c == s->c || tolower(c) == s->c) {
-                slist_add_tail(set, s->out);
-            }
-        } else if (s->type == NFA_STATE_TYPE_DOTCH) {
-            if (c != '\n') {
-                slist_add_tail(set, s->out);
-            }
-        } else if (s->type == NFA_STATE_TYPE_ANYCH) {
-            slist_add_tail(set, s->out);
-        } else if (s->type == NFA_STATE_TYPE_DUAL) {
-            if (c == s->c || c == s->c1) {
-                slist_add_tail(set, s->out);
-            }
-        } else if (s->type == NFA_STATE_TYPE_TRIAD) {
-            if (c == s->c || c == s->c1 || c == s->c2) {
-                slist_add_tail(set, s->out);
-            }
-        } else if (s->type == NFA_STATE_TYPE_RANGE) {
-            if (c >= s->c && c <= s->c1) {
-                slist_add_tail(set, s->out);
+    /* keep it half empty */
+    if ((table->used + 1) * 2 > table->size) {
+        if (dfa_state_table_init(&bigger, table->size * 2) < 0)
+            return -1;
+
+        for (j = 0; j < table->size; j++) {
+            if (table->slots[j]) {
+                for (i = table->slots[j]->hash & (bigger.size - 1); bigger.slots[i]; i = (i + 1) & (bigger.size - 1));
+                bigger.slots[i] = table->slots[j];
             }
         }
-        s->marked = 0;
+        bigger.used = table->used;
+        dfa_state_table_fini(table);
+        *table = bigger;
     }
 
+    for (i = s->hash & (table->size - 1); table->slots[i]; i = (i + 1) & (table->size - 1));
+    table->slots[i] = s;
+    table->used++;
     return 0;
 }
 
-static int nfa2dfa(struct nfa_st *nfa, struct dfa_st *dfa)
+/**
+ * the scratch of the subset construction, owned by one nfa2dfa call, so
+ * nothing is written into the nfa states and the compile is reentrant.
+ * the set is a sparse set (Briggs and Torczon) over the state ids, it's
+ * cleared in O(1) and needs no marks on the states.
+ */
+typedef struct nfa_scratch_st {
+    uint32_t n;
+    uint32_t *dense;
+    uint32_t *sparse;
+    uint32_t *stack;
+    uint32_t *sorted;   /** the set in order of id, the key of the dfa state */
+    nfa_state_t **states;
+} nfa_scratch_t;
+
+/* the sets of the ids below n, without the states */
+static int nfa_scratch_alloc(nfa_scratch_t *sc, uint32_t n)
 {
-    int i;
-    slist_t set;
-    slist_t dfa_states;
+    sc->n = 0;
+    sc->dense = malloc(n * sizeof(uint32_t));
+    /* the sparse set doesn't need it cleared, but valgrind does */
+    sc->sparse = calloc(n, sizeof(uint32_t));
+    sc->stack = malloc(n * sizeof(uint32_t));
+    sc->sorted = malloc(n * sizeof(uint32_t));
+    sc->states = NULL;
+    if (!sc->dense || !sc->sparse || !sc->stack || !sc->sorted)
+        return -1;
+
+    return 0;
+}
+
+static int nfa_scratch_init(nfa_scratch_t *sc, struct nfa_st *nfa)
+{
+    if (nfa_scratch_alloc(sc, nfa->nstate + 1) < 0)
+        return -1;
+
+    sc->states = nfa_states_collect(nfa);
+    if (sc->states == NULL)
+        return -1;
+
+    return 0;
+}
+
+static void nfa_scratch_fini(nfa_scratch_t *sc)
+{
+    free(sc->dense);
+    free(sc->sparse);
+    free(sc->stack);
+    free(sc->sorted);
+    free(sc->states);
+}
+
+static inline int nfa_scratch_add(nfa_scratch_t *sc, uint32_t id)
+{
+    uint32_t i = sc->sparse[id];
+
+    if (i < sc->n && sc->dense[i] == id)
+        return 0;
+
+    sc->sparse[id] = sc->n;
+    sc->dense[sc->n++] = id;
+    return 1;
+}
+
+static int nfa_id_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * the states pushed on the stack are in the set already, follow their
+ * epsilon edges, then sort the set into sc->sorted.
+ */
+static uint32_t nfa_eps_closure(nfa_scratch_t *sc, uint32_t top)
+{
+    nfa_state_t *s;
+
+    while (top > 0) {
+        s = sc->states[sc->stack[--top]];
+        if (s->type == NFA_STATE_TYPE_SPLIT) {
+            if (s->out && nfa_scratch_add(sc, s->out->id))
+                sc->stack[top++] = s->out->id;
+            if (s->out1 && nfa_scratch_add(sc, s->out1->id))
+                sc->stack[top++] = s->out1->id;
+        }
+    }
+
+    memcpy(sc->sorted, sc->dense, sc->n * sizeof(uint32_t));
+    qsort(sc->sorted, sc->n, sizeof(uint32_t), nfa_id_cmp);
+    return sc->n;
+}
+
+/* if the state consumes c */
+static inline int nfa_state_hit(nfa_state_t *s, uint8_t c)
+{
+    switch (s->type) {
+    case NFA_STATE_TYPE_LITER:
+        return c == s->c;
+    case NFA_STATE_TYPE_NOCASE:
+        return c == s->c || tolower(c) == s->c;
+    case NFA_STATE_TYPE_DOTCH:
+        return c != '\n';
+    case NFA_STATE_TYPE_ANYCH:
+        return 1;
+    case NFA_STATE_TYPE_DUAL:
+        return c == s->c || c == s->c1;
+    case NFA_STATE_TYPE_TRIAD:
+        return c == s->c || c == s->c1 || c == s->c2;
+    case NFA_STATE_TYPE_RANGE:
+        return c >= s->c && c <= s->c1;
+    default:
+        return 0;
+    }
+}
+
+/* the states of the set reached on c, pushed on the stack, return the stack top */
+static uint32_t nfa_move(nfa_scratch_t *sc, uint32_t *nfa_set, uint32_t nset, uint8_t c)
+{
+    uint32_t i;
+    uint32_t top = 0;
+    nfa_state_t *s;
+
+    sc->n = 0;
+    for (i = 0; i < nset; i++) {
+        s = sc->states[nfa_set[i]];
+        if (nfa_state_hit(s, c) && nfa_scratch_add(sc, s->out->id))
+            sc->stack[top++] = s->out->id;
+    }
+
+    return top;
+}
+
+/* the attributes of the set, from its match state of the smallest pid */
+static uint8_t nfa_set_attrs(nfa_scratch_t *sc, uint32_t *nfa_set, uint32_t nset, uint32_t *pid)
+{
+    uint32_t i;
+    uint8_t attrs = 0;
+    nfa_state_t *s;
+
+    *pid = 0x0fffffff;
+    for (i = 0; i < nset; i++) {
+        s = sc->states[nfa_set[i]];
+        if (s->type == NFA_STATE_TYPE_MATCH && s->pid < *pid) {
+            *pid = s->pid;
+            attrs = DFA_ACCEPT | (s->bol ? DFA_BOL : 0)
+                | (s->eol ? DFA_EOL : 0) | (s->ml ? DFA_ML : 0);
+        }
+    }
+
+    return attrs;
+}
+
+/* the new dfa state of the closure in sc->sorted */
+static dfa_state_t *nfa_closure_state(nfa_scratch_t *sc, uint64_t hash)
+{
+    uint32_t pid;
+    uint8_t attrs;
+    dfa_state_t *ds;
+
+    ds = dfa_state_create(sc->sorted, sc->n, hash);
+    if (ds == NULL)
+        return NULL;
+
+    attrs = nfa_set_attrs(sc, sc->sorted, sc->n, &pid);
+    ds->accept = (attrs & DFA_ACCEPT) != 0;
+    ds->bol = (attrs & DFA_BOL) != 0;
+    ds->eol = (attrs & DFA_EOL) != 0;
+    ds->ml = (attrs & DFA_ML) != 0;
+    ds->pid = pid;
+
+    return ds;
+}
+
+static int nfa2dfa(struct nfa_st *nfa, struct dfa_st *dfa)
+{
+    int i;
+    uint32_t top;
+    uint64_t hash;
+    slist_t dfa_states;
+    dfa_state_table_t table;
+    nfa_scratch_t sc;
 
     void *v;
     int n_dfa_states = 0;
-    dfa_state_t *T, *U, *W;
+    dfa_state_t *T, *U;
 
     int nchar = N_CHARSET;
     uint8_t *charset = g_default_charset;
@@ -3691,145 +4453,1845 @@ static int nfa2dfa(struct nfa_st *nfa, struct dfa_st *dfa)
         return 0;
     }
 
-    slist_init(&set);
     slist_init(&dfa_states);
+    table.slots = NULL;
+    if (nfa_scratch_init(&sc, nfa) < 0 || dfa_state_table_init(&table, 64) < 0)
+        goto errout;
 
     if (nfa->charset) {
         nchar = nfa->nchar;
         charset = nfa->charset;
     }
 
-    T = dfa_state_create();
+    sc.n = 0;
+    nfa_scratch_add(&sc, nfa->start->id);
+    sc.stack[0] = nfa->start->id;
+    nfa_eps_closure(&sc, 1);
+    hash = nfa_set_hash(sc.sorted, sc.n);
+    T = nfa_closure_state(&sc, hash);
+    if (T == NULL || dfa_state_table_add(&table, T) < 0) {
+        dfa_state_destroy(T);
+        goto errout;
+    }
     n_dfa_states++;
-
-    slist_add(&set, nfa->start);
-    nfa_eps_closure(nfa, &set, T->nfa_set, T);
     dfa->start = T;
+    slist_add(&dfa_states,  T);
 
-    if (nchar == 0) {
+    while (slist_del(&dfa_states, &v)) {
+        T = (dfa_state_t *)v;
         slist_add_tail(&dfa->states,  T);
-        nfa_closure_flush(T->nfa_set);
-        return 0;
+        for (i=0; i<nchar; i++) {
+            top = nfa_move(&sc, T->nfa_set, T->nset, charset[i]);
+            if (top == 0)
+                continue;
+
+            nfa_eps_closure(&sc, top);
+            hash = nfa_set_hash(sc.sorted, sc.n);
+            U = dfa_state_find(&table, hash, sc.sorted, sc.n);
+            if (U == NULL) {
+                U = nfa_closure_state(&sc, hash);
+                if (U == NULL || dfa_state_table_add(&table, U) < 0) {
+                    dfa_state_destroy(U);
+                    goto errout;
+                }
+                n_dfa_states++;
+                slist_add_tail(&dfa_states,  U);
+            }
+            T->next[charset[i]] = U;
+        }
+    }
+
+    dfa_state_table_fini(&table);
+    nfa_scratch_fini(&sc);
+    dfa_destroy_nfa(dfa);
+    return n_dfa_states;
+
+errout:
+    /* dfa_destroy frees them */
+    while (slist_del(&dfa_states, &v)) {
+        slist_add_tail(&dfa->states, v);
+    }
+    dfa_state_table_fini(&table);
+    nfa_scratch_fini(&sc);
+    return -1;
+}
+
+static int dfa_class_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * number the states densely, split the bytes into classes by their next
+ * states, and move the transitions into one table, the states are freed.
+ */
+static int dfa_freeze(struct dfa_st *dfa)
+{
+    int c;
+    void *v;
+    uint32_t id;
+    uint32_t nclass = 1;
+    uint8_t rep[N_CHARSET];
+    uint64_t keys[N_CHARSET];
+    slist_node_t *cur;
+    dfa_state_t *s, *t;
+
+    dfa->nstate = 0;
+    if (dfa->start) {
+        dfa->start->id = DFA_START;
+        dfa->nstate = 1;
+    }
+
+    for (cur = dfa->states.head; cur; cur = cur->next) {
+        s = (dfa_state_t *)cur->value;
+        if (s != dfa->start)
+            s->id = ++dfa->nstate;
+    }
+
+    /* refine the classes by (class, next state) of every state */
+    memset(dfa->classes, 0, sizeof(dfa->classes));
+    for (cur = dfa->states.head; cur && nclass < N_CHARSET; cur = cur->next) {
+        s = (dfa_state_t *)cur->value;
+        for (c = 0; c < N_CHARSET; c++) {
+            id = s->next[c] ? s->next[c]->id : DFA_DEAD;
+            keys[c] = ((uint64_t)dfa->classes[c] << 40) | ((uint64_t)id << 8) | c;
+        }
+
+        qsort(keys, N_CHARSET, sizeof(uint64_t), dfa_class_cmp);
+        nclass = 0;
+        for (c = 0; c < N_CHARSET; c++) {
+            if (c > 0 && (keys[c] >> 8) != (keys[c - 1] >> 8))
+                nclass++;
+            dfa->classes[keys[c] & 0xff] = nclass;
+        }
+        nclass++;
+    }
+
+    dfa->nclass = nclass;
+    for (c = N_CHARSET - 1; c >= 0; c--) {
+        rep[dfa->classes[c]] = c;
+    }
+
+    dfa->wide = dfa->nstate >= 0xffff;
+    dfa->table = calloc((size_t)(dfa->nstate + 1) * nclass, dfa->wide ? sizeof(uint32_t) : sizeof(uint16_t));
+    dfa->attrs = calloc(dfa->nstate + 1, sizeof(uint8_t));
+    dfa->pids = calloc(dfa->nstate + 1, sizeof(uint32_t));
+    if (dfa->table == NULL || dfa->attrs == NULL || dfa->pids == NULL)
+        return -1;
+
+    for (cur = dfa->states.head; cur; cur = cur->next) {
+        s = (dfa_state_t *)cur->value;
+        for (c = 0; c < nclass; c++) {
+            t = s->next[rep[c]];
+            id = t ? t->id : DFA_DEAD;
+            if (dfa->wide) {
+                ((uint32_t *)dfa->table)[s->id * nclass + c] = id;
+            } else {
+                ((uint16_t *)dfa->table)[s->id * nclass + c] = id;
+            }
+        }
+
+        dfa->attrs[s->id] = (s->accept ? DFA_ACCEPT : 0) | (s->bol ? DFA_BOL : 0)
+            | (s->eol ? DFA_EOL : 0) | (s->ml ? DFA_ML : 0);
+        dfa->pids[s->id] = s->pid;
+    }
+
+    while (filo_dequeue(&dfa->states, &v)) {
+        dfa_state_destroy(v);
+    }
+    dfa->start = NULL;
+    dfa->single = dfa->nstate == 1;
+    dfa_skip_init(dfa);
+
+    return 0;
+}
+
+typedef struct dfa_min_key_st {
+    uint32_t state;
+    uint32_t attrs;
+    uint32_t pid;
+} dfa_min_key_t;
+
+static int dfa_min_key_cmp(const void *a, const void *b)
+{
+    const dfa_min_key_t *x = a;
+    const dfa_min_key_t *y = b;
+
+    /* the dead state goes first and alone */
+    if ((x->state == DFA_DEAD) != (y->state == DFA_DEAD))
+        return x->state == DFA_DEAD ? -1 : 1;
+    if (x->attrs != y->attrs)
+        return x->attrs < y->attrs ? -1 : 1;
+    if (x->pid != y->pid)
+        return x->pid < y->pid ? -1 : 1;
+    return x->state < y->state ? -1 : x->state > y->state;
+}
+
+/**
+ * the partition of the states for dfa_minimize, the states of block b are
+ * elems[first[b]] ... elems[last[b] - 1], the marked ones moved to the front.
+ */
+typedef struct dfa_partition_st {
+    uint32_t nblock;
+    uint32_t *elems;
+    uint32_t *loc;
+    uint32_t *block;
+    uint32_t *first;
+    uint32_t *last;
+    uint32_t *marked;
+    uint32_t *touched;
+    uint32_t ntouched;
+    uint32_t *work;
+    uint32_t nwork;
+    uint8_t *inwork;
+} dfa_partition_t;
+
+static void dfa_partition_mark(dfa_partition_t *p, uint32_t s)
+{
+    uint32_t b = p->block[s];
+    uint32_t i = p->loc[s];
+    uint32_t j = p->first[b] + p->marked[b];
+    uint32_t t;
+
+    if (i < j)
+        return;
+
+    t = p->elems[j];
+    p->elems[j] = s;
+    p->elems[i] = t;
+    p->loc[s] = j;
+    p->loc[t] = i;
+    if (p->marked[b]++ == 0)
+        p->touched[p->ntouched++] = b;
+}
+
+/* split the touched blocks into the marked and the others, the smaller one is new */
+static void dfa_partition_split(dfa_partition_t *p)
+{
+    uint32_t b, nb, i;
+    uint32_t m, n;
+
+    while (p->ntouched > 0) {
+        b = p->touched[--p->ntouched];
+        m = p->marked[b];
+        n = p->last[b] - p->first[b];
+        p->marked[b] = 0;
+        if (m == n)
+            continue;
+
+        nb = p->nblock++;
+        if (m <= n - m) {
+            p->first[nb] = p->first[b];
+            p->last[nb] = p->first[b] + m;
+            p->first[b] += m;
+        } else {
+            p->first[nb] = p->first[b] + m;
+            p->last[nb] = p->last[b];
+            p->last[b] = p->first[b] + m;
+        }
+        p->marked[nb] = 0;
+        for (i = p->first[nb]; i < p->last[nb]; i++) {
+            p->block[p->elems[i]] = nb;
+        }
+
+        /* b in the work or not, the smaller part is enough */
+        p->inwork[nb] = 1;
+        p->work[p->nwork++] = nb;
+    }
+}
+
+/**
+ * merge the equivalent states of a frozen dfa by Hopcroft's partition
+ * refinement, the states are equivalent only if they have the same
+ * attributes and the same pid when accepting. the dead state is kept
+ * alone, so dfa_match stops at the same places. return the number of
+ * states left, which dfa_nstate reports from now on, or -1 on failure.
+ * the lazy dfa has no table to minimize, it's left as it is.
+ */
+int dfa_minimize(mdfa_t *prog)
+{
+    uint32_t s, t, c, i, j, b, a;
+    uint32_t n, nclass, nsplit;
+    uint32_t *count = NULL;
+    uint32_t *preds = NULL;
+    uint32_t *splitter = NULL;
+    uint32_t *ids = NULL;
+    uint8_t *attrs = NULL;
+    uint32_t *pids = NULL;
+    void *table = NULL;
+    int wide;
+    int ret = -1;
+    dfa_min_key_t *keys = NULL;
+    dfa_partition_t p;
+    struct dfa_st *dfa = (struct dfa_st *)prog;
+
+    if (dfa == NULL)
+        return -1;
+
+    if (dfa->lazy || dfa->table == NULL || dfa->nstate <= 1)
+        return dfa->nstate;
+
+    n = dfa->nstate + 1;
+    nclass = dfa->nclass;
+    memset(&p, 0, sizeof(p));
+    p.elems = malloc(n * sizeof(uint32_t));
+    p.loc = malloc(n * sizeof(uint32_t));
+    p.block = malloc(n * sizeof(uint32_t));
+    p.first = malloc(n * sizeof(uint32_t));
+    p.last = malloc(n * sizeof(uint32_t));
+    p.marked = calloc(n, sizeof(uint32_t));
+    p.touched = malloc(n * sizeof(uint32_t));
+    p.work = malloc(n * sizeof(uint32_t));
+    p.inwork = calloc(n, sizeof(uint8_t));
+    keys = malloc(n * sizeof(dfa_min_key_t));
+    splitter = malloc(n * sizeof(uint32_t));
+    count = calloc((size_t)nclass * n + 1, sizeof(uint32_t));
+    preds = malloc((size_t)nclass * n * sizeof(uint32_t));
+    if (!p.elems || !p.loc || !p.block || !p.first || !p.last || !p.marked
+            || !p.touched || !p.work || !p.inwork || !keys || !splitter
+            || !count || !preds)
+        goto out;
+
+    /* the predecessors of t on class c are preds[count[c * n + t] ...] */
+    for (s = 0; s < n; s++) {
+        for (c = 0; c < nclass; c++) {
+            count[c * n + dfa_next_class(dfa, s, c) + 1]++;
+        }
+    }
+    for (i = 1; i <= nclass * n; i++) {
+        count[i] += count[i - 1];
+    }
+    for (s = 0; s < n; s++) {
+        for (c = 0; c < nclass; c++) {
+            preds[count[c * n + dfa_next_class(dfa, s, c)]++] = s;
+        }
+    }
+    for (i = nclass * n; i > 0; i--) {
+        count[i] = count[i - 1];
+    }
+    count[0] = 0;
+
+    /* the initial blocks are the states of the same attributes and pid */
+    for (s = 0; s < n; s++) {
+        keys[s].state = s;
+        keys[s].attrs = dfa->attrs[s];
+        keys[s].pid = (dfa->attrs[s] & DFA_ACCEPT) ? dfa->pids[s] : 0;
+    }
+    qsort(keys, n, sizeof(dfa_min_key_t), dfa_min_key_cmp);
+    for (i = 0; i < n; i++) {
+        s = keys[i].state;
+        if (i == 0 || keys[i - 1].state == DFA_DEAD
+                || keys[i - 1].attrs != keys[i].attrs || keys[i - 1].pid != keys[i].pid) {
+            b = p.nblock++;
+            p.first[b] = i;
+            p.inwork[b] = 1;
+            p.work[p.nwork++] = b;
+        }
+        p.elems[i] = s;
+        p.loc[s] = i;
+        p.block[s] = p.nblock - 1;
+        p.last[p.nblock - 1] = i + 1;
+    }
+
+    while (p.nwork > 0) {
+        a = p.work[--p.nwork];
+        p.inwork[a] = 0;
+
+        /* the splitter may be split by itself, so take its states first */
+        nsplit = 0;
+        for (i = p.first[a]; i < p.last[a]; i++) {
+            splitter[nsplit++] = p.elems[i];
+        }
+
+        for (c = 0; c < nclass; c++) {
+            for (i = 0; i < nsplit; i++) {
+                t = splitter[i];
+                for (j = count[c * n + t]; j < count[c * n + t + 1]; j++) {
+                    dfa_partition_mark(&p, preds[j]);
+                }
+            }
+            dfa_partition_split(&p);
+        }
+    }
+
+    ret = dfa->nstate;
+    if (p.nblock == n)
+        goto out;
+
+    /* the block of the dead state is 0 and the one of the start is 1 */
+    ids = malloc(p.nblock * sizeof(uint32_t));
+    if (ids == NULL) {
+        ret = -1;
+        goto out;
+    }
+
+    for (b = 0; b < p.nblock; b++) {
+        ids[b] = DFA_UNKNOWN;
+    }
+    ids[p.block[DFA_DEAD]] = DFA_DEAD;
+    ids[p.block[DFA_START]] = DFA_START;
+    j = DFA_START + 1;
+    for (b = 0; b < p.nblock; b++) {
+        if (ids[b] == DFA_UNKNOWN)
+            ids[b] = j++;
+    }
+
+    wide = p.nblock - 1 >= 0xffff;
+    table = calloc((size_t)p.nblock * nclass, wide ? sizeof(uint32_t) : sizeof(uint16_t));
+    attrs = calloc(p.nblock, sizeof(uint8_t));
+    pids = calloc(p.nblock, sizeof(uint32_t));
+    if (table == NULL || attrs == NULL || pids == NULL) {
+        free(table);
+        free(attrs);
+        free(pids);
+        ret = -1;
+        goto out;
+    }
+
+    for (b = 0; b < p.nblock; b++) {
+        s = p.elems[p.first[b]];
+        for (c = 0; c < nclass; c++) {
+            t = ids[p.block[dfa_next_class(dfa, s, c)]];
+            if (wide) {
+                ((uint32_t *)table)[ids[b] * nclass + c] = t;
+            } else {
+                ((uint16_t *)table)[ids[b] * nclass + c] = t;
+            }
+        }
+        attrs[ids[b]] = dfa->attrs[s];
+        pids[ids[b]] = dfa->pids[s];
+    }
+
+    /* the reverse is of the old table */
+    dfa_destroy(dfa->rev);
+    dfa->rev = NULL;
+    dfa_table_free(dfa);
+    dfa->table = table;
+    dfa->attrs = attrs;
+    dfa->pids = pids;
+    dfa->wide = wide;
+    dfa->nstate = p.nblock - 1;
+    ret = dfa->nstate;
+
+out:
+    free(p.elems);
+    free(p.loc);
+    free(p.block);
+    free(p.first);
+    free(p.last);
+    free(p.marked);
+    free(p.touched);
+    free(p.work);
+    free(p.inwork);
+    free(keys);
+    free(splitter);
+    free(count);
+    free(preds);
+    free(ids);
+    return ret;
+}
+
+void *dfa_compile(char *regex, int flags)
+{
+    struct nfa_st nfa;
+    struct dfa_st *dfa;
+
+    dfa = malloc(sizeof(*dfa));
+    if (dfa == NULL) {
+        return NULL;
+    }
+
+    memset(dfa, 0, sizeof(*dfa));
+    filo_init(&dfa->states);
+
+    nfa.nstate = 0;
+    if (nfa_compile(&nfa, 0, regex, flags) < 0) {
+        free(dfa);
+        return NULL;
+    }
+
+    if (nfa2dfa(&nfa, dfa) < 0) {
+        nfa_destroy(&nfa);
+        dfa_destroy(dfa);
+        return NULL;
+    }
+    nfa_destroy(&nfa);
+
+    if (dfa_freeze(dfa) < 0) {
+        dfa_destroy(dfa);
+        return NULL;
+    }
+
+    return dfa;
+}
+
+/**
+ * compile the n regexes into one nfa, which is left in nfa[0], nfa must have
+ * room for n.
+ */
+static int mdfa_nfa_compile(struct nfa_st *nfa, int n, char **regex, int *flags)
+{
+    int i;
+
+    nfa[0].nstate = 0;
+    if (nfa_compile(nfa, 0, regex[0], flags[0]) < 0) {
+        fprintf(stderr, "compile regex 0 /%s/%x failed\n", regex[0], flags[0]);
+        return -1;
+    }
+
+    for (i=1; i<n; i++) {
+        /* number the states after the ones combined, so the ids are unique */
+        nfa[i].nstate = nfa[0].nstate;
+        if (nfa_compile(nfa + i, i, regex[i], flags[i]) < 0) {
+            fprintf(stderr, "compile regex %d /%s/%x failed\n", i, regex[i], flags[i]);
+            nfa_destroy(nfa); // nfa[0] had combined nfa[1]...nfa[i-1]
+            return -1;
+        }
+
+        if (nfa_combine(nfa, nfa + i, nfa) < 0) {
+            fprintf(stderr, "combine regex %d /%s/%x failed\n", i, regex[i], flags[i]);
+            nfa_destroy(nfa); // nfa[0] had combined nfa[1]...nfa[i-1]
+            nfa_destroy(nfa + i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void *mdfa_compile(int n, char **regex, int *flags)
+{
+    struct nfa_st *nfa;
+    struct dfa_st *dfa;
+
+    dfa = malloc(sizeof(*dfa));
+    if (dfa == NULL) {
+        return NULL;
+    }
+
+    memset(dfa, 0, sizeof(*dfa));
+    filo_init(&dfa->states);
+
+    nfa = malloc(n * sizeof(*nfa));
+    if (nfa == NULL) {
+        free(dfa);
+        return NULL;
+    }
+
+    if (mdfa_nfa_compile(nfa, n, regex, flags) < 0)
+        goto out;
+
+    if (nfa2dfa(nfa, dfa) < 0) {
+        nfa_destroy(nfa);
+        free(nfa);
+        dfa_destroy(dfa);
+        return NULL;
+    }
+    dfa->flags |= REF_MULTIREG;
+    nfa_destroy(nfa);
+    free(nfa);
+
+    if (dfa_freeze(dfa) < 0) {
+        dfa_destroy(dfa);
+        return NULL;
+    }
+
+    return dfa;
+out:
+    free(nfa);
+    free(dfa);
+    return NULL;
+}
+
+/**
+ * the lazy dfa builds the states of the frozen one only when the input
+ * reaches them, from the nfa, and caches them until they cost more than
+ * the budget, then the cache is dropped but the start state. when it is
+ * dropped before the states paid for themselves, the cache is thrashing,
+ * and the rest of that dfa_match steps the nfa set by set, which needs no
+ * memory but is slower. dfa_match writes the cache, so a lazy dfa must not
+ * be matched by several threads at once.
+ */
+#define DFA_SIMULATE        2           /** the state of the nfa simulation */
+#define DFA_LAZY_BUDGET     (1 << 20)
+#define DFA_LAZY_GAIN       10          /** the steps a cached state must save */
+#define DFA_LINEAR_GAIN     8           /** the steps per byte before dfa_match goes reverse */
+#define DFA_MORE            (-2)        /** dfa_match_run needs the text after len */
+#define DFA_MATCH_MORE      0x01        /** the text may go on after len */
+#define DFA_MATCH_RESTART   0x02        /** search from pos as a restart from pos - 1 */
+#define DFA_STREAM_CHUNK    65536       /** the bytes dfa_stream_scan reads at a time */
+
+struct dfa_lazy_st {
+    struct nfa_st nfa;
+    nfa_scratch_t sc;
+    size_t budget;
+    size_t used;
+    uint32_t size;          /** the states allocated, ids 1 ... nstate used */
+    uint32_t *rows;         /** size rows of nclass, DFA_UNKNOWN not built yet */
+    uint32_t **sets;
+    uint32_t *nsets;
+    uint64_t *hashes;
+    uint32_t *slots;        /** the ids by the hash of their sets, 2 * size */
+    uint32_t *sim;          /** the set of DFA_SIMULATE */
+    uint32_t nsim;
+    uint32_t nstep;         /** since the cache was dropped */
+    uint32_t nflush;        /** the times the cache was dropped */
+    int simulate;
+    int dead;               /** class 0 is the bytes out of the charset */
+    struct dfa_st *fwd;     /** reversed by this one, the sets are of its states, or its nfa states if it's lazy */
+    uint32_t nid;           /** the ids of the states of fwd, the flags of the pos follow them */
+    int eol;                /** fwd has matches anchored at the end */
+    int bol;                /** the matches start at 0 if 1, at a line start if 2 */
+    uint32_t *redges;       /** the (class, source) of the edges into every state of fwd, the sources if lazy */
+    uint32_t *roffsets;     /** the edges into t are redges[roffsets[t] ... roffsets[t + 1]) */
+    uint32_t *pre;          /** the sources into the accepting states by class and anchor, the match states if lazy */
+    uint32_t *preoffsets;
+    uint32_t *eedges;       /** the split states into every nfa state of a lazy fwd */
+    uint32_t *eoffsets;
+};
+
+static void dfa_lazy_destroy(struct dfa_lazy_st *lazy)
+{
+    uint32_t i;
+
+    if (lazy) {
+        for (i = 0; lazy->sets && i < lazy->size; i++) {
+            free(lazy->sets[i]);
+        }
+        free(lazy->rows);
+        free(lazy->sets);
+        free(lazy->nsets);
+        free(lazy->hashes);
+        free(lazy->slots);
+        free(lazy->sim);
+        free(lazy->redges);
+        free(lazy->roffsets);
+        free(lazy->pre);
+        free(lazy->preoffsets);
+        free(lazy->eedges);
+        free(lazy->eoffsets);
+        nfa_scratch_fini(&lazy->sc);
+        nfa_destroy(&lazy->nfa);
+        free(lazy);
+    }
+}
+
+static size_t dfa_lazy_cost(struct dfa_st *dfa, uint32_t nset)
+{
+    return (dfa->nclass + nset + 2) * sizeof(uint32_t) + sizeof(uint32_t *)
+        + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t);
+}
+
+static uint32_t dfa_lazy_find(struct dfa_lazy_st *lazy, uint64_t hash, uint32_t *nfa_set, uint32_t nset)
+{
+    uint32_t i, id;
+    uint32_t mask = 2 * lazy->size - 1;
+
+    for (i = hash & mask; (id = lazy->slots[i]) != 0; i = (i + 1) & mask) {
+        if (lazy->hashes[id] == hash && lazy->nsets[id] == nset
+                && memcmp(lazy->sets[id], nfa_set, nset * sizeof(uint32_t)) == 0)
+            return id;
+    }
+
+    return DFA_DEAD;
+}
+
+static void dfa_lazy_slot(struct dfa_lazy_st *lazy, uint32_t id)
+{
+    uint32_t i;
+    uint32_t mask = 2 * lazy->size - 1;
+
+    for (i = lazy->hashes[id] & mask; lazy->slots[i]; i = (i + 1) & mask);
+    lazy->slots[i] = id;
+}
+
+/* the next states are not known yet, but the bytes out of the charset */
+static void dfa_lazy_row(struct dfa_st *dfa, uint32_t id)
+{
+    uint32_t k;
+    uint32_t *row = dfa->lazy->rows + (size_t)id * dfa->nclass;
+
+    for (k = 0; k < dfa->nclass; k++) {
+        row[k] = DFA_UNKNOWN;
+    }
+    if (dfa->lazy->dead)
+        row[0] = DFA_DEAD;
+}
+
+/* drop the cache but the start state */
+static void dfa_lazy_flush(struct dfa_st *dfa)
+{
+    uint32_t i;
+    struct dfa_lazy_st *lazy = dfa->lazy;
+
+    for (i = DFA_START + 1; i <= dfa->nstate; i++) {
+        free(lazy->sets[i]);
+        lazy->sets[i] = NULL;
+    }
+
+    dfa->nstate = DFA_START;
+    memset(lazy->slots, 0, 2 * lazy->size * sizeof(uint32_t));
+    dfa_lazy_slot(lazy, DFA_START);
+    dfa_lazy_row(dfa, DFA_START);
+    lazy->used = dfa_lazy_cost(dfa, lazy->nsets[DFA_START]);
+    lazy->nstep = 0;
+    lazy->nflush++;
+}
+
+static int dfa_lazy_grow(struct dfa_st *dfa)
+{
+    uint32_t i;
+    uint32_t size;
+    uint32_t *slots;
+    void *p;
+    struct dfa_lazy_st *lazy = dfa->lazy;
+
+    size = lazy->size * 2;
+    slots = calloc(2 * (size_t)size, sizeof(uint32_t));
+    if (slots == NULL)
+        return -1;
+
+    /* the arrays grown before a failure are only bigger than size */
+#define DFA_LAZY_REALLOC(ptr, n) do { \
+        p = realloc(ptr, (size_t)(n) * sizeof(*(ptr))); \
+        if (p == NULL) { \
+            free(slots); \
+            return -1; \
+        } \
+        ptr = p; \
+    } while (0)
+
+    DFA_LAZY_REALLOC(lazy->rows, (size_t)size * dfa->nclass);
+    DFA_LAZY_REALLOC(dfa->attrs, size);
+    DFA_LAZY_REALLOC(dfa->pids, size);
+    DFA_LAZY_REALLOC(lazy->nsets, size);
+    DFA_LAZY_REALLOC(lazy->hashes, size);
+    DFA_LAZY_REALLOC(lazy->sets, size);
+
+#undef DFA_LAZY_REALLOC
+
+    for (i = lazy->size; i < size; i++) {
+        lazy->sets[i] = NULL;
+    }
+
+    free(lazy->slots);
+    lazy->slots = slots;
+    lazy->size = size;
+    for (i = DFA_START; i <= dfa->nstate; i++) {
+        dfa_lazy_slot(lazy, i);
+    }
+
+    return 0;
+}
+
+/**
+ * the anchors of the matches, and the flags of the pos in a set of the
+ * reverse, after the ids of fwd: a $ may match there, a multiline $ may,
+ * the pos is the end of text. a match without an anchor may end anywhere.
+ */
+#define DFA_REV_ANY         0
+#define DFA_REV_END         1
+#define DFA_REV_LINE        2
+#define DFA_REV_LAST        3
+#define DFA_REV_NFLAG       4
+
+/* the anchor of a match, by the attributes of its state */
+static inline uint32_t dfa_reverse_anchor(uint8_t attrs)
+{
+    if (!(attrs & DFA_EOL))
+        return DFA_REV_ANY;
+
+    return (attrs & DFA_ML) ? DFA_REV_LINE : DFA_REV_END;
+}
+
+/* the flags of the set as bits, by the anchors they let end there */
+static uint32_t dfa_reverse_flags(struct dfa_lazy_st *lazy, uint32_t *set, uint32_t nset)
+{
+    uint32_t flags = 1 << DFA_REV_ANY;
+
+    while (nset > 0 && set[nset - 1] >= lazy->nid) {
+        flags |= 1 << (set[--nset] - lazy->nid);
+    }
+
+    return flags;
+}
+
+/* the flags of the pos before, where c is */
+static uint32_t dfa_reverse_flags_next(struct dfa_lazy_st *lazy, uint32_t flags, uint8_t c)
+{
+    uint32_t next = 1 << DFA_REV_ANY;
+
+    if (lazy->eol && c == '\n') {
+        next |= 1 << DFA_REV_LINE;
+        if (flags & (1 << DFA_REV_LAST))
+            next |= 1 << DFA_REV_END;
+    }
+
+    return next;
+}
+
+static void dfa_reverse_flags_add(struct dfa_lazy_st *lazy, uint32_t flags)
+{
+    uint32_t a;
+
+    for (a = DFA_REV_END; a < DFA_REV_NFLAG; a++) {
+        if (flags & (1 << a))
+            nfa_scratch_add(&lazy->sc, lazy->nid + a);
+    }
+}
+
+/**
+ * the sets of the reverse are the states of fwd which reach an accepting
+ * one on the text after the pos, whose anchor holds where it's reached.
+ * the accepting states without one are always in, so they are left out.
+ */
+static uint32_t dfa_reverse_move(struct dfa_lazy_st *lazy, uint32_t *set, uint32_t nset, uint8_t c)
+{
+    uint32_t i, j, a;
+    uint32_t k = lazy->fwd->classes[c];
+    uint32_t flags = dfa_reverse_flags(lazy, set, nset);
+    nfa_scratch_t *sc = &lazy->sc;
+
+    sc->n = 0;
+    for (a = DFA_REV_ANY; a <= DFA_REV_LINE; a++) {
+        if (!(flags & (1 << a)))
+            continue;
+        for (j = lazy->preoffsets[3 * k + a]; j < lazy->preoffsets[3 * k + a + 1]; j++) {
+            nfa_scratch_add(sc, lazy->pre[j]);
+        }
+    }
+
+    for (i = 0; i < nset && set[i] < lazy->nid; i++) {
+        for (j = lazy->roffsets[set[i]]; j < lazy->roffsets[set[i] + 1]; j++) {
+            if (lazy->redges[2 * j] == k)
+                nfa_scratch_add(sc, lazy->redges[2 * j + 1]);
+        }
+    }
+
+    dfa_reverse_flags_add(lazy, dfa_reverse_flags_next(lazy, flags, c));
+    memcpy(sc->sorted, sc->dense, sc->n * sizeof(uint32_t));
+    qsort(sc->sorted, sc->n, sizeof(uint32_t), nfa_id_cmp);
+
+    /* the reverse never dies */
+    return 1;
+}
+
+/* add the match states whose anchor holds at the pos, then what reaches them by epsilon */
+static void nfa_reverse_closure(struct dfa_lazy_st *lazy, uint32_t top, uint32_t flags)
+{
+    uint32_t a, j, q;
+    nfa_scratch_t *sc = &lazy->sc;
+
+    for (a = DFA_REV_ANY; a <= DFA_REV_LINE; a++) {
+        if (!(flags & (1 << a)))
+            continue;
+        for (j = lazy->preoffsets[a]; j < lazy->preoffsets[a + 1]; j++) {
+            if (nfa_scratch_add(sc, lazy->pre[j]))
+                sc->stack[top++] = lazy->pre[j];
+        }
+    }
+
+    while (top > 0) {
+        q = sc->stack[--top];
+        for (j = lazy->eoffsets[q]; j < lazy->eoffsets[q + 1]; j++) {
+            if (nfa_scratch_add(sc, lazy->eedges[j]))
+                sc->stack[top++] = lazy->eedges[j];
+        }
+    }
+}
+
+/**
+ * the reverse of a lazy fwd: the sets are the nfa states which reach a
+ * match state on the text after the pos, whose anchor holds where it's
+ * reached, closed by the epsilon edges into them.
+ */
+static uint32_t nfa_reverse_move(struct dfa_lazy_st *lazy, uint32_t *set, uint32_t nset, uint8_t c)
+{
+    uint32_t i, j, q;
+    uint32_t top = 0;
+    uint32_t flags = dfa_reverse_flags(lazy, set, nset);
+    nfa_state_t **states = lazy->fwd->lazy->sc.states;
+    nfa_scratch_t *sc = &lazy->sc;
+
+    sc->n = 0;
+    for (i = 0; i < nset && set[i] < lazy->nid; i++) {
+        for (j = lazy->roffsets[set[i]]; j < lazy->roffsets[set[i] + 1]; j++) {
+            q = lazy->redges[j];
+            if (nfa_state_hit(states[q], c) && nfa_scratch_add(sc, q))
+                sc->stack[top++] = q;
+        }
+    }
+
+    flags = dfa_reverse_flags_next(lazy, flags, c);
+    nfa_reverse_closure(lazy, top, flags);
+    dfa_reverse_flags_add(lazy, flags);
+    memcpy(sc->sorted, sc->dense, sc->n * sizeof(uint32_t));
+    qsort(sc->sorted, sc->n, sizeof(uint32_t), nfa_id_cmp);
+
+    return 1;
+}
+
+static uint8_t dfa_lazy_attrs(struct dfa_st *dfa, uint32_t *set, uint32_t nset, uint32_t *pid)
+{
+    uint32_t start;
+    struct dfa_lazy_st *lazy = dfa->lazy;
+    struct dfa_st *fwd = lazy->fwd;
+
+    if (fwd == NULL)
+        return nfa_set_attrs(&lazy->sc, set, nset, pid);
+
+    /* a match of fwd starts at the pos if its start is in */
+    *pid = 0;
+    if (fwd->lazy) {
+        start = fwd->lazy->nfa.start->id;
+        return bsearch(&start, set, nset, sizeof(uint32_t), nfa_id_cmp) ? DFA_ACCEPT : 0;
+    }
+
+    if (nset > 0 && set[0] == DFA_START)
+        return DFA_ACCEPT;
+    if ((fwd->attrs[DFA_START] & DFA_ACCEPT) && (dfa_reverse_flags(lazy, set, nset)
+                & (1 << dfa_reverse_anchor(fwd->attrs[DFA_START]))))
+        return DFA_ACCEPT;
+
+    return 0;
+}
+
+/* the set in sc->sorted becomes the state of the nfa simulation */
+static uint32_t dfa_lazy_simulate(struct dfa_st *dfa)
+{
+    struct dfa_lazy_st *lazy = dfa->lazy;
+
+    lazy->nsim = lazy->sc.n;
+    memcpy(lazy->sim, lazy->sc.sorted, lazy->sc.n * sizeof(uint32_t));
+    dfa->attrs[DFA_SIMULATE] = dfa_lazy_attrs(dfa, lazy->sim, lazy->nsim, &dfa->pids[DFA_SIMULATE]);
+    return DFA_SIMULATE;
+}
+
+/* cache the set in sc->sorted as a new state, the states but the start may be dropped */
+static uint32_t dfa_lazy_add(struct dfa_st *dfa, uint64_t hash)
+{
+    uint32_t id;
+    size_t cost;
+    nfa_scratch_t *sc;
+    struct dfa_lazy_st *lazy = dfa->lazy;
+
+    sc = &lazy->sc;
+    cost = dfa_lazy_cost(dfa, sc->n);
+    if (lazy->used + cost > lazy->budget && dfa->nstate > DFA_START) {
+        if (lazy->nstep < DFA_LAZY_GAIN * (dfa->nstate - DFA_START))
+            lazy->simulate = 1;
+        dfa_lazy_flush(dfa);
+        if (lazy->simulate)
+            return dfa_lazy_simulate(dfa);
+    }
+
+    if (dfa->nstate + 1 >= lazy->size && dfa_lazy_grow(dfa) < 0)
+        goto nomem;
+
+    id = dfa->nstate + 1;
+    lazy->sets[id] = malloc(sc->n * sizeof(uint32_t) + 1);
+    if (lazy->sets[id] == NULL)
+        goto nomem;
+
+    memcpy(lazy->sets[id], sc->sorted, sc->n * sizeof(uint32_t));
+    lazy->nsets[id] = sc->n;
+    lazy->hashes[id] = hash;
+    dfa->attrs[id] = dfa_lazy_attrs(dfa, sc->sorted, sc->n, &dfa->pids[id]);
+    dfa_lazy_row(dfa, id);
+    dfa_lazy_slot(lazy, id);
+    dfa->nstate = id;
+    lazy->used += cost;
+    return id;
+
+nomem:
+    /* the simulation needs no more memory */
+    lazy->simulate = 1;
+    dfa_lazy_flush(dfa);
+    return dfa_lazy_simulate(dfa);
+}
+
+static uint32_t dfa_lazy_next(struct dfa_st *dfa, uint32_t s, uint8_t c)
+{
+    uint32_t k, t;
+    uint32_t top;
+    uint32_t nset;
+    uint32_t *nfa_set;
+    uint32_t nflush;
+    uint64_t hash;
+    struct dfa_lazy_st *lazy = dfa->lazy;
+
+    k = dfa->classes[c];
+    lazy->nstep++;
+    if (!lazy->simulate) {
+        t = lazy->rows[(size_t)s * dfa->nclass + k];
+        if (t != DFA_UNKNOWN)
+            return t;
+    } else if (k == 0 && lazy->dead) {
+        return DFA_DEAD;
+    }
+
+    if (s == DFA_SIMULATE && lazy->simulate) {
+        nfa_set = lazy->sim;
+        nset = lazy->nsim;
+    } else {
+        nfa_set = lazy->sets[s];
+        nset = lazy->nsets[s];
+    }
+
+    if (lazy->fwd && lazy->fwd->lazy)
+        top = nfa_reverse_move(lazy, nfa_set, nset, c);
+    else if (lazy->fwd)
+        top = dfa_reverse_move(lazy, nfa_set, nset, c);
+    else
+        top = nfa_move(&lazy->sc, nfa_set, nset, c);
+    if (top == 0) {
+        t = DFA_DEAD;
+    } else {
+        if (lazy->fwd == NULL)
+            nfa_eps_closure(&lazy->sc, top);
+        hash = nfa_set_hash(lazy->sc.sorted, lazy->sc.n);
+        t = dfa_lazy_find(lazy, hash, lazy->sc.sorted, lazy->sc.n);
+        if (t == DFA_DEAD) {
+            if (lazy->simulate)
+                return dfa_lazy_simulate(dfa);
+
+            /* s is gone if the cache is dropped */
+            nflush = lazy->nflush;
+            t = dfa_lazy_add(dfa, hash);
+            if (lazy->simulate || lazy->nflush != nflush)
+                return t;
+        }
+    }
+
+    if (!lazy->simulate)
+        lazy->rows[(size_t)s * dfa->nclass + k] = t;
+    return t;
+}
+
+/**
+ * the byte classes of the lazy dfa, from the bytes each nfa state accepts,
+ * class 0 is the bytes out of the charset, which never lead anywhere.
+ */
+static void dfa_lazy_classes(struct dfa_st *dfa)
+{
+    int c;
+    uint32_t i, k;
+    uint8_t cut[N_CHARSET + 1];
+    uint8_t live[N_CHARSET];
+    nfa_state_t *s;
+    struct dfa_lazy_st *lazy = dfa->lazy;
+
+#define DFA_LAZY_CUT(lo, hi) do { cut[lo] = 1; cut[(hi) + 1] = 1; } while (0)
+
+    memset(cut, 0, sizeof(cut));
+    memset(live, 0, sizeof(live));
+    for (i = 0; i < lazy->nfa.nchar; i++) {
+        live[lazy->nfa.charset[i]] = 1;
+    }
+
+    for (i = 0; i < lazy->nfa.nstate; i++) {
+        s = lazy->sc.states[i];
+        if (s == NULL)
+            continue;
+
+        switch (s->type) {
+        case NFA_STATE_TYPE_TRIAD:
+            DFA_LAZY_CUT(s->c2, s->c2);
+            /* fall through */
+        case NFA_STATE_TYPE_DUAL:
+            DFA_LAZY_CUT(s->c1, s->c1);
+            /* fall through */
+        case NFA_STATE_TYPE_LITER:
+            DFA_LAZY_CUT(s->c, s->c);
+            break;
+        case NFA_STATE_TYPE_NOCASE:
+            DFA_LAZY_CUT(s->c, s->c);
+            for (c = 0; c < N_CHARSET; c++) {
+                if (c != s->c && tolower(c) == s->c)
+                    DFA_LAZY_CUT(c, c);
+            }
+            break;
+        case NFA_STATE_TYPE_DOTCH:
+            DFA_LAZY_CUT('\n', '\n');
+            break;
+        case NFA_STATE_TYPE_RANGE:
+            if (s->c <= s->c1)
+                DFA_LAZY_CUT(s->c, s->c1);
+            break;
+        default:
+            break;
+        }
+    }
+
+#undef DFA_LAZY_CUT
+
+    lazy->dead = 0;
+    for (c = 0; c < N_CHARSET; c++) {
+        if (!live[c])
+            lazy->dead = 1;
+    }
+
+    /* a new class at every cut and after every dead byte */
+    k = 0;
+    for (c = 0; c < N_CHARSET; c++) {
+        if (!live[c]) {
+            dfa->classes[c] = 0;
+            continue;
+        }
+        if (k == 0 || cut[c] || !live[c - 1])
+            k++;
+        dfa->classes[c] = k - 1 + lazy->dead;
+    }
+    dfa->nclass = k + lazy->dead;
+}
+
+/* the lazy dfa without any state */
+static struct dfa_st *dfa_lazy_alloc(size_t budget)
+{
+    struct dfa_st *dfa;
+    struct dfa_lazy_st *lazy;
+
+    dfa = malloc(sizeof(*dfa));
+    lazy = malloc(sizeof(*lazy));
+    if (dfa == NULL || lazy == NULL) {
+        free(dfa);
+        free(lazy);
+        return NULL;
+    }
+
+    memset(dfa, 0, sizeof(*dfa));
+    memset(lazy, 0, sizeof(*lazy));
+    filo_init(&dfa->states);
+    dfa->lazy = lazy;
+    lazy->budget = budget ? budget : DFA_LAZY_BUDGET;
+
+    /* the ids 0 and 1 are the dead and the start, 2 the simulation */
+    lazy->size = 4;
+    dfa->nclass = 1;
+    lazy->rows = malloc(lazy->size * N_CHARSET * sizeof(uint32_t));
+    lazy->sets = calloc(lazy->size, sizeof(uint32_t *));
+    lazy->nsets = calloc(lazy->size, sizeof(uint32_t));
+    lazy->hashes = calloc(lazy->size, sizeof(uint64_t));
+    lazy->slots = calloc(2 * lazy->size, sizeof(uint32_t));
+    dfa->attrs = calloc(lazy->size, sizeof(uint8_t));
+    dfa->pids = calloc(lazy->size, sizeof(uint32_t));
+    if (!lazy->rows || !lazy->sets || !lazy->nsets || !lazy->hashes
+            || !lazy->slots || !dfa->attrs || !dfa->pids) {
+        dfa_destroy(dfa);
+        return NULL;
+    }
+
+    return dfa;
+}
+
+static struct dfa_st *dfa_lazy_new(struct nfa_st *nfa, size_t budget)
+{
+    int c;
+    uint32_t t;
+    struct dfa_st *dfa;
+    struct dfa_lazy_st *lazy;
+
+    dfa = dfa_lazy_alloc(budget);
+    if (dfa == NULL) {
+        nfa_destroy(nfa);
+        return NULL;
+    }
+
+    lazy = dfa->lazy;
+    dfa->flags = nfa->flags;
+    lazy->nfa = *nfa;
+    if (lazy->nfa.start == NULL)
+        return dfa;
+
+    lazy->sim = malloc((lazy->nfa.nstate + 1) * sizeof(uint32_t));
+    if (lazy->sim == NULL || nfa_scratch_init(&lazy->sc, &lazy->nfa) < 0)
+        goto errout;
+
+    dfa_lazy_classes(dfa);
+
+    lazy->sc.n = 0;
+    nfa_scratch_add(&lazy->sc, lazy->nfa.start->id);
+    lazy->sc.stack[0] = lazy->nfa.start->id;
+    nfa_eps_closure(&lazy->sc, 1);
+    if (dfa_lazy_add(dfa, nfa_set_hash(lazy->sc.sorted, lazy->sc.n)) != DFA_START)
+        goto errout;
+
+    /* dfa_match needs to know if the start is the only state */
+    dfa->single = 1;
+    for (c = 0; c < N_CHARSET; c++) {
+        t = dfa_lazy_next(dfa, DFA_START, c);
+        if (t != DFA_DEAD && t != DFA_START)
+            dfa->single = 0;
+    }
+    dfa_skip_init(dfa);
+    lazy->simulate = 0;
+
+    return dfa;
+
+errout:
+    dfa_destroy(dfa);
+    return NULL;
+}
+
+/**
+ * compile like mdfa_compile, but build the states while matching, in at
+ * most budget bytes, 0 for the default.
+ */
+void *mdfa_compile_lazy(int n, char **regex, int *flags, size_t budget)
+{
+    struct nfa_st *nfa;
+    struct dfa_st *dfa;
+
+    nfa = malloc(n * sizeof(*nfa));
+    if (nfa == NULL)
+        return NULL;
+
+    if (mdfa_nfa_compile(nfa, n, regex, flags) < 0) {
+        free(nfa);
+        return NULL;
+    }
+
+    dfa = dfa_lazy_new(nfa, budget);
+    if (dfa)
+        dfa->flags |= REF_MULTIREG;
+    free(nfa);
+    return dfa;
+}
+
+void *dfa_compile_lazy(char *regex, int flags, size_t budget)
+{
+    struct nfa_st nfa;
+
+    nfa.nstate = 0;
+    if (nfa_compile(&nfa, 0, regex, flags) < 0)
+        return NULL;
+
+    return dfa_lazy_new(&nfa, budget);
+}
+
+/* the states of fwd kept in the sets of the reverse, the ones not always in */
+static inline int dfa_reverse_kept(uint8_t attrs)
+{
+    return !(attrs & DFA_ACCEPT) || (attrs & DFA_EOL);
+}
+
+/**
+ * the classes of fwd, with '\n' on its own if the flags need it, and the
+ * start state: at the end of text every anchor holds.
+ */
+static int dfa_reverse_init(struct dfa_st *dfa)
+{
+    int c;
+    uint32_t flags;
+    struct dfa_lazy_st *lazy = dfa->lazy;
+    struct dfa_st *fwd = lazy->fwd;
+
+    dfa->nclass = fwd->nclass;
+    memcpy(dfa->classes, fwd->classes, sizeof(dfa->classes));
+    for (c = 0; lazy->eol && c < N_CHARSET; c++) {
+        if (c != '\n' && dfa->classes[c] == dfa->classes['\n']) {
+            dfa->classes['\n'] = dfa->nclass++;
+            break;
+        }
+    }
+
+    lazy->sim = malloc((lazy->nid + DFA_REV_NFLAG) * sizeof(uint32_t));
+    if (lazy->sim == NULL || nfa_scratch_alloc(&lazy->sc, lazy->nid + DFA_REV_NFLAG) < 0)
+        return -1;
+
+    flags = 1 << DFA_REV_ANY;
+    if (lazy->eol)
+        flags |= (1 << DFA_REV_END) | (1 << DFA_REV_LINE) | (1 << DFA_REV_LAST);
+
+    lazy->sc.n = 0;
+    if (fwd->lazy)
+        nfa_reverse_closure(lazy, 0, flags);
+    dfa_reverse_flags_add(lazy, flags);
+    memcpy(lazy->sc.sorted, lazy->sc.dense, lazy->sc.n * sizeof(uint32_t));
+    qsort(lazy->sc.sorted, lazy->sc.n, sizeof(uint32_t), nfa_id_cmp);
+    if (dfa_lazy_add(dfa, nfa_set_hash(lazy->sc.sorted, lazy->sc.n)) != DFA_START)
+        return -1;
+    lazy->simulate = 0;
+
+    return 0;
+}
+
+/**
+ * the reverse of the frozen dfa fwd, with a .* in front, which is built
+ * lazily by the states of fwd, like the lazy dfa by the nfa states.
+ */
+static struct dfa_st *dfa_reverse_new(struct dfa_st *fwd)
+{
+    int all = 1;
+    int ml = 0;
+    uint32_t q, t, k, a;
+    uint32_t n = fwd->nstate + 1;
+    uint32_t np = 3 * fwd->nclass;
+    uint32_t *rnext = NULL;
+    uint32_t *pnext = NULL;
+    struct dfa_st *dfa;
+    struct dfa_lazy_st *lazy;
+
+    dfa = dfa_lazy_alloc(0);
+    if (dfa == NULL)
+        return NULL;
+
+    lazy = dfa->lazy;
+    lazy->fwd = fwd;
+    lazy->nid = n;
+    for (q = DFA_START; q < n; q++) {
+        if (!(fwd->attrs[q] & DFA_ACCEPT))
+            continue;
+        if (fwd->attrs[q] & DFA_EOL)
+            lazy->eol = 1;
+        if (!(fwd->attrs[q] & DFA_BOL))
+            all = 0;
+        if (fwd->attrs[q] & DFA_ML)
+            ml = 1;
+    }
+    lazy->bol = all ? 1 + ml : 0;
+
+    lazy->roffsets = calloc(n + 1, sizeof(uint32_t));
+    lazy->preoffsets = calloc(np + 1, sizeof(uint32_t));
+    rnext = malloc((n + 1) * sizeof(uint32_t));
+    pnext = malloc((np + 1) * sizeof(uint32_t));
+    if (!lazy->roffsets || !lazy->preoffsets || !rnext || !pnext)
+        goto errout;
+
+    /* count the edges, then place them, the states always in are left out */
+    for (q = DFA_START; q < n; q++) {
+        if (!dfa_reverse_kept(fwd->attrs[q]))
+            continue;
+        for (k = 0; k < fwd->nclass; k++) {
+            t = dfa_next_class(fwd, q, k);
+            if (t == DFA_DEAD)
+                continue;
+            if (fwd->attrs[t] & DFA_ACCEPT)
+                lazy->preoffsets[3 * k + dfa_reverse_anchor(fwd->attrs[t]) + 1]++;
+            if (dfa_reverse_kept(fwd->attrs[t]))
+                lazy->roffsets[t + 1]++;
+        }
+    }
+
+    for (t = 0; t < n; t++) {
+        lazy->roffsets[t + 1] += lazy->roffsets[t];
+    }
+    for (a = 0; a < np; a++) {
+        lazy->preoffsets[a + 1] += lazy->preoffsets[a];
+    }
+
+    lazy->redges = malloc(2 * (size_t)lazy->roffsets[n] * sizeof(uint32_t) + 1);
+    lazy->pre = malloc(lazy->preoffsets[np] * sizeof(uint32_t) + 1);
+    if (!lazy->redges || !lazy->pre)
+        goto errout;
+
+    memcpy(rnext, lazy->roffsets, (n + 1) * sizeof(uint32_t));
+    memcpy(pnext, lazy->preoffsets, (np + 1) * sizeof(uint32_t));
+    for (q = DFA_START; q < n; q++) {
+        if (!dfa_reverse_kept(fwd->attrs[q]))
+            continue;
+        for (k = 0; k < fwd->nclass; k++) {
+            t = dfa_next_class(fwd, q, k);
+            if (t == DFA_DEAD)
+                continue;
+            if (fwd->attrs[t] & DFA_ACCEPT)
+                lazy->pre[pnext[3 * k + dfa_reverse_anchor(fwd->attrs[t])]++] = q;
+            if (dfa_reverse_kept(fwd->attrs[t])) {
+                lazy->redges[2 * rnext[t]] = k;
+                lazy->redges[2 * rnext[t] + 1] = q;
+                rnext[t]++;
+            }
+        }
+    }
+
+    free(rnext);
+    free(pnext);
+    rnext = pnext = NULL;
+
+    if (dfa_reverse_init(dfa) < 0)
+        goto errout;
+
+    return dfa;
+
+errout:
+    free(rnext);
+    free(pnext);
+    dfa_destroy(dfa);
+    return NULL;
+}
+
+/**
+ * the reverse of the lazy dfa fwd, built lazily by the nfa states of fwd,
+ * whose dfa states may be dropped while the reverse runs.
+ */
+static struct dfa_st *nfa_reverse_new(struct dfa_st *fwd)
+{
+    int all = 1;
+    int ml = 0;
+    uint32_t i, a;
+    uint32_t n = fwd->lazy->nfa.nstate + 1;
+    uint32_t *rnext = NULL;
+    uint32_t *enext = NULL;
+    uint32_t pnext[DFA_REV_LINE + 2];
+    nfa_state_t *s;
+    nfa_state_t **states = fwd->lazy->sc.states;
+    struct dfa_st *dfa;
+    struct dfa_lazy_st *lazy;
+
+    dfa = dfa_lazy_alloc(0);
+    if (dfa == NULL)
+        return NULL;
+
+    lazy = dfa->lazy;
+    lazy->fwd = fwd;
+    lazy->nid = n;
+    lazy->roffsets = calloc(n + 1, sizeof(uint32_t));
+    lazy->eoffsets = calloc(n + 1, sizeof(uint32_t));
+    lazy->preoffsets = calloc(DFA_REV_LINE + 2, sizeof(uint32_t));
+    rnext = malloc((n + 1) * sizeof(uint32_t));
+    enext = malloc((n + 1) * sizeof(uint32_t));
+    if (!lazy->roffsets || !lazy->eoffsets || !lazy->preoffsets || !rnext || !enext)
+        goto errout;
+
+    /* count the edges into every state, then place them */
+    for (i = 0; i < n; i++) {
+        s = states[i];
+        if (s == NULL)
+            continue;
+
+        if (s->type == NFA_STATE_TYPE_MATCH) {
+            if (s->eol)
+                lazy->eol = 1;
+            if (!s->bol)
+                all = 0;
+            if (s->ml)
+                ml = 1;
+            lazy->preoffsets[(s->eol ? (s->ml ? DFA_REV_LINE : DFA_REV_END) : DFA_REV_ANY) + 1]++;
+        } else if (s->type == NFA_STATE_TYPE_SPLIT) {
+            if (s->out)
+                lazy->eoffsets[s->out->id + 1]++;
+            if (s->out1)
+                lazy->eoffsets[s->out1->id + 1]++;
+        } else if (s->out) {
+            lazy->roffsets[s->out->id + 1]++;
+        }
+    }
+    lazy->bol = all ? 1 + ml : 0;
+
+    for (i = 0; i < n; i++) {
+        lazy->roffsets[i + 1] += lazy->roffsets[i];
+        lazy->eoffsets[i + 1] += lazy->eoffsets[i];
+    }
+    for (a = DFA_REV_ANY; a <= DFA_REV_LINE; a++) {
+        lazy->preoffsets[a + 1] += lazy->preoffsets[a];
+    }
+
+    lazy->redges = malloc(lazy->roffsets[n] * sizeof(uint32_t) + 1);
+    lazy->eedges = malloc(lazy->eoffsets[n] * sizeof(uint32_t) + 1);
+    lazy->pre = malloc(lazy->preoffsets[DFA_REV_LINE + 1] * sizeof(uint32_t) + 1);
+    if (!lazy->redges || !lazy->eedges || !lazy->pre)
+        goto errout;
+
+    memcpy(rnext, lazy->roffsets, (n + 1) * sizeof(uint32_t));
+    memcpy(enext, lazy->eoffsets, (n + 1) * sizeof(uint32_t));
+    memcpy(pnext, lazy->preoffsets, sizeof(pnext));
+    for (i = 0; i < n; i++) {
+        s = states[i];
+        if (s == NULL)
+            continue;
+
+        if (s->type == NFA_STATE_TYPE_MATCH) {
+            lazy->pre[pnext[s->eol ? (s->ml ? DFA_REV_LINE : DFA_REV_END) : DFA_REV_ANY]++] = i;
+        } else if (s->type == NFA_STATE_TYPE_SPLIT) {
+            if (s->out)
+                lazy->eedges[enext[s->out->id]++] = i;
+            if (s->out1)
+                lazy->eedges[enext[s->out1->id]++] = i;
+        } else if (s->out) {
+            lazy->redges[rnext[s->out->id]++] = i;
+        }
+    }
+
+    free(rnext);
+    free(enext);
+    rnext = enext = NULL;
+
+    if (dfa_reverse_init(dfa) < 0)
+        goto errout;
+
+    return dfa;
+
+errout:
+    free(rnext);
+    free(enext);
+    dfa_destroy(dfa);
+    return NULL;
+}
+
+/**
+ * the reverse of dfa built the first time it's needed, NULL if the start
+ * is the only state, whose failed attempts dfa_match skips by itself.
+ */
+static struct dfa_st *dfa_reverse(struct dfa_st *dfa)
+{
+    if (dfa->rev || dfa->single)
+        return dfa->rev;
+
+    if (dfa->lazy && dfa->lazy->nfa.start)
+        dfa->rev = nfa_reverse_new(dfa);
+    else if (dfa->table)
+        dfa->rev = dfa_reverse_new(dfa);
+
+    return dfa->rev;
+}
+
+/**
+ * the state of the reverse at len if the text may go on after it: every
+ * state of fwd still alive there may reach an accept on the text to come,
+ * and the anchors at the end may hold, as the text may end there too.
+ */
+static uint32_t dfa_reverse_open(struct dfa_st *rev)
+{
+    uint32_t q, t;
+    uint64_t hash;
+    struct dfa_lazy_st *lazy = rev->lazy;
+    struct dfa_st *fwd = lazy->fwd;
+
+    lazy->sc.n = 0;
+    for (q = fwd->lazy ? 0 : DFA_START; q < lazy->nid; q++) {
+        if (fwd->lazy ? fwd->lazy->sc.states[q] != NULL : dfa_reverse_kept(fwd->attrs[q]))
+            nfa_scratch_add(&lazy->sc, q);
+    }
+    if (lazy->eol)
+        dfa_reverse_flags_add(lazy, (1 << DFA_REV_END) | (1 << DFA_REV_LINE) | (1 << DFA_REV_LAST));
+
+    /* added in order of id */
+    memcpy(lazy->sc.sorted, lazy->sc.dense, lazy->sc.n * sizeof(uint32_t));
+    hash = nfa_set_hash(lazy->sc.sorted, lazy->sc.n);
+    t = dfa_lazy_find(lazy, hash, lazy->sc.sorted, lazy->sc.n);
+    if (t == DFA_DEAD)
+        t = dfa_lazy_add(rev, hash);
+
+    return t;
+}
+
+/**
+ * mark in bits the pos from pos on where a match may start, by one pass
+ * of the reverse from the end of text, or from len left open if more. the
+ * marks miss no match, and the starts which fail after all are the ones
+ * the reverse can't tell apart: the longest match of a multiline $ may go
+ * past the line end the shorter one stops at, and the sets mixing anchors
+ * are decided by the match of the smallest pid, which the reverse doesn't
+ * follow. left open, the starts alive at len are marked as well.
+ */
+static void dfa_reverse_mark(struct dfa_st *rev, uint8_t *text, int pos, int len, int more, uint64_t *bits)
+{
+    int i;
+    uint32_t s = DFA_START;
+    struct dfa_lazy_st *lazy = rev->lazy;
+
+    lazy->simulate = 0;
+    if (more)
+        s = dfa_reverse_open(rev);
+    for (i = len - 1; i >= pos; i--) {
+        s = dfa_lazy_next(rev, s, text[i]);
+        if (!(rev->attrs[s] & DFA_ACCEPT))
+            continue;
+        if (lazy->bol && i != 0 && (lazy->bol == 1 || text[i - 1] != '\n'))
+            continue;
+        bits[(i - pos) >> 6] |= (uint64_t)1 << ((i - pos) & 63);
+    }
+}
+
+/**
+ * what the searches of one text learned once they cost too much: the pos
+ * where a match may start, marked by the reverse, and the states from
+ * which a longest match found no more accept. it's kept over the searches,
+ * so the steps add up and the reverse runs once.
+ */
+typedef struct dfa_cand_st {
+    int marked;         /** 1 if made, 0 not yet, -1 never */
+    int pos;            /** the pos of bit 0 and ends[0] */
+    int len;
+    int more;           /** the text may go on after len, the marks leave it open */
+    int64_t nstep;      /** the steps of the searches since made */
+    uint32_t nflush;    /** the drops of the lazy dfa cache when made, the ids change */
+    uint64_t *bits;     /** NULL if the dfa has no reverse */
+    uint32_t *ends;
+} dfa_cand_t;
+
+/* the first pos from pos on where a match may start, marked or out of the marks */
+static int dfa_cand_next(dfa_cand_t *cand, int pos)
+{
+    int i = pos - cand->pos;
+    int n = cand->len - cand->pos;
+    uint64_t w;
+
+    if (i < 0 || i >= n)
+        return pos;
+
+    w = cand->bits[i >> 6] >> (i & 63);
+    if (w)
+        return pos + __builtin_ctzll(w);
+
+    for (i = (i >> 6) + 1; i < (n + 63) >> 6; i++) {
+        if (cand->bits[i])
+            return cand->pos + (i << 6) + __builtin_ctzll(cand->bits[i]);
+    }
+
+    return cand->len;
+}
+
+/* ends holds the states of the dfa as they are */
+static inline int dfa_cand_ends(struct dfa_st *dfa, dfa_cand_t *cand)
+{
+    return cand->ends && (dfa->lazy == NULL || (!dfa->lazy->simulate && dfa->lazy->nflush == cand->nflush));
+}
+
+/**
+ * once the searches cost more than DFA_LINEAR_GAIN steps a byte of the text
+ * after from, mark where a match may start from there by one pass of the
+ * reverse, and make room for the ends. they are made again if the text
+ * grew or the ids of the lazy dfa changed since, and the steps ran up again.
+ */
+static void dfa_cand_make(struct dfa_st *dfa, uint8_t *text, int from, int len, dfa_cand_t *cand)
+{
+    if (cand->marked < 0 || from >= len || cand->nstep / DFA_LINEAR_GAIN <= len - from)
+        return;
+    if (cand->marked == 1 && cand->len == len && dfa_cand_ends(dfa, cand))
+        return;
+
+    free(cand->bits);
+    free(cand->ends);
+    cand->bits = NULL;
+    cand->marked = -1;
+    cand->pos = from;
+    cand->len = len;
+    cand->nstep = 0;
+    cand->ends = calloc(len - from, sizeof(uint32_t));
+    if (cand->ends == NULL)
+        return;
+
+    if (dfa_reverse(dfa)) {
+        cand->bits = calloc(((size_t)(len - from) + 63) >> 6, sizeof(uint64_t));
+        if (cand->bits == NULL) {
+            free(cand->ends);
+            cand->ends = NULL;
+            return;
+        }
+        dfa_reverse_mark(dfa->rev, text, from, len, cand->more, cand->bits);
+    }
+
+    if (dfa->lazy)
+        cand->nflush = dfa->lazy->nflush;
+    cand->marked = 1;
+}
+
+/* the ends of the longest match from lo to hi lead to an accept after all */
+static inline void dfa_cand_forget(dfa_cand_t *cand, int lo, int hi)
+{
+    int i;
+
+    for (i = lo; cand->ends && i <= hi; i++) {
+        if (i >= cand->pos && i < cand->len)
+            cand->ends[i - cand->pos] = DFA_DEAD;
     }
+}
 
-    slist_add(&dfa_states,  T);
+/**
+ * start again after start_pos like dfa_restart, only the marked starts are
+ * tried once they are made, so the near misses cost nothing. a marked start
+ * fails only for the cases told at dfa_reverse_mark, which are left to cost
+ * what they cost.
+ */
+static uint32_t dfa_match_restart(struct dfa_st *dfa, uint8_t *text, int pos, int len, int *start_pos,
+        dfa_cand_t *cand)
+{
+    int i;
+    uint32_t s;
 
-    while (slist_del(&dfa_states, &v)) {
-        T = (dfa_state_t *)v;
-        slist_add_tail(&dfa->states,  T);
-        for (i=0; i<nchar; i++) {
-            nfa_move(nfa, T->nfa_set, charset[i], &set);
-            if (slist_empty(&set))
-                continue;
+    dfa_cand_make(dfa, text, *start_pos + 1, len, cand);
 
-            U = dfa_state_create();
-            nfa_eps_closure(nfa, &set, U->nfa_set, U);
-            W = dfa_state_find(U->nfa_set, &dfa_states, &dfa->states);
-            if (W == NULL) {
-                n_dfa_states++;
-                slist_add_tail(&dfa_states,  U);
-                nfa_closure_flush(U->nfa_set);
-            } else {
-                dfa_state_destroy(U, nfa_state_flush);
-                U = W;
-            }
-            T->next[charset[i]] = U;
+    s = dfa_restart(dfa, text, len, start_pos);
+    while (s != DFA_DEAD && cand->bits) {
+        i = dfa_cand_next(cand, *start_pos);
+        if (i == *start_pos)
+            break;
+        if (i >= len) {
+            *start_pos = len;
+            return DFA_DEAD;
         }
+        *start_pos = i - 1;
+        s = dfa_restart(dfa, text, len, start_pos);
     }
 
-    dfa_destroy_nfa(dfa);
-    return n_dfa_states;
+    return s;
 }
 
-void *dfa_compile(char *regex, int flags)
+/**
+ * the $ of the only state failed: the starts up to cur_pos end where
+ * this one does and fail alike, so the next attempt is from cur_pos.
+ */
+static inline void dfa_match_single(struct dfa_st *dfa, int cur_pos, int *start_pos)
 {
-    struct nfa_st nfa;
-    struct dfa_st *dfa;
+    if (dfa->single && cur_pos - 1 > *start_pos)
+        *start_pos = cur_pos - 1;
+}
 
-    dfa = malloc(sizeof(*dfa));
-    if (dfa == NULL) {
-        return NULL;
+/* the anchors of the accept at cur_pos of the match from start_pos hold */
+static inline int dfa_match_anchored(uint8_t attrs, uint8_t *text, int start_pos, int cur_pos, int len)
+{
+    if (attrs & DFA_BOL) {
+        if (attrs & DFA_ML) {
+            if (start_pos >= 1 && text[start_pos - 1] != '\n')
+                return 0;
+        } else if (start_pos != 0) {
+            return 0;
+        }
     }
 
-    dfa->start = NULL;
-    filo_init(&dfa->states);
+    if (attrs & DFA_EOL) {
+        if (attrs & DFA_ML)
+            return cur_pos + 1 == len || text[cur_pos + 1] == '\n';
 
-    if (nfa_compile(&nfa, 0, regex, flags) < 0) {
-        free(dfa);
-        return NULL;
+        return cur_pos + 1 == len || (cur_pos + 1 == len - 1 && text[cur_pos + 1] == '\n');
     }
 
-    nfa2dfa(&nfa, dfa);
-    nfa_destroy(&nfa);
-
-    return dfa;
+    return 1;
 }
 
-void *mdfa_compile(int n, char **regex, int *flags)
+/**
+ * the anchors of the longest match failed, the last shorter accept from
+ * start_pos whose anchors hold is the match, eg. "foo" of "foo|foobar$" in
+ * "foobarbaz". the empty one at start_pos only if it's not a restart. the
+ * text after the longest is there, so a $ before it fails for good.
+ */
+static int dfa_match_shorter(struct dfa_st *dfa, uint8_t *text, int start_pos, int match_pos, int len,
+        int empty, dfa_cand_t *cand, uint32_t *pid)
 {
-    int i;
-    struct nfa_st *nfa;
-    struct dfa_st *dfa;
+    int cur_pos;
+    int end = -1;
+    uint32_t s = DFA_START;
+
+    for (cur_pos = start_pos - 1; cur_pos < match_pos; cur_pos++) {
+        if (cur_pos >= start_pos) {
+            s = dfa_step(dfa, s, text[cur_pos]);
+            cand->nstep++;
+            if (s == DFA_DEAD)
+                break;
+        } else if (!empty) {
+            continue;
+        }
 
-    dfa = malloc(sizeof(*dfa));
-    if (dfa == NULL) {
-        return NULL;
+        if ((dfa->attrs[s] & DFA_ACCEPT)
+                && dfa_match_anchored(dfa->attrs[s], text, start_pos, cur_pos, len)) {
+            end = cur_pos + 1;
+            *pid = dfa->pids[s];
+        }
     }
 
-    dfa->start = NULL;
-    filo_init(&dfa->states);
+    return end;
+}
 
-    nfa = malloc(n * sizeof(*nfa));
-    if (nfa == NULL) {
-        free(dfa);
-        return NULL;
-    }
+#define DFA_RESUME_NONE     0
+#define DFA_RESUME_SEARCH   1           /** the attempt from start_pos has no accept yet */
+#define DFA_RESUME_LONGEST  2           /** it has, and may go on */
+#define DFA_RESUME_EOL      3           /** it ended, its $ waits for the end of text */
+#define DFA_RESUME_SINGLE   4           /** the start after start_pos of the only state */
 
-    if (nfa_compile(nfa, 0, regex[0], flags[0]) < 0) {
-        fprintf(stderr, "compile regex 0 /%s/%x failed\n", regex[0], flags[0]);
-        goto out;
+/* where the search stopped at len with DFA_MATCH_MORE, the pos are in its text */
+typedef struct dfa_resume_st {
+    int phase;
+    int restarted;
+    int start_pos;
+    int cur_pos;
+    int match_pos;      /** the last accept */
+    uint32_t match_pid;
+    uint8_t match_attrs;
+    uint32_t state;     /** the state at cur_pos */
+    uint32_t *set;      /** the set of it if the dfa is lazy, which may drop the state */
+    uint32_t nset;
+} dfa_resume_t;
+
+/* the set of the lazy dfa can hold every nfa state */
+static int dfa_resume_init(struct dfa_st *dfa, dfa_resume_t *resume)
+{
+    memset(resume, 0, sizeof(*resume));
+    if (dfa->lazy) {
+        resume->set = malloc((dfa->lazy->nfa.nstate + 1) * sizeof(uint32_t));
+        if (resume->set == NULL)
+            return -1;
     }
 
-    for (i=1; i<n; i++) {
-        if (nfa_compile(nfa + i, i, regex[i], flags[i]) < 0) {
-            fprintf(stderr, "compile regex %d /%s/%x failed\n", i, regex[i], flags[i]);
-            nfa_destroy(nfa); // nfa[0] had combined nfa[1]...nfa[i-1]
-            goto out;
-        }
+    return 0;
+}
 
-        if (nfa_combine(nfa, nfa + i, nfa) < 0) {
-            fprintf(stderr, "combine regex %d /%s/%x failed\n", i, regex[i], flags[i]);
-            nfa_destroy(nfa); // nfa[0] had combined nfa[1]...nfa[i-1]
-            nfa_destroy(nfa + i);
-            goto out;
-        }
-    }
+static void dfa_resume_save(struct dfa_st *dfa, dfa_resume_t *resume, uint32_t s)
+{
+    struct dfa_lazy_st *lazy = dfa->lazy;
 
-    nfa2dfa(nfa, dfa);
-    dfa->flags |= REF_MULTIREG;
-    nfa_destroy(nfa);
-    free(nfa);
-    return dfa;
-out:
-    free(nfa);
-    free(dfa);
-    return NULL;
+    resume->state = s;
+    if (lazy == NULL)
+        return;
+
+    if (s == DFA_SIMULATE && lazy->simulate) {
+        resume->nset = lazy->nsim;
+        memcpy(resume->set, lazy->sim, lazy->nsim * sizeof(uint32_t));
+    } else {
+        resume->nset = lazy->nsets[s];
+        memcpy(resume->set, lazy->sets[s], lazy->nsets[s] * sizeof(uint32_t));
+    }
 }
 
-int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int flags)
+/* the state saved, cached again by the lazy dfa */
+static uint32_t dfa_resume_state(struct dfa_st *dfa, dfa_resume_t *resume)
 {
-    int cur_pos;
-    int start_pos;
-    int match_pos;
+    uint32_t t;
+    uint64_t hash;
+    struct dfa_lazy_st *lazy = dfa->lazy;
 
-    dfa_state_t *cur_state;
-    dfa_state_t *tmp_state;
-    dfa_state_t *match_state;
+    if (lazy == NULL)
+        return resume->state;
 
-    struct dfa_st *dfa = (struct dfa_st *)prog;
+    lazy->sc.n = resume->nset;
+    memcpy(lazy->sc.sorted, resume->set, resume->nset * sizeof(uint32_t));
+    hash = nfa_set_hash(lazy->sc.sorted, lazy->sc.n);
+    t = dfa_lazy_find(lazy, hash, lazy->sc.sorted, lazy->sc.n);
+    if (t == DFA_DEAD)
+        t = dfa_lazy_add(dfa, hash);
 
-    if (dfa == NULL || text == NULL || len == 0)
-        return -1;
+    return t;
+}
+
+/**
+ * the leftmost longest match in text from pos on, the text before pos is
+ * only looked at by the anchors. with DFA_MATCH_MORE, more text may follow:
+ * DFA_MORE is returned once the result depends on it, resume keeps where
+ * the search stopped and the next call goes on from there with the text
+ * longer, the pos before start_pos no longer needed. -1 is returned with
+ * start set to where the next search starts, and end to DFA_MATCH_RESTART
+ * if it's a restart, which doesn't take the empty match at pos.
+ */
+static int dfa_match_run(struct dfa_st *dfa, uint8_t *text, int pos, int len, int *start, int *end, int flags,
+        dfa_cand_t *cand, dfa_resume_t *resume)
+{
+    int cur_pos;
+    int start_pos;
+    int match_pos = 0;
+    int phase;
+    int lo, memo;
+    int shorter;
+    int more = flags & DFA_MATCH_MORE;
+    int restarted = flags & DFA_MATCH_RESTART;
+
+    uint32_t cur_state;
+    uint32_t tmp_state;
+    uint32_t match_pid = 0;
+    uint32_t shorter_pid = 0;
+    uint8_t match_attrs = 0;
 
     /** process the special case */
     if (dfa->flags & REF_MATCHOMG) {
@@ -3837,29 +6299,78 @@ int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int fl
     }
 
     if (dfa->flags & REF_MATCHEPS) {
-        *start = *end = 0;
+        *start = *end = pos;
         return 0;
     }
 
+    /** the nfa simulation lasts for one match */
+    if (dfa->lazy && dfa->lazy->simulate)
+        dfa->lazy->simulate = 0;
+
+    /* nothing is left before len, unless told otherwise */
+    if (more) {
+        *start = len;
+        *end = DFA_MATCH_RESTART;
+    }
+
+    /* the marks made now are left open */
+    cand->more = more;
+
+    /* go on from where the last search stopped */
+    if (resume && resume->phase != DFA_RESUME_NONE) {
+        phase = resume->phase;
+        resume->phase = DFA_RESUME_NONE;
+        restarted = resume->restarted;
+        start_pos = resume->start_pos;
+        cur_pos = resume->cur_pos;
+        match_pos = resume->match_pos;
+        match_pid = resume->match_pid;
+        match_attrs = resume->match_attrs;
+        cur_state = tmp_state = DFA_DEAD;
+        if (phase == DFA_RESUME_SEARCH || phase == DFA_RESUME_LONGEST)
+            cur_state = tmp_state = dfa_resume_state(dfa, resume);
+
+        if (phase == DFA_RESUME_SEARCH)
+            goto search;
+        else if (phase == DFA_RESUME_LONGEST)
+            goto longest;
+        else if (phase == DFA_RESUME_EOL)
+            goto eol;
+        else
+            goto single;
+    }
+
     /** process the generic case */
-    cur_pos = -1;
-    start_pos = 0;
-    cur_state = dfa->start;
+    cur_pos = pos - 1;
+    start_pos = pos;
+    cur_state = dfa->nstate ? DFA_START : DFA_DEAD;
+    if (restarted && cur_state != DFA_DEAD) {
+        start_pos = pos - 1;
+        cur_state = dfa_restart(dfa, text, len, &start_pos);
+        cur_pos = start_pos;
+    } else if (cand->bits && cur_state != DFA_DEAD && dfa_cand_next(cand, pos) != pos) {
+        /* marked by an earlier search of the text, no match starts at pos */
+        cur_state = dfa_match_restart(dfa, text, pos, len, &start_pos, cand);
+        cur_pos = start_pos;
+        restarted = 1;
+    }
+
     do {
-        if (cur_state == NULL)
+        if (cur_state == DFA_DEAD)
             return -1;
 
-        if (cur_state->accept) {
-            match_state = cur_state;
-            if (match_state->bol) {
-                if (match_state->ml) {
+        if (dfa->attrs[cur_state] & DFA_ACCEPT) {
+            /* the lazy dfa may drop the state, keep what's needed */
+            match_attrs = dfa->attrs[cur_state];
+            match_pid = dfa->pids[cur_state];
+            if (match_attrs & DFA_BOL) {
+                if (match_attrs & DFA_ML) {
                     if (start_pos >= 1 && text[start_pos - 1] != '\n') {
-                        do {
-                            cur_pos = ++start_pos;
-                            if (cur_pos >= len)
-                                return -1;
-                            cur_state = dfa->start->next[text[cur_pos]];
-                        } while (cur_state == NULL);
+                        cur_state = dfa_match_restart(dfa, text, pos, len, &start_pos, cand);
+                        if (cur_state == DFA_DEAD)
+                            return -1;
+                        cur_pos = start_pos;
+                        restarted = 1;
                         continue;
                     }
                 } else {
@@ -3867,12 +6378,11 @@ int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int fl
                         if (!(dfa->flags & REF_MULTIREG))
                             return -1;
 
-                        do {
-                            cur_pos = ++start_pos;
-                            if (cur_pos >= len)
-                                return -1;
-                            cur_state = dfa->start->next[text[cur_pos]];
-                        } while (cur_state == NULL);
+                        cur_state = dfa_match_restart(dfa, text, pos, len, &start_pos, cand);
+                        if (cur_state == DFA_DEAD)
+                            return -1;
+                        cur_pos = start_pos;
+                        restarted = 1;
                         continue;
                     }
                 }
@@ -3881,74 +6391,121 @@ int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int fl
             /** until to the longest match pos */
             match_pos = cur_pos;
             tmp_state = cur_state;
+            dfa_cand_make(dfa, text, start_pos, len, cand);
+longest:
+            /**
+             * the state at a pos whose longest match found no more accept
+             * after it is kept in ends, the dfa goes the same way from there
+             * for every match which gets there in that state.
+             */
+            lo = cur_pos + 1;
+            memo = dfa_cand_ends(dfa, cand);
             while (cur_pos + 1 < len) {
-                tmp_state = tmp_state->next[text[cur_pos + 1]];
-                if (tmp_state) {
+                if (memo && cur_pos + 1 >= cand->pos && cur_pos + 1 < cand->len) {
+                    if (cand->ends[cur_pos + 1 - cand->pos] == tmp_state)
+                        break;
+                    cand->ends[cur_pos + 1 - cand->pos] = tmp_state;
+                }
+                tmp_state = dfa_step(dfa, tmp_state, text[cur_pos + 1]);
+                cand->nstep++;
+                if (tmp_state != DFA_DEAD) {
                     cur_state = tmp_state;
                     cur_pos = cur_pos + 1;
-                    if (cur_state->accept) {
-                        match_state = cur_state;
+                    if (dfa->attrs[cur_state] & DFA_ACCEPT) {
+                        match_attrs = dfa->attrs[cur_state];
+                        match_pid = dfa->pids[cur_state];
                         match_pos = cur_pos;
+                        if (memo) {
+                            dfa_cand_forget(cand, lo, cur_pos);
+                            lo = cur_pos + 1;
+                        }
                     }
+                    /* the ids change if the lazy dfa drops its cache */
+                    if (memo && !dfa_cand_ends(dfa, cand))
+                        memo = 0;
                 } else {
                     break;
                 }
             }
 
-            if (!cur_state->accept)
+            /* still alive at the end, the match may go on */
+            if (more && cur_pos + 1 >= len) {
+                if (memo)
+                    dfa_cand_forget(cand, lo, cur_pos);
+                phase = DFA_RESUME_LONGEST;
+                goto moreout;
+            }
+
+            if (!(dfa->attrs[cur_state] & DFA_ACCEPT))
                 cur_pos = match_pos;
 
-            if (match_state->eol) {
-                if (match_state->ml) {
+eol:
+            /* a shorter accept may hold where the $ of the longest fails */
+            if ((match_attrs & DFA_EOL) && !(more && !(match_attrs & DFA_ML) && cur_pos + 2 >= len)
+                    && !dfa_match_anchored(match_attrs, text, start_pos, cur_pos, len)) {
+                shorter = dfa_match_shorter(dfa, text, start_pos, cur_pos, len, !restarted, cand, &shorter_pid);
+                if (shorter >= 0) {
+                    *start = start_pos;
+                    *end = shorter;
+                    return shorter_pid;
+                }
+            }
+
+            if (match_attrs & DFA_EOL) {
+                if (match_attrs & DFA_ML) {
                     if (!(cur_pos + 1 == len || text[cur_pos + 1] == '\n')) {
-                        do {
-                            cur_pos = ++start_pos;
-                            if (cur_pos >= len)
-                                return -1;
-                            cur_state = dfa->start->next[text[cur_pos]];
-                        } while (cur_state == NULL);
+                        dfa_match_single(dfa, cur_pos, &start_pos);
+                        cur_state = dfa_match_restart(dfa, text, pos, len, &start_pos, cand);
+                        if (cur_state == DFA_DEAD)
+                            return -1;
+                        cur_pos = start_pos;
+                        restarted = 1;
                         continue;
                     }
-                    if (match_state->bol) {
+                    if (match_attrs & DFA_BOL) {
                         if (start_pos >= 1 && text[start_pos - 1] != '\n') {
-                            do {
-                                cur_pos = ++start_pos;
-                                if (cur_pos >= len)
-                                    return -1;
-                                cur_state = dfa->start->next[text[cur_pos]];
-                            } while (cur_state == NULL);
+                            cur_state = dfa_match_restart(dfa, text, pos, len, &start_pos, cand);
+                            if (cur_state == DFA_DEAD)
+                                return -1;
+                            cur_pos = start_pos;
+                            restarted = 1;
                             continue;
                         }
                     }
                 } else {
+                    if (more && cur_pos + 2 >= len) {
+                        phase = DFA_RESUME_EOL;
+                        goto moreout;
+                    }
                     if (!(cur_pos + 1 == len
                                 || (cur_pos + 1 == len - 1
                                     && text[cur_pos + 1] == '\n'))) {
-                        do {
-                            cur_pos = ++start_pos;
-                            if (cur_pos >= len) {
-                                if (dfa->states.nelm == 1
-                                        && match_state->bol == 0) {
-                                    *start = len;
-                                    *end = len;
-                                    return match_state->pid;
+                        dfa_match_single(dfa, cur_pos, &start_pos);
+single:
+                        cur_state = dfa_match_restart(dfa, text, pos, len, &start_pos, cand);
+                        if (cur_state == DFA_DEAD) {
+                            if (dfa->single
+                                    && (match_attrs & DFA_BOL) == 0) {
+                                /* the next start may be in the text after len */
+                                if (more) {
+                                    phase = DFA_RESUME_SINGLE;
+                                    start_pos = len - 1;
+                                    goto moreout;
                                 }
 
-                                return -1;
+                                /**
+                                 * special case for "$" matched with "aaaa"
+                                 * and "a*$" matched with "baaaab".
+                                 */
+                                *start = len;
+                                *end = len;
+                                return match_pid;
                             }
-                            cur_state = dfa->start->next[text[cur_pos]];
-                        } while (cur_state == NULL);
-                        if (dfa->states.nelm == 1
-                                && match_state->bol == 0
-                                && cur_state == NULL) {
-                            /**
-                             * special case for "$" matched with "aaaa"
-                             * and "a*$" matched with "baaaab".
-                             */
-                            *start = len;
-                            *end = len;
-                            return match_state->pid;
+
+                            return -1;
                         }
+                        cur_pos = start_pos;
+                        restarted = 1;
                         continue;
                     }
                 }
@@ -3956,13 +6513,20 @@ int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int fl
 
             *start = start_pos;
             *end = cur_pos + 1;
-            return match_state->pid;
+            return match_pid;
         } else {
-            if (cur_pos + 1 >= len)
-                return -1;
-
-            cur_state = cur_state->next[text[cur_pos + 1]];
-            if (cur_state == NULL) {
+            /* a match may start later if this one runs out of text */
+search:
+            if (cur_pos + 1 < len) {
+                cur_state = dfa_step(dfa, cur_state, text[cur_pos + 1]);
+            } else if (more) {
+                phase = DFA_RESUME_SEARCH;
+                goto moreout;
+            } else
+                cur_state = DFA_DEAD;
+            cand->nstep++;
+
+            if (cur_state == DFA_DEAD) {
                 if ((dfa->flags & REF_MULTIREG) == 0) {
                     if ((dfa->flags & REF_MULTILINE) == 0) {
                         if (dfa->flags & REF_MATCHBOL) {
@@ -3971,12 +6535,11 @@ int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int fl
                     }
                 }
 
-                while (cur_state == NULL) {
-                    cur_pos = ++start_pos;
-                    if (cur_pos >= len)
-                        return -1;
-                    cur_state = dfa->start->next[text[cur_pos]];
-                }
+                cur_state = dfa_match_restart(dfa, text, pos, len, &start_pos, cand);
+                if (cur_state == DFA_DEAD)
+                    return -1;
+                cur_pos = start_pos;
+                restarted = 1;
             } else {
                 cur_pos++;
             }
@@ -3984,6 +6547,299 @@ int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int fl
     } while (cur_pos < len);
 
     return -1;
+
+moreout:
+    *start = start_pos;
+    *end = restarted ? DFA_MATCH_RESTART : 0;
+    resume->phase = phase;
+    resume->restarted = restarted;
+    resume->start_pos = start_pos;
+    resume->cur_pos = cur_pos;
+    resume->match_pos = match_pos;
+    resume->match_pid = match_pid;
+    resume->match_attrs = match_attrs;
+    if (phase == DFA_RESUME_SEARCH || phase == DFA_RESUME_LONGEST)
+        dfa_resume_save(dfa, resume, cur_state);
+    return DFA_MORE;
+}
+
+int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int flags)
+{
+    int ret;
+    dfa_cand_t cand;
+    struct dfa_st *dfa = (struct dfa_st *)prog;
+
+    if (dfa == NULL || (dfa->table == NULL && dfa->lazy == NULL) || text == NULL || len == 0)
+        return -1;
+
+    memset(&cand, 0, sizeof(cand));
+    ret = dfa_match_run(dfa, text, 0, len, start, end, 0, &cand, NULL);
+    free(cand.bits);
+    free(cand.ends);
+    return ret;
+}
+
+/**
+ * call hit for every match in text, from left to right, the next one is
+ * searched from the end of the last one, so they never overlap. return the
+ * number of matches.
+ */
+int dfa_match_all(mdfa_t *prog, uint8_t *text, int len, dfa_hit_t hit, void *data)
+{
+    int pid;
+    int pos = 0;
+    int n = 0;
+    int start, end;
+    dfa_cand_t cand;
+    struct dfa_st *dfa = (struct dfa_st *)prog;
+
+    if (dfa == NULL || (dfa->table == NULL && dfa->lazy == NULL) || text == NULL)
+        return -1;
+
+    /* the searches share the marks, whose pos only go forward */
+    memset(&cand, 0, sizeof(cand));
+    while (pos < len) {
+        pid = dfa_match_run(dfa, text, pos, len, &start, &end, 0, &cand, NULL);
+        if (pid < 0)
+            break;
+
+        n++;
+        if (hit && hit(pid, start, end, data) < 0)
+            break;
+
+        /* step over the empty match, or it's found again */
+        pos = end > start ? end : start + 1;
+    }
+
+    free(cand.bits);
+    free(cand.ends);
+    return n;
+}
+
+typedef struct dfa_count_st {
+    int *counts;
+    int n;
+} dfa_count_t;
+
+static int dfa_count_hit(int pid, int start, int end, void *data)
+{
+    dfa_count_t *count = (dfa_count_t *)data;
+
+    if (pid < count->n)
+        count->counts[pid]++;
+
+    return 0;
+}
+
+/**
+ * add the matches of every pid below n in text to counts, like
+ * dfa_match_all, return the number of matches.
+ */
+int dfa_match_count(mdfa_t *prog, uint8_t *text, int len, int *counts, int n)
+{
+    dfa_count_t count;
+
+    if (counts == NULL)
+        return -1;
+
+    count.counts = counts;
+    count.n = n;
+    return dfa_match_all(prog, text, len, dfa_count_hit, &count);
+}
+
+/**
+ * the matches of a text fed in pieces, the same ones dfa_match_all finds in
+ * the whole text. the search goes on from where it stopped, in the state
+ * it was in, so every byte is stepped once but for the restarts. only the
+ * bytes since the start of the attempt are kept, with the one before for
+ * the anchors, a failed attempt starts again after its start. that's about
+ * the longest match for the keywords, but a pattern like "a.*b" keeps all
+ * since the first 'a', up to INT_MAX bytes.
+ */
+struct dfa_stream_st {
+    struct dfa_st *dfa;
+    dfa_stream_hit_t hit;
+    void *data;
+    int stop;           /** hit asked to stop */
+    int pos;            /** where the next search starts in buffer */
+    int restart;        /** the next search is a restart, DFA_MATCH_RESTART */
+    dfa_resume_t resume;    /** the state, the last accept and the pid of the search stopped at length */
+    dfa_cand_t cand;        /** the marks and ends shared by the searches, like dfa_match_all */
+    int length;         /** the bytes in buffer */
+    int size;           /** the bytes allocated */
+    int64_t base;       /** the offset of buffer[0] in the stream */
+    uint8_t *buffer;
+};
+
+dfa_stream_t *dfa_stream_new(mdfa_t *prog, dfa_stream_hit_t hit, void *data)
+{
+    dfa_stream_t *stream;
+    struct dfa_st *dfa = (struct dfa_st *)prog;
+
+    if (dfa == NULL || (dfa->table == NULL && dfa->lazy == NULL))
+        return NULL;
+
+    stream = malloc(sizeof(dfa_stream_t));
+    if (stream == NULL)
+        return NULL;
+
+    memset(stream, 0, sizeof(dfa_stream_t));
+    stream->dfa = dfa;
+    stream->hit = hit;
+    stream->data = data;
+    if (dfa_resume_init(dfa, &stream->resume) < 0) {
+        free(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+static void dfa_stream_free(dfa_stream_t *stream)
+{
+    free(stream->resume.set);
+    free(stream->cand.bits);
+    free(stream->cand.ends);
+    free(stream->buffer);
+    free(stream);
+}
+
+/**
+ * search the buffer from pos, or go on with the search stopped, and drop
+ * the bytes no search needs again, return the number of matches.
+ */
+static int dfa_stream_search(dfa_stream_t *stream, int more)
+{
+    int pid;
+    int n = 0;
+    int drop;
+    int start, end;
+    dfa_resume_t *resume = &stream->resume;
+
+    while (!stream->stop && (stream->pos < stream->length || resume->phase != DFA_RESUME_NONE)) {
+        pid = dfa_match_run(stream->dfa, stream->buffer, stream->pos,
+                stream->length, &start, &end, more | stream->restart, &stream->cand, resume);
+        if (pid < 0) {
+            /* taken again from there with the text fed next */
+            if (more) {
+                stream->pos = start;
+                stream->restart = end;
+            }
+            break;
+        }
+
+        n++;
+        if (stream->hit && stream->hit(pid, stream->base + start, stream->base + end, stream->data) < 0)
+            stream->stop = 1;
+
+        /* step over the empty match, or it's found again */
+        stream->pos = end > start ? end : start + 1;
+        stream->restart = 0;
+    }
+
+    /* the byte before pos tells the anchors where the line begins */
+    drop = stream->pos > 0 ? stream->pos - 1 : 0;
+    if (drop > 0) {
+        memmove(stream->buffer, stream->buffer + drop, stream->length - drop);
+        stream->length -= drop;
+        stream->pos -= drop;
+        stream->base += drop;
+        resume->start_pos -= drop;
+        resume->cur_pos -= drop;
+        resume->match_pos -= drop;
+        stream->cand.pos -= drop;
+        stream->cand.len -= drop;
+    }
+
+    return n;
+}
+
+/**
+ * append len bytes of text to stream, return the number of matches decided
+ * by them, or -1 on error, or if more than INT_MAX bytes would be kept.
+ */
+int dfa_stream_feed(dfa_stream_t *stream, uint8_t *buf, int len)
+{
+    int size;
+    uint8_t *buffer;
+
+    if (stream == NULL || buf == NULL || len < 0)
+        return -1;
+
+    if (stream->stop || len == 0)
+        return 0;
+
+    /* the pos in buffer are int */
+    if (len > INT_MAX - stream->length)
+        return -1;
+
+    if (stream->length + len > stream->size) {
+        size = stream->length + len;
+        if (stream->size < INT_MAX / 2 && stream->size * 2 > size)
+            size = stream->size * 2;
+        buffer = realloc(stream->buffer, size);
+        if (buffer == NULL)
+            return -1;
+        stream->buffer = buffer;
+        stream->size = size;
+    }
+
+    memcpy(stream->buffer + stream->length, buf, len);
+    stream->length += len;
+    return dfa_stream_search(stream, DFA_MATCH_MORE);
+}
+
+/**
+ * the text ends, report the matches left and free the stream, return the
+ * number of them.
+ */
+int dfa_stream_end(dfa_stream_t *stream)
+{
+    int n;
+
+    if (stream == NULL)
+        return -1;
+
+    n = dfa_stream_search(stream, 0);
+    dfa_stream_free(stream);
+    return n;
+}
+
+/**
+ * call hit for every match in the rest of stream read by stream_read, like
+ * dfa_match_all, return the number of matches, or -1 on error.
+ */
+int dfa_stream_scan(mdfa_t *prog, stream_t *stream, dfa_stream_hit_t hit, void *data)
+{
+    int n = 0;
+    int len;
+    int ret;
+    char *chunk;
+    dfa_stream_t *ds;
+
+    if (stream == NULL)
+        return -1;
+
+    ds = dfa_stream_new(prog, hit, data);
+    chunk = malloc(DFA_STREAM_CHUNK);
+    if (ds == NULL || chunk == NULL)
+        goto errout;
+
+    while (!ds->stop && (len = stream_read(stream, chunk, DFA_STREAM_CHUNK)) > 0) {
+        ret = dfa_stream_feed(ds, (uint8_t *)chunk, len);
+        if (ret < 0)
+            goto errout;
+        n += ret;
+    }
+
+    free(chunk);
+    return n + dfa_stream_end(ds);
+
+errout:
+    free(chunk);
+    if (ds)
+        dfa_stream_free(ds);
+    return -1;
 }
 
 int dfa_nstate(mdfa_t *prog)
@@ -3994,6 +6850,6 @@ int dfa_nstate(mdfa_t *prog)
         return 0;
     }
 
-    return dfa->states.nelm;
+    return dfa->nstate;
 }
 
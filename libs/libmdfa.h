@@ -22,12 +22,29 @@
 #endif
 
 typedef void mdfa_t;
+typedef struct dfa_stream_st dfa_stream_t;
+
+/* called for every match of dfa_match_all, return < 0 to stop */
+typedef int (*dfa_hit_t)(int pid, int start, int end, void *data);
+
+/* the same for dfa_stream_t, the offsets are from the beginning of stream */
+typedef int (*dfa_stream_hit_t)(int pid, int64_t start, int64_t end, void *data);
 
 /* libregex.c */
 extern void dfa_destroy(mdfa_t *prog);
 extern void *dfa_compile(char *regex, int flags);
 extern void *mdfa_compile(int n, char **regex, int *flags);
+extern void *dfa_compile_lazy(char *regex, int flags, size_t budget);
+extern void *mdfa_compile_lazy(int n, char **regex, int *flags, size_t budget);
+extern int dfa_utf8_cased(char *text);
 extern int dfa_match(mdfa_t *prog, uint8_t *text, int len, int *start, int *end, int flags);
+extern int dfa_match_all(mdfa_t *prog, uint8_t *text, int len, dfa_hit_t hit, void *data);
+extern int dfa_match_count(mdfa_t *prog, uint8_t *text, int len, int *counts, int n);
+extern dfa_stream_t *dfa_stream_new(mdfa_t *prog, dfa_stream_hit_t hit, void *data);
+extern int dfa_stream_feed(dfa_stream_t *stream, uint8_t *buf, int len);
+extern int dfa_stream_end(dfa_stream_t *stream);
+extern int dfa_stream_scan(mdfa_t *prog, void *stream, dfa_stream_hit_t hit, void *data);
+extern int dfa_minimize(mdfa_t *prog);
 extern int dfa_nstate(mdfa_t *prog);
 
 #endif
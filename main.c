@@ -437,12 +437,25 @@ static gboolean gbs_menu_save_response(void)
 
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        gbs_dbw_flush();
         ret = gbs_db_write(filename);
         if(ret < 0) {
             gbs_message_dialog(GTK_MESSAGE_ERROR, "Save file failed!", "When write into database %s, sqlite3 exec ret %d", filename, ret);
         } else {
+            /* the snapshot is only a cache of the database, ignore the failure */
+            mbs_t snapfile = mbsnewfmt("%s%s", filename, GBS_SNAPSHOT_SUFFIX);
+            gbs_snapshot_write(filename, snapfile);
+            mbsfree(snapfile);
             g_modify_flag = 0;
             ret = TRUE;
+
+            /* the following mutations go into the saved database */
+            if (g_db_filename == NULL || strcmp(g_db_filename, filename)) {
+                gbs_dbw_start(filename);
+                g_free(g_db_filename);
+                g_db_filename = filename;
+                filename = NULL;
+            }
         }
         g_free(filename);
     }
@@ -510,6 +523,7 @@ static gboolean gbs_menu_new_response(void)
     gbs_sidebar_clear_tree_model();
     gbs_gtk_booklist_update_model_first_page();
 
+    gbs_dbw_stop();
     if (g_db_filename) {
         g_free(g_db_filename);
         g_db_filename = NULL;
@@ -548,6 +562,7 @@ static gboolean gbs_menu_open_response(void)
         gbs_sidebar_clear_tree_model();
         gbs_gtk_booklist_update_model_first_page();
 
+        gbs_dbw_stop();
         if (g_db_filename) {
             g_free(g_db_filename);
             g_db_filename = NULL;
@@ -563,6 +578,11 @@ static gboolean gbs_menu_open_response(void)
             return;
         }
 
+        ret = gbs_dbw_start(filename);
+        if (ret < 0) {
+            gbs_message_dialog (GTK_MESSAGE_WARNING, "open database failed!", "the changes can't be written into <i>%s</i> until it's saved: <i>%s</i>", filename, gbs_err(ret));
+        }
+
         gbs_sidebar_update_tree_model(g_sidebar_flag);
         gbs_gtk_booklist_update_model_first_page();
         if (g_db_filename) {
@@ -1179,6 +1199,7 @@ int main(int argc, char *argv[])
     gtk_window_set_focus(GTK_WINDOW(g_window), g_book_treeview);
     gtk_widget_show_all(g_window);
     gtk_main();
+    gbs_dbw_stop();
 
     if (g_db_filename != NULL) {
         g_free(g_db_filename);